@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+
+#include "llvm/ADT/StringRef.h"
+
+#include "output.hpp"
+#include "parser.hpp"
+#include "query.hpp"
+#include "search.hpp"
+#include "walker.hpp"
+
+namespace fs = boost::filesystem;
+namespace po = boost::program_options;
+
+using bench_clock = std::chrono::steady_clock;
+
+/// The queries every run measures, covering each kind of term and the paths
+/// through the search that matter for speed, for a corpus whose innermost
+/// namespace is 'innermost'
+std::vector<std::string> bench_queries(const std::string& innermost) {
+    return {
+        // Unqualified variable: function bodies must be parsed
+        "int:counter_.*",
+        // Qualified variable: function bodies are skipped
+        innermost + "::int:counter_.*",
+        // Overload resolution over many parameter lists
+        "void:process(int:first, ...)",
+        // Calls into the shared header
+        "int:helper_.*(...)",
+        // Class declarations, including those in the header
+        "#widget_.*",
+        // A name no file contains, so every file is rejected by the
+        // prefilter
+        ".*:no_such_name_anywhere",
+    };
+}
+
+struct QueryResult {
+    std::string query;
+    std::size_t files = 0;
+    std::size_t matches = 0;
+    double seconds = 0;
+    /// Time to search each file, in milliseconds
+    std::vector<double> latencies;
+};
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    auto rank = static_cast<std::size_t>(p / 100 * (values.size() - 1) + 0.5);
+    return values[std::min(rank, values.size() - 1)];
+}
+
+void write_rates(std::ostream& out, std::size_t files, std::size_t matches,
+                 double seconds) {
+    out << "\"files\": " << files << ", \"matches\": " << matches
+        << ", \"seconds\": " << seconds << ", \"files_per_second\": "
+        << (seconds > 0 ? files / seconds : 0) << ", \"matches_per_second\": "
+        << (seconds > 0 ? matches / seconds : 0);
+}
+
+void write_results(std::ostream& out, const std::string& label,
+                   const std::string& corpus, double walk_seconds,
+                   const std::vector<QueryResult>& results) {
+    std::size_t total_files = 0;
+    std::size_t total_matches = 0;
+    double total_seconds = 0;
+    for (const auto& result : results) {
+        total_files += result.files;
+        total_matches += result.matches;
+        total_seconds += result.seconds;
+    }
+
+    out << "{\n"
+        << "  \"label\": " << json_string(label) << ",\n"
+        << "  \"timestamp\": " << std::time(nullptr) << ",\n"
+        << "  \"corpus\": " << json_string(corpus) << ",\n"
+        << "  \"walk_seconds\": " << walk_seconds << ",\n"
+        << "  \"total\": {";
+    write_rates(out, total_files, total_matches, total_seconds);
+    out << "},\n"
+        << "  \"queries\": [\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const auto& result = results[i];
+        out << "    {\"query\": " << json_string(result.query) << ", ";
+        write_rates(out, result.files, result.matches, result.seconds);
+        out << ",\n     \"latency_ms\": {\"p50\": "
+            << percentile(result.latencies, 50)
+            << ", \"p90\": " << percentile(result.latencies, 90)
+            << ", \"p99\": " << percentile(result.latencies, 99)
+            << ", \"max\": " << percentile(result.latencies, 100) << "}}"
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n"
+        << "}\n";
+}
+
+int main(int argc, char** argv) {
+    po::options_description desc("Usage: sas-bench [options] corpus");
+    desc.add_options()                                                      //
+        ("help,h", "Print help messages")                                   //
+        ("corpus", po::value<std::string>(), "Directory of files to search") //
+        ("output,o", po::value<std::string>(),                              //
+         "Write the results as JSON to this file (default: stdout)")        //
+        ("label", po::value<std::string>()->default_value(""),              //
+         "Recorded with the results, e.g., the release being measured")     //
+        ("repeat", po::value<std::size_t>()->default_value(1),              //
+         "Search the corpus this many times for each query")                //
+        ("namespace-depth", po::value<std::size_t>()->default_value(8),     //
+         "The --namespace-depth the corpus was generated with");
+
+    po::positional_options_description p;
+    p.add("corpus", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv)
+                  .options(desc)
+                  .positional(p)
+                  .run(),
+              vm);
+
+    if (vm.count("help") || !vm.count("corpus")) {
+        std::cout << desc << std::endl;
+        return vm.count("help") ? 0 : 1;
+    }
+    po::notify(vm);
+
+    // Searched with the same defaults as the command line tool
+    po::variables_map config;
+
+    // The corpus is walked as 'sas -r' walks it, and only its source files
+    // are searched
+    const auto& corpus = vm["corpus"].as<std::string>();
+    std::vector<std::string> files;
+    auto walk_start = bench_clock::now();
+    walk_paths({corpus}, true, config, [&](const std::string& file) {
+        if (fs::extension(file) == ".cpp") {
+            files.push_back(file);
+        }
+    });
+    std::chrono::duration<double> walk_seconds =
+        bench_clock::now() - walk_start;
+    std::cerr << "walk: " << files.size() << " files in "
+              << walk_seconds.count() << "s" << std::endl;
+
+    auto depth = std::max(vm["namespace-depth"].as<std::size_t>(),
+                          std::size_t{1});
+    std::vector<QueryResult> results;
+    for (const auto& query :
+         bench_queries("ns" + std::to_string(depth - 1))) {
+        QueryResult result;
+        result.query = query;
+        auto term = compile_term(parse_search_string(query, config));
+
+        for (std::size_t r = 0; r < vm["repeat"].as<std::size_t>(); ++r) {
+            for (const auto& file : files) {
+                auto start = bench_clock::now();
+                auto matches = find_matches(file, term, config);
+                std::chrono::duration<double> elapsed =
+                    bench_clock::now() - start;
+
+                result.files += 1;
+                result.matches += matches.size();
+                result.seconds += elapsed.count();
+                result.latencies.push_back(elapsed.count() * 1000);
+            }
+        }
+        std::cerr << query << ": " << result.files << " files, "
+                  << result.matches << " matches in " << result.seconds
+                  << "s" << std::endl;
+        results.push_back(std::move(result));
+    }
+
+    if (vm.count("output")) {
+        std::ofstream out(vm["output"].as<std::string>());
+        write_results(out, vm["label"].as<std::string>(), corpus,
+                      walk_seconds.count(), results);
+    } else {
+        write_results(std::cout, vm["label"].as<std::string>(), corpus,
+                      walk_seconds.count(), results);
+    }
+    return 0;
+}
@@ -0,0 +1,204 @@
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+
+namespace fs = boost::filesystem;
+namespace po = boost::program_options;
+
+/// The shape of a generated corpus. Each source file includes a shared
+/// header and declares its contents inside nested namespaces. The files are
+/// spread over a tree of directories, two levels deep, with up to
+/// 'fan_out' entries in each.
+struct CorpusShape {
+    std::size_t files;
+    std::size_t fan_out;
+    std::size_t namespace_depth;
+    std::size_t overloads;
+    std::size_t template_depth;
+    std::size_t header_size;
+    unsigned seed;
+};
+
+const char* const parameter_types[] = {
+    "int", "double", "const char*", "long", "float", "unsigned", "char",
+    "const std::string&", "std::vector<int>&", "bool",
+};
+
+const std::size_t parameter_type_count =
+    sizeof(parameter_types) / sizeof(parameter_types[0]);
+
+/// A large header every source file includes: records, functions and a
+/// recursive template, so each parse spends most of its time outside the
+/// main file.
+std::string generate_header(const CorpusShape& shape) {
+    std::ostringstream out;
+    out << "#ifndef CORPUS_COMMON\n"
+        << "#define CORPUS_COMMON\n\n"
+        << "#include <string>\n"
+        << "#include <vector>\n\n"
+        << "namespace common {\n\n"
+        << "template <typename T, int N>\n"
+        << "struct fold {\n"
+        << "    static T apply(T value) {\n"
+        << "        return fold<T, N - 1>::apply(value) + value;\n"
+        << "    }\n"
+        << "};\n\n"
+        << "template <typename T>\n"
+        << "struct fold<T, 0> {\n"
+        << "    static T apply(T value) { return value; }\n"
+        << "};\n\n";
+
+    for (std::size_t i = 0; i < shape.header_size; ++i) {
+        out << "struct record_" << i << " {\n"
+            << "    int id;\n"
+            << "    std::string label;\n"
+            << "    std::vector<double> values;\n"
+            << "};\n\n"
+            << "inline int helper_" << i << "(int value, double scale) {\n"
+            << "    return static_cast<int>(value * scale) + " << i << ";\n"
+            << "}\n\n";
+    }
+
+    out << "}\n\n"
+        << "#endif\n";
+    return out.str();
+}
+
+/// Where source file 'index' goes, relative to the corpus
+fs::path source_path(const CorpusShape& shape, std::size_t index) {
+    auto group = index / shape.fan_out;
+    return fs::path("dir_" + std::to_string(group / shape.fan_out)) /
+           ("dir_" + std::to_string(group % shape.fan_out)) /
+           ("file_" + std::to_string(index) + ".cpp");
+}
+
+std::string generate_source(const CorpusShape& shape, std::size_t index,
+                            std::mt19937& random) {
+    std::ostringstream out;
+    out << "#include \"../../common.hpp\"\n\n";
+
+    for (std::size_t depth = 0; depth < shape.namespace_depth; ++depth) {
+        out << "namespace ns" << depth << " {\n";
+    }
+    out << "\n";
+
+    out << "int counter_" << index << " = " << index << ";\n"
+        << "const char* label_" << index << " = \"file " << index << "\";\n\n";
+
+    out << "struct widget_" << index << " {\n"
+        << "    int count;\n"
+        << "    std::string name;\n"
+        << "    common::record_" << index % shape.header_size << " record;\n"
+        << "};\n\n";
+
+    out << "template <typename T, int N>\n"
+        << "struct box_" << index << " {\n"
+        << "    T value[N];\n"
+        << "};\n\n";
+
+    // Overloads differ in their number and types of parameters
+    std::uniform_int_distribution<std::size_t> pick_type(
+        0, parameter_type_count - 1);
+    for (std::size_t i = 0; i < shape.overloads; ++i) {
+        out << "void process(int first";
+        for (std::size_t p = 0; p < i; ++p) {
+            out << ", " << parameter_types[pick_type(random)] << " arg" << p;
+        }
+        out << ") {\n"
+            << "    int local = first;\n"
+            << "    counter_" << index << " += local;\n"
+            << "}\n\n";
+    }
+
+    out << "int run_" << index << "() {\n"
+        << "    widget_" << index << " widget{};\n"
+        << "    box_" << index << "<double, " << shape.template_depth + 1
+        << "> box{};\n"
+        << "    process(widget.count);\n"
+        << "    int total = common::helper_" << index % shape.header_size
+        << "(counter_" << index << ", box.value[0]);\n"
+        << "    return total + common::fold<int, " << shape.template_depth
+        << ">::apply(total);\n"
+        << "}\n\n";
+
+    for (std::size_t depth = shape.namespace_depth; depth > 0; --depth) {
+        out << "}\n";
+    }
+    return out.str();
+}
+
+void write_file(const fs::path& path, const std::string& contents) {
+    std::ofstream out(path.string());
+    if (!out) {
+        throw std::runtime_error(path.string() + ": Unable to write file");
+    }
+    out << contents;
+}
+
+int main(int argc, char** argv) {
+    po::options_description desc("Usage: sas-corpus [options] directory");
+    desc.add_options()                                                      //
+        ("help,h", "Print help messages")                                   //
+        ("directory", po::value<std::string>(), "Where to write the corpus") //
+        ("files", po::value<std::size_t>()->default_value(100),             //
+         "Number of source files")                                          //
+        ("fan-out", po::value<std::size_t>()->default_value(10),            //
+         "Entries in each directory of the tree holding the source files")  //
+        ("namespace-depth", po::value<std::size_t>()->default_value(8),     //
+         "Nesting depth of the namespaces in each source file")             //
+        ("overloads", po::value<std::size_t>()->default_value(16),          //
+         "Overloads of 'process' in each source file")                      //
+        ("template-depth", po::value<std::size_t>()->default_value(64),     //
+         "Recursion depth of the template instantiated by each file")       //
+        ("header-size", po::value<std::size_t>()->default_value(500),       //
+         "Records and functions declared in the shared header")             //
+        ("seed", po::value<unsigned>()->default_value(0),                   //
+         "Seed for the parameter types, so corpora can be reproduced");
+
+    po::positional_options_description p;
+    p.add("directory", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv)
+                  .options(desc)
+                  .positional(p)
+                  .run(),
+              vm);
+
+    if (vm.count("help") || !vm.count("directory")) {
+        std::cout << desc << std::endl;
+        return vm.count("help") ? 0 : 1;
+    }
+    po::notify(vm);
+
+    CorpusShape shape{vm["files"].as<std::size_t>(),
+                      std::max(vm["fan-out"].as<std::size_t>(),
+                               std::size_t{1}),
+                      vm["namespace-depth"].as<std::size_t>(),
+                      vm["overloads"].as<std::size_t>(),
+                      vm["template-depth"].as<std::size_t>(),
+                      std::max(vm["header-size"].as<std::size_t>(),
+                               std::size_t{1}),
+                      vm["seed"].as<unsigned>()};
+
+    fs::path dir = vm["directory"].as<std::string>();
+    std::mt19937 random(shape.seed);
+    try {
+        fs::create_directories(dir);
+        write_file(dir / "common.hpp", generate_header(shape));
+        for (std::size_t i = 0; i < shape.files; ++i) {
+            auto path = dir / source_path(shape, i);
+            fs::create_directories(path.parent_path());
+            write_file(path, generate_source(shape, i, random));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "sas-corpus: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
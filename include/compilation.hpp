@@ -0,0 +1,44 @@
+#ifndef SAS_COMPILATION
+#define SAS_COMPILATION
+
+#include <boost/program_options.hpp>
+#include <string>
+#include <vector>
+
+namespace llvm {
+class StringRef;
+}
+
+namespace po = boost::program_options;
+
+/// How a single file is handed to clang
+struct ParseCommand {
+    /// The absolute path of the file
+    std::string filename;
+    std::vector<std::string> arguments;
+};
+
+/// Load the '-p' compilation database (if any) so that a missing or invalid
+/// database is reported before any file is parsed. Throws
+/// std::runtime_error on failure.
+void load_compilation_database(const po::variables_map& config);
+
+/// The flags 'file' is parsed with, before any precompiled preamble is
+/// added: from the '-p' compilation database, or the defaults for files
+/// that are not in it.
+ParseCommand compile_command(const std::string& file,
+                             const po::variables_map& config);
+
+/// Whether 'file' is parsed with headers that its source does not include,
+/// given by '-include' (or '-imacros' or '-include-pch') in its flags
+bool has_forced_includes(const std::string& file,
+                         const po::variables_map& config);
+
+/// Build the command for parsing 'file', whose contents are 'source'. With
+/// '-p' the flags come from the compilation database, and with '--pch-cache'
+/// files sharing their flags and leading #include block share a precompiled
+/// preamble, which stands in for that block of the file.
+ParseCommand parse_command(const std::string& file, llvm::StringRef source,
+                           const po::variables_map& config);
+
+#endif
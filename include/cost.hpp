@@ -0,0 +1,61 @@
+#ifndef SAS_COST
+#define SAS_COST
+
+#include <cstddef>
+#include <mutex>
+
+namespace clang {
+class ASTContext;
+}
+
+/// The memory a parse takes, for '--mem-budget'. A parse is measured once it
+/// is complete, by the memory held by its AST and source buffers, which
+/// dominate it.
+
+/// Estimates what parsing a file will cost from its size. Before any file
+/// has been measured the estimate grows from a fixed base; afterwards, a
+/// file of the average measured size is expected to cost the average
+/// measured cost, and larger files proportionally more. Estimates include
+/// a margin for the rest of clang's state.
+class CostModel {
+public:
+    std::size_t estimate(std::size_t file_size) const;
+    void record(std::size_t file_size, std::size_t cost);
+
+private:
+    mutable std::mutex m_mutex;
+    std::size_t m_files = 0;
+    double m_total_size = 0;
+    double m_total_cost = 0;
+};
+
+/// Measures the parses run on this thread until destroyed
+class ParseMeasure {
+public:
+    ParseMeasure();
+    ~ParseMeasure();
+
+    ParseMeasure(const ParseMeasure&) = delete;
+    ParseMeasure& operator=(const ParseMeasure&) = delete;
+
+    std::size_t bytes() const { return m_bytes; }
+
+private:
+    friend void record_parse_memory(clang::ASTContext& context);
+
+    std::size_t m_bytes = 0;
+    ParseMeasure* m_parent;
+};
+
+/// The memory held by a parsed AST and the buffers of its source files
+std::size_t ast_memory(clang::ASTContext& context);
+
+/// Called with each complete parse. Does nothing unless a ParseMeasure is
+/// active on this thread.
+void record_parse_memory(clang::ASTContext& context);
+
+/// Hand the memory freed by a parse back to the system, so the process's
+/// RSS follows what is admitted to the budget
+void release_free_memory();
+
+#endif
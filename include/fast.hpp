@@ -0,0 +1,43 @@
+#ifndef SAS_FAST
+#define SAS_FAST
+
+#include <vector>
+
+#include "index.hpp"
+#include "query.hpp"
+
+namespace llvm {
+class StringRef;
+}
+
+/// The '--fast' engine answers a query from the tokens of a file alone: it
+/// runs clang's lexer in raw mode and recognizes declarations by their
+/// shape, without preprocessing, reading includes or running Sema. It is
+/// approximate where only the compiler could know better:
+///
+///  - Code produced by macros is not seen, and preprocessor conditionals
+///    are not evaluated, so both branches of an '#if' are searched.
+///  - Types are spelled as written (e.g., 'auto' or a typedef), not as
+///    clang prints them once deduced or desugared.
+///  - An ambiguous statement such as 'a * b;' is taken as a declaration.
+///  - A call is reported only if the function it calls is declared in the
+///    file (by name and number of arguments), and declarations inside
+///    lambdas are not seen.
+///  - Classes are only found in the file itself, not in its headers.
+///  - Templates are not instantiated, so the members of a class template
+///    are matched once, rather than again for each instantiation.
+
+/// The declarations (in IndexedDecl form) in 'source' that a query could
+/// match, in the order a search reports them: variables (including
+/// parameters and static members, but not other members), functions,
+/// calls and classes
+std::vector<IndexedDecl> lex_declarations(llvm::StringRef source);
+
+/// Whether a recognized declaration matches a term, as the clang matchers
+/// would match the declaration it stands for
+bool lexed_match(const IndexedDecl& decl, const CompiledVariable& term);
+bool lexed_match(const IndexedDecl& decl, const CompiledFunction& term);
+bool lexed_match(const IndexedDecl& decl, const CompiledClass& term);
+bool lexed_match(const IndexedDecl& decl, const CompiledTerm& term);
+
+#endif
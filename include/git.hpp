@@ -0,0 +1,70 @@
+#ifndef SAS_GIT
+#define SAS_GIT
+
+#include <boost/program_options.hpp>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/IntrusiveRefCntPtr.h"
+
+namespace clang {
+namespace vfs {
+class FileSystem;
+}
+}
+
+namespace llvm {
+class MemoryBuffer;
+}
+
+namespace po = boost::program_options;
+
+// '--rev' and '--since' ask the repository in the working directory, by
+// running git: the files of a revision are listed by 'git ls-tree' and read
+// from the object database by a 'git cat-file --batch' kept running for the
+// whole search, so a revision is searched without checking it out. The
+// headers its files include are read from the revision as well.
+
+/// Find the '--rev' revision (if any), so that an unknown revision is
+/// reported before any file is searched. Throws std::runtime_error on
+/// failure.
+void load_revision(const po::variables_map& config);
+
+/// The files under 'paths' (which are relative to the working directory)
+/// in the '--rev' revision, to be searched instead of those in the working
+/// tree. Throws std::runtime_error on failure.
+std::vector<std::string> revision_files(const std::vector<std::string>& paths,
+                                        const po::variables_map& config);
+
+/// The content of a file in the '--rev' revision, handed to clang as the
+/// file's source. Throws std::runtime_error if the revision has no such
+/// file.
+std::unique_ptr<llvm::MemoryBuffer>
+read_revision_file(const std::string& file, const po::variables_map& config);
+
+/// The file system clang reads the headers of a '--rev' search from:
+/// paths in the repository are those of the revision (so a header that is
+/// not in the revision is missing, even if it is in the working tree), and
+/// all others (e.g., system headers) are read from disk
+llvm::IntrusiveRefCntPtr<clang::vfs::FileSystem>
+revision_file_system(const po::variables_map& config);
+
+/// The files changed since the '--since' revision: in the '--rev'
+/// revision, or else in the working tree (which includes untracked files
+/// that are not ignored). Deleted files are not included.
+class ChangedFiles {
+public:
+    /// Throws std::runtime_error on failure
+    explicit ChangedFiles(const po::variables_map& config);
+
+    bool contains(const std::string& file) const;
+
+private:
+    std::string m_directory;
+    /// Absolute paths
+    std::set<std::string> m_files;
+};
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef SAS_IGNORE
+#define SAS_IGNORE
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/// A single pattern from an ignore file, in the .gitignore syntax
+struct IgnoreRule {
+    std::string pattern;
+    bool negated = false;
+    /// Only matches directories (the pattern ended with a '/')
+    bool directory_only = false;
+    /// Matched against the path relative to the ignore file's directory,
+    /// rather than against the name alone (the pattern contained a '/')
+    bool anchored = false;
+};
+
+/// The rules of the ignore files in one directory, chained to those of the
+/// directories above it
+struct IgnoreList {
+    /// The directory, without a trailing '/'
+    std::string base;
+    std::vector<IgnoreRule> rules;
+    std::shared_ptr<const IgnoreList> parent;
+};
+
+/// Match a glob against a path: '*' and '?' never match a '/', while '**'
+/// matches across directories
+bool glob_match(const std::string& pattern, const std::string& text);
+
+/// Parse a line of an ignore file. Returns false for blank lines and
+/// comments, which hold no rule.
+bool parse_ignore_rule(std::string line, IgnoreRule& rule);
+
+/// Add the rules of an ignore file to 'rules'. A file that cannot be read
+/// adds nothing.
+void read_ignore_file(const std::string& path,
+                      std::vector<IgnoreRule>& rules);
+
+/// Whether 'path' (named 'name') is ignored. Deeper ignore files take
+/// precedence, and within a file the last matching pattern decides.
+bool is_ignored(const IgnoreList* list, const std::string& path,
+                const std::string& name, bool is_directory);
+
+#endif
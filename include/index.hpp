@@ -0,0 +1,147 @@
+#ifndef SAS_INDEX
+#define SAS_INDEX
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "query.hpp"
+#include "search.hpp"
+
+/// A declaration (or call of a declared function) that a query could match,
+/// as recorded in the on-disk index.
+struct IndexedDecl {
+    enum Kind : std::uint8_t {
+        VariableKind,
+        FunctionKind,
+        CallKind,
+        RecordKind
+    };
+    enum ContextKind : std::uint8_t {
+        NamespaceContext,
+        RecordContext,
+        OtherContext
+    };
+
+    Kind kind;
+    std::string name;
+
+    /// The variable type or function return type
+    std::string type;
+
+    /// Enclosing named contexts, innermost first
+    std::vector<std::pair<ContextKind, std::string>> qualifiers;
+
+    /// (type, name) of each function parameter
+    std::vector<std::pair<std::string, std::string>> parameters;
+
+    match_t range;
+
+    /// The first line of the match, as it would be printed
+    std::string line;
+};
+
+/// Checks a declaration against a term, mirroring the clang matchers in
+/// matchers.hpp, for the engines that record declarations rather than
+/// matching an AST: the index and '--fast'. 'Decl' reads the fields of a
+/// declaration however it is stored, providing:
+///
+///   IndexedDecl::Kind kind()
+///   name(), type()
+///   std::size_t qualifier_count()
+///   IndexedDecl::ContextKind qualifier_kind(i), qualifier_name(i)
+///   std::size_t parameter_count()
+///   parameter_type(i), parameter_name(i)
+///
+/// where the names and types are anything a CompiledRegex matches, and
+/// qualifiers are innermost first.
+template <typename Decl>
+class DeclMatcher : public boost::static_visitor<bool> {
+public:
+    explicit DeclMatcher(const Decl& decl) : m_decl(decl) {}
+
+    bool operator()(const CompiledVariable& v) const {
+        return m_decl.kind() == IndexedDecl::VariableKind &&
+               v.name.match(m_decl.name()) && v.type.match(m_decl.type()) &&
+               matches_qualifiers(v.qualifiers);
+    }
+
+    bool operator()(const CompiledFunction& f) const {
+        return (m_decl.kind() == IndexedDecl::FunctionKind ||
+                m_decl.kind() == IndexedDecl::CallKind) &&
+               f.name.match(m_decl.name()) &&
+               f.return_type.match(m_decl.type()) &&
+               matches_qualifiers(f.qualifiers) &&
+               f.parameters.matches(
+                   m_decl.parameter_count(),
+                   [this](const CompiledParameter& param, std::size_t i) {
+                       return param.name.match(m_decl.parameter_name(i)) &&
+                              param.type.match(m_decl.parameter_type(i));
+                   });
+    }
+
+    bool operator()(const CompiledClass& c) const {
+        return m_decl.kind() == IndexedDecl::RecordKind &&
+               c.name.match(m_decl.name());
+    }
+
+private:
+    bool matches_qualifiers(
+        const std::vector<CompiledQualifier>& qualifiers) const {
+        if (qualifiers.size() > m_decl.qualifier_count()) {
+            return false;
+        }
+        for (std::size_t i = 0; i < qualifiers.size(); ++i) {
+            const auto& qual = qualifiers[qualifiers.size() - 1 - i];
+            auto kind = m_decl.qualifier_kind(i);
+            if (qual.which() == 0) {
+                if (kind != IndexedDecl::NamespaceContext ||
+                    !boost::get<CompiledNamespace>(qual).name.match(
+                        m_decl.qualifier_name(i))) {
+                    return false;
+                }
+            } else if (qual.which() == 1) {
+                if (kind != IndexedDecl::RecordContext ||
+                    !boost::get<CompiledClass>(qual).name.match(
+                        m_decl.qualifier_name(i))) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    const Decl& m_decl;
+};
+
+/// Parse a file and return every declaration in it that a Variable,
+/// Function or Class query could match, in the order a search reports them.
+/// Given 'dependencies', the other files the parse read (its headers, and
+/// any PCH) are added to them.
+std::vector<IndexedDecl>
+collect_declarations(const std::string& file, const po::variables_map& config,
+                     std::vector<std::string>* dependencies = nullptr);
+
+/// Write (or update) the index in 'index_dir' so it covers 'files'. A file
+/// is not parsed again if its content, path and compile flags are those of
+/// an object in the index, and none of the files that object was parsed
+/// from has changed since.
+void build_index(const std::string& index_dir,
+                 const std::vector<std::string>& files,
+                 const po::variables_map& config);
+
+using indexed_matches_t =
+    std::vector<std::pair<std::string, std::vector<match_t>>>;
+
+/// Answer a query from an index without running clang. Returns the matches
+/// for each indexed file that has any, in index order.
+indexed_matches_t find_indexed_matches(const std::string& index_dir,
+                                       const CompiledTerm& term);
+
+/// Write the matches from an index to 'sink', each indexed file with
+/// matches taking the next file ID
+void print_indexed_matches(const std::string& index_dir,
+                           const CompiledTerm& term, OutputSink& sink);
+
+#endif
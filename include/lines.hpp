@@ -0,0 +1,46 @@
+#ifndef SAS_LINES
+#define SAS_LINES
+
+#include <cstddef>
+#include <vector>
+
+namespace llvm {
+class StringRef;
+}
+
+/// The lines of a source buffer, found in a single pass so that looking up
+/// the line of an offset, or the text of a range of lines, is a binary
+/// search. Lines are numbered from 1, as clang numbers them: a line ends
+/// with '\n', '\r', "\r\n" or "\n\r". Their text is sliced from the
+/// buffer, which must outlive the index.
+class LineIndex {
+public:
+    explicit LineIndex(llvm::StringRef buffer);
+
+    /// The buffer the index was built from
+    const char* data() const { return m_data; }
+
+    std::size_t size() const { return m_starts.size(); }
+
+    /// The line holding 'offset'
+    std::size_t line_of(std::size_t offset) const;
+
+    /// The offset at which 'line' starts
+    std::size_t start_of(std::size_t line) const { return m_starts[line - 1]; }
+
+    /// The text of 'line', without its line ending
+    llvm::StringRef line(std::size_t line) const;
+
+    /// The text from the start of 'first' to the end of 'last', including
+    /// the line endings between them
+    llvm::StringRef lines(std::size_t first, std::size_t last) const;
+
+private:
+    std::size_t end_of(std::size_t line) const;
+
+    const char* m_data;
+    std::size_t m_size;
+    std::vector<unsigned> m_starts;
+};
+
+#endif
@@ -1,116 +1,191 @@
 #ifndef SAS_MATCHERS
 #define SAS_MATCHERS
 
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
 #include "clang/ASTMatchers/ASTMatchers.h"
 #include "clang/ASTMatchers/ASTMatchFinder.h"
 
+#include "query.hpp"
 #include "search.hpp"
+#include "stats.hpp"
 
 namespace clang {
 
 namespace ast_matchers {
 
-AST_MATCHER_P(NamedDecl, matchesUnqualifiedName, std::string, RegExp) {
-    assert(!RegExp.empty());
-    std::string FullNameString = Node.getNameAsString();
-    llvm::Regex RE(RegExp);
-    return RE.match(FullNameString);
+/// Whether a declaration was expanded in the main file or, with 'headers',
+/// in any file it includes other than a system header
+AST_MATCHER_P(Decl, isExpansionInSearchedFile, bool, headers) {
+    auto& sm = Finder->getASTContext().getSourceManager();
+    auto location = sm.getExpansionLoc(Node.getLocStart());
+    if (location.isInvalid()) {
+        return false;
+    }
+    return sm.isInMainFile(location) ||
+           (headers && !sm.isInSystemHeader(location));
 }
 
-AST_MATCHER_P(QualType, matchesType, std::string, RegExp) {
-    assert(!RegExp.empty());
-    llvm::Regex RE(RegExp);
-    return RE.match(Node.getAsString());
+/// Placed first, so a file whose limit is reached stops matching at once
+AST_MATCHER_P(Decl, untilStopped, const FileLimit*, limit) {
+    return !limit->stopped();
 }
 
-AST_MATCHER_P(ParmVarDecl, matchesParameter, ExplicitParameter, param) {
-    auto matcher = parmVarDecl(allOf(matchesUnqualifiedName(param.name),
-                                     hasType(matchesType(param.type)),
-                                     unless(isImplicit())));
-    return matcher.matches(Node, Finder, Builder);
+/// As untilStopped, for a parse whose headers have limits of their own
+AST_MATCHER_P(Decl, untilRunStopped, const FileLimit*, limit) {
+    return !limit->run_stopped();
 }
 
-AST_MATCHER_P(FunctionDecl, matchesParameters, std::vector<FunctionParameter>,
-              parameters) {
-    bool ellipses_active = false;
-    auto iter = Node.param_begin();
-    for (const auto& p : parameters) {
-        if (p.which() == 1) {
-            ellipses_active = true;
-            continue;
-        }
-        if (iter == Node.param_end()) {
-            return false;
+AST_MATCHER_P(NamedDecl, matchesUnqualifiedName, CompiledRegex, RegExp) {
+    assert(!RegExp.pattern().empty());
+    return count_evaluation(Counter::UnqualifiedName,
+                            RegExp.match(Node.getNameAsString()));
+}
+
+/// The spelling of each type, and whether it matched each type regex, for
+/// one translation unit. Types are keyed by their QualType, which keeps
+/// their qualifiers and sugar (e.g., typedefs), so each spelling is exactly
+/// what getAsString() gives. A type is printed once, and matched once by
+/// each regex, however many declarations use it.
+class TypeMatchCache {
+public:
+    bool match(const CompiledRegex& regex, QualType type) {
+        auto key = std::make_pair(regex.id(), type.getAsOpaquePtr());
+        auto iter = m_results.find(key);
+        if (iter != m_results.end()) {
+            return iter->second;
         }
 
-        auto matcher = matchesParameter(boost::get<ExplicitParameter>(p));
-        if (!matcher.matches(**iter, Finder, Builder)) {
-            if (!ellipses_active) {
-                return false;
-            } else {
-                ++iter;
-            }
-        } else {
-            ++iter;
-            ellipses_active = false;
+        auto spelling = m_spellings.find(type.getAsOpaquePtr());
+        if (spelling == m_spellings.end()) {
+            spelling = m_spellings
+                           .emplace(type.getAsOpaquePtr(), type.getAsString())
+                           .first;
         }
+        auto matched = regex.match(spelling->second);
+        m_results.emplace(key, matched);
+        return matched;
     }
-    if (iter != Node.param_end() && !ellipses_active) {
-        return false;
+
+    void clear() {
+        m_spellings.clear();
+        m_results.clear();
     }
-    return true;
+
+private:
+    using key_t = std::pair<const void*, const void*>;
+
+    struct KeyHash {
+        std::size_t operator()(const key_t& key) const {
+            std::hash<const void*> hash;
+            return hash(key.first) * 31 + hash(key.second);
+        }
+    };
+
+    std::unordered_map<const void*, std::string> m_spellings;
+    std::unordered_map<key_t, bool, KeyHash> m_results;
+};
+
+AST_MATCHER_P2(QualType, matchesType, CompiledRegex, RegExp,
+               std::shared_ptr<TypeMatchCache>, types) {
+    assert(!RegExp.pattern().empty());
+    return count_evaluation(Counter::Type, types->match(RegExp, Node));
 }
 
-AST_MATCHER_P(NamespaceDecl, matchesNamespace, Namespace, ns) {
-    llvm::Regex RE(ns.name);
-    return RE.match(Node.getNameAsString());
+/// Checked directly rather than through a matcher, so no matcher is built
+/// for each parameter of each candidate function
+inline bool parameterMatches(const CompiledParameter& param,
+                             const ParmVarDecl& decl, TypeMatchCache& types) {
+    return count_evaluation(Counter::Parameter,
+                            !decl.isImplicit() &&
+                                param.name.match(decl.getNameAsString()) &&
+                                types.match(param.type, decl.getType()));
 }
 
-AST_MATCHER_P(RecordDecl, matchesClass, Class, cls) {
-    llvm::Regex RE(cls.name);
-    return RE.match(Node.getNameAsString());
+AST_MATCHER_P2(FunctionDecl, matchesParameters, ParameterPattern, pattern,
+               std::shared_ptr<TypeMatchCache>, types) {
+    auto matched = pattern.matches(
+        Node.getNumParams(), [&](const CompiledParameter& param, unsigned i) {
+            return parameterMatches(param, *Node.getParamDecl(i), *types);
+        });
+    return count_evaluation(Counter::Parameters, matched);
 }
 
-AST_MATCHER_P(NamedDecl, matchesQualifiers, std::vector<Qualifier>,
-              qualifiers) {
-    auto context = Node.getDeclContext();
+AST_MATCHER_P(NamespaceDecl, matchesNamespace, CompiledNamespace, ns) {
+    return count_evaluation(Counter::Namespace,
+                            ns.name.match(Node.getNameAsString()));
+}
 
-    std::vector<const DeclContext*> contexts;
+AST_MATCHER_P(RecordDecl, matchesClass, CompiledClass, cls) {
+    return count_evaluation(Counter::Class,
+                            cls.name.match(Node.getNameAsString()));
+}
 
-    while (context && isa<NamedDecl>(context)) {
-        contexts.push_back(context);
-        context = context->getParent();
+/// Results of a matcher for the nodes it has already been evaluated on. A
+/// cache is created along with the matchers for one translation unit, so
+/// its keys never outlive their AST.
+template <typename T>
+using MatchCache = std::unordered_map<const T*, bool>;
+
+/// Evaluate 'InnerMatcher' once per function declaration, however many call
+/// sites refer to it. 'InnerMatcher' must not bind any nodes, since only
+/// whether it matched is remembered.
+AST_MATCHER_P2(FunctionDecl, memoizedFunction, internal::Matcher<FunctionDecl>,
+               InnerMatcher, std::shared_ptr<MatchCache<FunctionDecl>>,
+               cache) {
+    auto iter = cache->find(&Node);
+    if (iter != cache->end()) {
+        return iter->second;
     }
+    auto matched = InnerMatcher.matches(Node, Finder, Builder);
+    cache->emplace(&Node, matched);
+    return matched;
+}
 
-    if (qualifiers.size() > contexts.size()) {
-        return false;
+/// Every declaration in the same context has the same qualifiers, so the
+/// context chain is matched once per context, via 'cache'
+AST_MATCHER_P2(NamedDecl, matchesQualifiers, std::vector<CompiledQualifier>,
+               qualifiers, std::shared_ptr<MatchCache<DeclContext>>, cache) {
+    auto context = Node.getDeclContext();
+    auto iter = cache->find(context);
+    if (iter != cache->end()) {
+        return iter->second;
     }
 
-    for (std::size_t i = 0; i < qualifiers.size(); ++i) {
-        const auto& qual = qualifiers[qualifiers.size() - 1 - i];
-        if (qual.which() == 0) {
-            if (const auto* ND = dyn_cast<NamespaceDecl>(contexts[i])) {
-                auto ns = boost::get<Namespace>(qual);
-                auto matcher = matchesNamespace(ns);
-                if (!matcher.matches(*ND, Finder, Builder)) {
-                    return false;
-                }
-            } else {
+    // The innermost context must match the last qualifier, and so on out
+    auto match_chain = [&] {
+        auto current = context;
+        for (auto qual = qualifiers.rbegin(); qual != qualifiers.rend();
+             ++qual) {
+            if (!current || !isa<NamedDecl>(current)) {
                 return false;
             }
-        } else if (qual.which() == 1) {
-            if (const auto* RD = dyn_cast<RecordDecl>(contexts[i])) {
-                auto cls = boost::get<Class>(qual);
-                auto matcher = matchesClass(cls);
-                if (!matcher.matches(*RD, Finder, Builder)) {
+            if (qual->which() == 0) {
+                const auto* ND = dyn_cast<NamespaceDecl>(current);
+                auto matcher =
+                    matchesNamespace(boost::get<CompiledNamespace>(*qual));
+                if (!ND || !matcher.matches(*ND, Finder, Builder)) {
+                    return false;
+                }
+            } else if (qual->which() == 1) {
+                const auto* RD = dyn_cast<RecordDecl>(current);
+                auto matcher = matchesClass(boost::get<CompiledClass>(*qual));
+                if (!RD || !matcher.matches(*RD, Finder, Builder)) {
                     return false;
                 }
-            } else {
-                return false;
             }
+            current = current->getParent();
         }
-    }
-    return true;
+        return true;
+    };
+
+    auto matched = count_evaluation(Counter::Qualifiers, match_chain());
+    cache->emplace(context, matched);
+    return matched;
 }
 }
 }
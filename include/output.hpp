@@ -0,0 +1,155 @@
+#ifndef SAS_OUTPUT
+#define SAS_OUTPUT
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "lines.hpp"
+#include "search.hpp"
+
+namespace llvm {
+class StringRef;
+}
+
+/// The '--format' of the output:
+///
+/// - text: 'row:column:line' for each match (prefixed by the query and a
+///   tab in a batch)
+/// - ndjson: one JSON object per match, with the file, file_id, query_id,
+///   range ([start row, start column, end row, end column]) and line
+/// - json: a single array with one object per file that has matches,
+///   holding its file, file_id and an array of matches
+/// - binary: the bytes "SASM" and a uint32 version, followed by records
+///   starting with a uint8 type. A file record (1) holds a uint32 file_id,
+///   a uint32 path length and the path; a match record (2) holds a uint32
+///   file_id, a uint32 query_id and four int32 giving the range. A file
+///   record precedes the first match record for that file. Integers are in
+///   host byte order.
+///
+/// '-l' and '-c' replace the format with a line per file: its path (only if
+/// it has matches), or its path, a colon and its number of matches.
+enum class OutputFormat {
+    Text,
+    Json,
+    NDJson,
+    Binary,
+    FilesWithMatches,
+    Count
+};
+
+/// Throws std::invalid_argument for an unknown format, or one combined with
+/// '-l' or '-c'
+OutputFormat output_format(const po::variables_map& config);
+
+/// The source printed around each match: '-B' lines before it, '-A' lines
+/// after it and, with '--full-range', every line of the match rather than
+/// only its first. In the text format, a line of context is printed as
+/// 'row-line', a further line of the match as 'row:line', and groups of
+/// lines that are not adjacent are separated by '--'. The JSON formats hold
+/// the lines before and after a match in its "before" and "after" strings,
+/// and the lines of the match in its "line".
+struct SourceContext {
+    std::size_t before = 0;
+    std::size_t after = 0;
+    bool full_range = false;
+};
+
+SourceContext source_context(const po::variables_map& config);
+
+/// Formats the matches found in one file into a single buffer, so the file
+/// can be written in one go, without allocating for each match.
+class MatchWriter {
+public:
+    MatchWriter(OutputFormat format, const std::string& file,
+                std::size_t file_id, const SourceContext& context = {});
+
+    /// 'tag' prefixes the match in the text format (the query, in a batch)
+    void write(const match_t& range, llvm::StringRef line,
+               std::size_t query_id, llvm::StringRef tag);
+
+    /// Write a match in 'source', the buffer of the writer's file, from
+    /// which its lines and those around it are sliced as the SourceContext
+    /// asks. The buffer's lines are indexed once, on its first match.
+    void write_in_source(const match_t& range, llvm::StringRef source,
+                         std::size_t query_id, llvm::StringRef tag);
+
+    /// The formatted matches; empty if none were written
+    std::string finish();
+
+private:
+    void write_match(const match_t& range, llvm::StringRef line,
+                     llvm::StringRef before, llvm::StringRef after,
+                     std::size_t query_id, llvm::StringRef tag);
+    /// Write the lines after the last match that come before 'line'
+    void write_after_context(std::size_t line);
+    /// Write the rest of the last match's context, so the next match starts
+    /// a new group
+    void end_group();
+    void append_line(llvm::StringRef tag, std::size_t row, char separator,
+                     llvm::StringRef line);
+    void append_number(long long value);
+    void append_uint32(std::uint32_t value);
+
+    OutputFormat m_format;
+    std::string m_file;
+    std::size_t m_file_id;
+    SourceContext m_context;
+    std::size_t m_count = 0;
+    std::string m_buffer;
+    std::unique_ptr<LineIndex> m_lines;
+    /// Whether any match has been written in the text format
+    bool m_written = false;
+    /// The first line of the last match, and the last line of source
+    /// written around it in the text format (or 0, once its group ended)
+    std::size_t m_last_first = 0;
+    std::size_t m_last_line = 0;
+    /// The last line after the last match to write, once it is known not to
+    /// be part of the next match, and that match's tag
+    std::size_t m_after_end = 0;
+    std::string m_after_tag;
+};
+
+/// Append 'str' to 'out' as a JSON string, quoted and with quotes,
+/// backslashes and control characters escaped
+void append_json_string(std::string& out, llvm::StringRef str);
+
+/// 'str' as a JSON string, as append_json_string() writes it
+std::string json_string(llvm::StringRef str);
+
+/// Combine the formatted matches of several files into one, as if each had
+/// been written to an OutputSink in turn
+std::string join_formatted(OutputFormat format,
+                           const std::vector<std::string>& formatted);
+
+/// Writes each file's formatted matches to a stream, in file order, with
+/// whatever the format needs around them (e.g., the brackets and commas of
+/// a JSON array). The stream is flushed once at least 'flush_size' bytes
+/// have been written since it last was, rather than after every file, and
+/// the output is complete once the sink is destroyed.
+class OutputSink {
+public:
+    OutputSink(std::ostream& out, OutputFormat format);
+    ~OutputSink();
+
+    OutputSink(const OutputSink&) = delete;
+    OutputSink& operator=(const OutputSink&) = delete;
+
+    /// Given the 'file' the output is from, the time spent writing it is
+    /// counted in the file's '--stats'
+    void write(const std::string& formatted, const std::string& file = {});
+
+    OutputFormat format() const { return m_format; }
+
+    static const std::size_t flush_size = 64 * 1024;
+
+private:
+    std::ostream& m_out;
+    OutputFormat m_format;
+    bool m_empty = true;
+    std::size_t m_unflushed = 0;
+};
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef SAS_QUERY
+#define SAS_QUERY
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "parser.hpp"
+
+namespace llvm {
+class Regex;
+class StringRef;
+}
+
+/// A regular expression from the search string, compiled once when the
+/// query is built and shared (read-only) by every matcher and worker.
+class CompiledRegex {
+public:
+    /// Throws std::invalid_argument if the pattern is not a valid regex
+    explicit CompiledRegex(const std::string& pattern);
+
+    bool match(llvm::StringRef text) const;
+    const std::string& pattern() const { return m_pattern; }
+
+    /// Identifies the compiled regex, which copies share
+    const void* id() const { return m_regex.get(); }
+
+    /// Runs of identifier characters that appear in every string this regex
+    /// matches. Empty when nothing is required (e.g., '.*' or 'a|b').
+    const std::vector<std::string>& required_literals() const {
+        return m_literals;
+    }
+
+private:
+    std::string m_pattern;
+    std::shared_ptr<llvm::Regex> m_regex;
+    std::vector<std::string> m_literals;
+};
+
+struct CompiledNamespace {
+    CompiledRegex name;
+};
+
+struct CompiledClass {
+    CompiledRegex name;
+};
+
+using CompiledQualifier = boost::variant<CompiledNamespace, CompiledClass>;
+
+struct CompiledParameter {
+    CompiledRegex type;
+    CompiledRegex name;
+};
+
+using CompiledFunctionParameter =
+    boost::variant<CompiledParameter, Ellipses>;
+
+/// A parameter list pattern compiled into an NFA. State i means the first i
+/// explicit parameters have been matched, and a state preceded by '...' may
+/// also consume any parameter. All states advance together, so every way of
+/// splitting the list between the '...' is tried, while each explicit
+/// parameter is checked at most once against each parameter of the list.
+class ParameterPattern {
+public:
+    explicit ParameterPattern(
+        const std::vector<CompiledFunctionParameter>& parameters);
+
+    /// Whether a list of 'count' parameters is long enough (or short
+    /// enough) to match
+    bool accepts_count(std::size_t count) const {
+        return count == m_parameters.size() ||
+               (count > m_parameters.size() && m_unbounded);
+    }
+
+    /// Match a list of 'count' parameters, where 'match(param, i)' tells
+    /// whether 'param' matches the i'th parameter of the list
+    template <typename MatchParameter>
+    bool matches(std::size_t count, MatchParameter match) const;
+
+private:
+    std::vector<CompiledParameter> m_parameters;
+    /// Whether each state (one more than there are explicit parameters) may
+    /// consume any parameter
+    std::vector<bool> m_loops;
+    bool m_unbounded = false;
+};
+
+template <typename MatchParameter>
+bool ParameterPattern::matches(std::size_t count, MatchParameter match) const {
+    if (!accepts_count(count)) {
+        return false;
+    }
+
+    const auto states = m_parameters.size() + 1;
+    std::vector<char> active(states, 0);
+    std::vector<char> next(states);
+    active[0] = 1;
+    for (std::size_t i = 0; i < count; ++i) {
+        // A state is dead if too few parameters remain for the explicit
+        // parameters it has still to match
+        auto live = [&](std::size_t state) {
+            return active[state] && count - i >= states - 1 - state;
+        };
+
+        bool alive = false;
+        for (std::size_t state = 0; state < states; ++state) {
+            next[state] = live(state) && m_loops[state];
+            alive |= next[state];
+        }
+        // A parameter is only checked if its target state is not already
+        // reached through a '...'
+        for (std::size_t state = 0; state + 1 < states; ++state) {
+            if (live(state) && !next[state + 1] &&
+                match(m_parameters[state], i)) {
+                next[state + 1] = 1;
+                alive = true;
+            }
+        }
+        if (!alive) {
+            return false;
+        }
+        active.swap(next);
+    }
+    return active[states - 1];
+}
+
+struct CompiledFunction {
+    std::vector<CompiledQualifier> qualifiers;
+    CompiledRegex return_type;
+    CompiledRegex name;
+    ParameterPattern parameters;
+};
+
+struct CompiledVariable {
+    std::vector<CompiledQualifier> qualifiers;
+    CompiledRegex type;
+    CompiledRegex name;
+};
+
+using CompiledTerm =
+    boost::variant<CompiledVariable, CompiledFunction, CompiledClass>;
+
+/// One query of a batch: the search string (used to tag its matches) and
+/// its compiled term
+struct NamedQuery {
+    std::string text;
+    CompiledTerm term;
+};
+
+/// Literal prefilter run on the raw source before it is parsed. Returns
+/// false only when a literal required by the term's name cannot be found,
+/// in which case the file has no matches (unless the name is produced by a
+/// macro, see '--no-prefilter'). 'forced_includes' is whether the file is
+/// parsed with headers its source does not include (e.g., by '-include'),
+/// where records may match.
+bool may_match(const CompiledVariable& term, llvm::StringRef source,
+               bool forced_includes = false);
+bool may_match(const CompiledFunction& term, llvm::StringRef source,
+               bool forced_includes = false);
+bool may_match(const CompiledClass& term, llvm::StringRef source,
+               bool forced_includes = false);
+
+/// Compile every regex in the term. Throws std::invalid_argument naming the
+/// first invalid pattern.
+CompiledTerm compile_term(const Term& term);
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef SAS_SCHEDULER
+#define SAS_SCHEDULER
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// A fixed-size thread pool where each worker owns a deque of tasks. Workers
+/// take work from the front of their own deque and, once it is empty, steal
+/// from the back of the other workers' deques. Tasks may be submitted while
+/// the pool is running (e.g., as a directory walk discovers files).
+class WorkStealingPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit WorkStealingPool(std::size_t workers);
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    void submit(Task task);
+
+    /// Stop accepting tasks and block until every submitted task has run.
+    void wait();
+
+    std::size_t size() const { return m_workers.size(); }
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void run(std::size_t index);
+    bool pop(std::size_t index, Task& task);
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    long m_queued = 0;
+    bool m_closed = false;
+    std::size_t m_next_worker = 0;
+};
+
+/// Collects per-file output buffers that may complete in any order and
+/// hands them, with the file each is from, to 'write' in the order their
+/// slots were reserved.
+class OrderedOutput {
+public:
+    using Write =
+        std::function<void(const std::string& file, const std::string&)>;
+
+    explicit OrderedOutput(Write write) : m_write{std::move(write)} {}
+
+    std::size_t reserve();
+    void complete(std::size_t slot, std::string file, std::string text);
+
+private:
+    Write m_write;
+    std::mutex m_mutex;
+    std::size_t m_next_slot = 0;
+    std::size_t m_next_flush = 0;
+    std::map<std::size_t, std::pair<std::string, std::string>> m_ready;
+};
+
+/// Admits work only while the estimated memory of everything admitted fits
+/// in a budget, so a run slows down instead of running out of memory. Work
+/// is always admitted when nothing else is running, so work estimated to
+/// exceed the budget runs on its own rather than never.
+class MemoryBudget {
+public:
+    explicit MemoryBudget(std::size_t bytes) : m_budget{bytes} {}
+
+    /// Block until 'cost' bytes fit beside the work already admitted
+    void acquire(std::size_t cost);
+    void release(std::size_t cost);
+
+    std::size_t budget() const { return m_budget; }
+
+    /// The most memory ever admitted at once
+    std::size_t peak() const;
+
+private:
+    std::size_t m_budget;
+    std::size_t m_used = 0;
+    std::size_t m_peak = 0;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+};
+
+/// Holds the memory admitted by a MemoryBudget until destroyed
+class MemoryReservation {
+public:
+    MemoryReservation(MemoryBudget& budget, std::size_t cost)
+        : m_budget(budget), m_cost{cost} {
+        m_budget.acquire(m_cost);
+    }
+    ~MemoryReservation() { m_budget.release(m_cost); }
+
+    MemoryReservation(const MemoryReservation&) = delete;
+    MemoryReservation& operator=(const MemoryReservation&) = delete;
+
+private:
+    MemoryBudget& m_budget;
+    std::size_t m_cost;
+};
+
+/// Number of workers to use for a '-j N' value, where 0 means one per core.
+std::size_t resolve_jobs(std::size_t jobs);
+
+#endif
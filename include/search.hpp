@@ -1,14 +1,24 @@
 #ifndef SAS_SEARCH
 #define SAS_SEARCH
 
+#include <atomic>
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <tuple>
 #include <vector>
 #include <regex>
 
 #include "parser.hpp"
+#include "query.hpp"
 
 namespace clang {
+class ASTUnit;
 namespace ast_matchers {
 class MatchFinder;
 }
@@ -17,17 +27,114 @@ class MatchFinder;
 namespace po = boost::program_options;
 using match_t = std::pair<std::pair<int, int>, std::pair<int, int>>;
 
+class WorkStealingPool;
+class OrderedOutput;
+class MemoryBudget;
+class CostModel;
+class MatchWriter;
+class OutputSink;
+
+/// With '--follow-includes', matches are also reported from the headers a
+/// file includes (other than system headers), under the header's path and
+/// the ID of the file whose parse reached it. Shared by every file of a run,
+/// this remembers which headers were included, so a header is only
+/// searched on its own if no file included it, and which header locations
+/// were reported, so each is reported once, however many files include it.
+class IncludedHeaders {
+public:
+    /// A file's device and inode, so every path to a file is the same
+    using file_key_t = std::pair<std::uint64_t, std::uint64_t>;
+
+    void add_included(file_key_t file);
+    bool included(const std::string& path) const;
+
+    /// Whether the location is yet to be reported for the query. Only
+    /// returns true once for each location and query.
+    bool first_report(file_key_t file, unsigned offset, std::size_t query_id);
+
+private:
+    mutable std::mutex m_mutex;
+    std::set<file_key_t> m_included;
+    std::set<std::tuple<file_key_t, unsigned, std::size_t>> m_reported;
+};
+
+/// The '-m' limit on the number of matches reported by a whole run, shared
+/// by every file searched
+class MatchLimit {
+public:
+    explicit MatchLimit(std::size_t max_matches) : m_remaining{max_matches} {}
+
+    /// Claim one of the remaining matches
+    bool take() {
+        auto remaining = m_remaining.load();
+        while (remaining > 0) {
+            if (m_remaining.compare_exchange_weak(remaining, remaining - 1)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// Return a match claimed by take() that was not reported after all
+    void give_back() { ++m_remaining; }
+
+    bool reached() const { return m_remaining == 0; }
+
+private:
+    std::atomic<std::size_t> m_remaining;
+};
+
+/// Which matches of one file are reported: with '-l' only the first, and
+/// with '-m' no more than the run's limit allows. Once the file can report
+/// no more, its matchers stop matching. With '--follow-includes', each
+/// header a parse writes matches to has a limit of its own.
+class FileLimit {
+public:
+    FileLimit(bool first_only, MatchLimit* limit)
+        : m_first_only{first_only}, m_limit{limit} {}
+
+    /// Whether a match is reported
+    bool accept() {
+        if (m_stopped || (m_limit && !m_limit->take())) {
+            m_stopped = true;
+            return false;
+        }
+        m_stopped = m_first_only;
+        return true;
+    }
+
+    /// Undo the last accept(), for a match that another file has already
+    /// reported
+    void revoke() {
+        if (m_limit) {
+            m_limit->give_back();
+        }
+        m_stopped = false;
+    }
+
+    bool stopped() const { return m_stopped || run_stopped(); }
+
+    /// Whether the run's limit is reached, so no file reports more
+    bool run_stopped() const { return m_limit && m_limit->reached(); }
+
+private:
+    bool m_first_only;
+    MatchLimit* m_limit;
+    bool m_stopped = false;
+};
+
 class MatchPrintVisitor : public boost::static_visitor<> {
 public:
     MatchPrintVisitor(const std::string& root_filename,
-                      const po::variables_map& config)
-        : m_root_filename{root_filename}, m_config{config} {}
+                      const po::variables_map& config, MatchWriter& writer)
+        : m_root_filename{root_filename}, m_config{config}, m_writer(writer) {}
     template <typename T>
-    void operator()(T&) const;
+    void operator()(const T&) const;
 
 private:
     std::string m_root_filename;
     po::variables_map m_config;
+    MatchWriter& m_writer;
 };
 
 class MatchBuildListVisitor
@@ -37,17 +144,179 @@ public:
                           const po::variables_map& config)
         : m_root_filename{root_filename}, m_config{config} {}
     template <typename T>
-    std::vector<match_t> operator()(T&) const;
+    std::vector<match_t> operator()(const T&) const;
 
 private:
     std::string m_root_filename;
     po::variables_map m_config;
 };
 
-void print_matches(const std::string& file, Term& term,
+/// Searches files on a pool of '-j' workers, each running its own clang
+/// frontend. Files may be enqueued while the search is running. The output
+/// for each file is buffered and written in the order the files were
+/// enqueued, so the result is identical to a serial search. Each searched
+/// file's ID is its position in that order.
+class ParallelSearch {
+public:
+    /// Searches a single file, returning its formatted matches
+    using SearchFile =
+        std::function<std::string(const std::string& file, std::size_t id)>;
+
+    /// Receives each file's formatted matches, in the order the files were
+    /// enqueued
+    using WriteFile = std::function<void(const std::string& file,
+                                         const std::string& formatted)>;
+
+    ParallelSearch(SearchFile search, const po::variables_map& config,
+                   WriteFile write);
+    ParallelSearch(SearchFile search, const po::variables_map& config,
+                   OutputSink& sink);
+    ParallelSearch(const CompiledTerm& term, const po::variables_map& config,
+                   OutputSink& sink);
+    ~ParallelSearch();
+
+    void enqueue(const std::string& file);
+
+    /// Block until every enqueued file has been searched and printed
+    void wait();
+
+    /// With '--mem-budget', the most estimated parse memory admitted at
+    /// once, in bytes (otherwise 0)
+    std::size_t admitted_peak() const;
+
+private:
+    /// With '--mem-budget', a file is parsed only once its estimated cost
+    /// fits in the budget alongside the files already being parsed
+    std::string search_within_budget(const std::string& file,
+                                     std::size_t slot);
+
+    SearchFile m_search;
+    const po::variables_map& m_config;
+    std::unique_ptr<OrderedOutput> m_output;
+    std::unique_ptr<WorkStealingPool> m_pool;
+    std::unique_ptr<MemoryBudget> m_budget;
+    std::unique_ptr<CostModel> m_costs;
+};
+
+bool should_search_path(const std::string& file,
+                        const po::variables_map& config);
+
+/// Whether the file is a header, by its extension
+bool is_header(const std::string& file);
+
+std::size_t search_jobs(const po::variables_map& config);
+
+/// Search a file, returning its matches in the '--format' of 'config', to be
+/// written to an OutputSink. 'file_id' identifies the file in the structured
+/// formats. Given 'headers', the matches in included headers follow those
+/// in the file. Given 'limit', matches stop once it is reached.
+std::string format_matches(const std::string& file, const CompiledTerm& term,
+                           const po::variables_map& config,
+                           std::size_t file_id = 0,
+                           IncludedHeaders* headers = nullptr,
+                           MatchLimit* limit = nullptr);
+
+void print_matches(const std::string& file, const CompiledTerm& term,
+                   const po::variables_map& config,
+                   std::ostream& out = std::cout);
+
+/// Files that cannot be searched are reported to stderr, and the rest are
+/// still searched, whatever '-j'.
+void print_matches(const std::vector<std::string>& files,
+                   const CompiledTerm& term, const po::variables_map& config);
+
+std::vector<match_t> find_matches(const std::string& file,
+                                  const CompiledTerm& term,
+                                  const po::variables_map& config);
+
+/// The matches of each file, in the order of 'files'. If any file cannot be
+/// searched, the error of the first such file is thrown, whatever '-j'.
+std::vector<std::vector<match_t>>
+find_matches(const std::vector<std::string>& files, const CompiledTerm& term,
+             const po::variables_map& config);
+
+/// Search a file for several queries at once, parsing it a single time.
+/// Each match carries the index of its query in 'queries' and, in the text
+/// format, is prefixed by the text of the query and a tab.
+std::string format_batch_matches(const std::string& file,
+                                 const std::vector<NamedQuery>& queries,
+                                 const po::variables_map& config,
+                                 std::size_t file_id = 0,
+                                 IncludedHeaders* headers = nullptr,
+                                 MatchLimit* limit = nullptr);
+
+/// Search an already parsed file, as format_batch_matches() does. Without
+/// 'tagged' the matches are not prefixed by their query, as with a single
+/// search string. The AST is not changed, so it can be searched again.
+std::string format_ast_matches(const std::string& file, clang::ASTUnit& unit,
+                               const std::vector<NamedQuery>& queries,
+                               bool tagged, const po::variables_map& config,
+                               std::size_t file_id = 0,
+                               IncludedHeaders* headers = nullptr,
+                               MatchLimit* limit = nullptr);
+
+void print_batch_matches(const std::string& file,
+                         const std::vector<NamedQuery>& queries,
+                         const po::variables_map& config,
+                         std::ostream& out = std::cout);
+
+/// Search a file for several queries at once, parsing it a single time.
+/// Returns the matches for each query, in the order of 'queries'.
+std::vector<std::vector<match_t>>
+find_batch_matches(const std::string& file,
+                   const std::vector<NamedQuery>& queries,
                    const po::variables_map& config);
 
-std::vector<match_t> find_matches(const std::string& file, Term& term,
+// The overloads taking an uncompiled Term compile it first, so an invalid
+// regex throws std::invalid_argument before any file is parsed.
+
+void print_matches(const std::string& file, const Term& term,
+                   const po::variables_map& config,
+                   std::ostream& out = std::cout);
+
+void print_matches(const std::vector<std::string>& files, const Term& term,
+                   const po::variables_map& config);
+
+std::vector<match_t> find_matches(const std::string& file, const Term& term,
                                   const po::variables_map& config);
 
+std::vector<std::vector<match_t>>
+find_matches(const std::vector<std::string>& files, const Term& term,
+             const po::variables_map& config);
+
+namespace sas {
+
+/// Searches file after file for one term, for tools that embed sas. Unlike
+/// find_matches(), which sets everything up again for each file, the term
+/// is compiled and its matchers built once, and clang's cache of the files
+/// and directories it has looked up (e.g., headers, and the directories
+/// searched for them) is kept from one file to the next. Files other than
+/// the one searched are therefore assumed not to change while a Searcher
+/// is in use.
+///
+/// A Searcher is not thread-safe: use one per thread.
+class Searcher {
+public:
+    using MatchCallback = std::function<void(const match_t& match)>;
+
+    /// Throws std::invalid_argument if a regex in 'term' is invalid
+    Searcher(const Term& term, const po::variables_map& config);
+    ~Searcher();
+
+    /// Search a file, calling 'on_match' with each match in the order
+    /// find_matches() would return them. Throws std::runtime_error if the
+    /// file cannot be read.
+    void search(const std::string& file, const MatchCallback& on_match);
+
+    std::vector<match_t> search(const std::string& file);
+
+private:
+    struct Matchers;
+
+    std::vector<NamedQuery> m_queries;
+    po::variables_map m_config;
+    std::unique_ptr<Matchers> m_matchers;
+};
+}
+
 #endif
@@ -0,0 +1,92 @@
+#ifndef SAS_SERVER
+#define SAS_SERVER
+
+#include <boost/program_options.hpp>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace clang {
+class ASTUnit;
+}
+
+namespace po = boost::program_options;
+
+/// The ASTs of the files a server has parsed, kept up to a memory budget
+/// and evicted least recently used first. ASTs are kept per file and parse
+/// command, so requests with different '-p' flags or '--pch-cache' do not
+/// share them. A file is reparsed when its content changes (a changed mtime
+/// or size leads to its hash being checked, and only a changed hash to a
+/// new parse) or when any header its AST read has a new mtime or size.
+class ASTCache {
+public:
+    explicit ASTCache(std::size_t budget_bytes) : m_budget{budget_bytes} {}
+
+    ASTCache(const ASTCache&) = delete;
+    ASTCache& operator=(const ASTCache&) = delete;
+
+    /// The AST of 'file', parsed with the flags from parse_command(). Throws
+    /// std::runtime_error if the file cannot be read or parsed.
+    std::shared_ptr<clang::ASTUnit> get(const std::string& file,
+                                        const po::variables_map& config);
+
+private:
+    /// A header read by a parse, as it was when it was read (or -1s if it
+    /// changed while the file was parsed)
+    struct Header {
+        std::string name;
+        long mtime_sec;
+        long mtime_nsec;
+        long size;
+    };
+
+    struct Entry {
+        std::shared_ptr<clang::ASTUnit> unit;
+        long mtime_sec;
+        long mtime_nsec;
+        long size;
+        std::string hash;
+        std::vector<Header> headers;
+        std::size_t bytes;
+        std::list<std::string>::iterator recent;
+    };
+
+    static bool headers_unchanged(const Entry& entry);
+    void touch(Entry& entry);
+    void evict();
+
+    std::size_t m_budget;
+    std::size_t m_used = 0;
+    std::mutex m_mutex;
+    /// Keys (the file's real path and parse command), most recently used
+    /// first
+    std::list<std::string> m_recent;
+    std::unordered_map<std::string, Entry> m_entries;
+};
+
+/// Handles one request: the arguments a client was started with, and the
+/// streams its output and errors are sent back through
+using ServeRequest =
+    std::function<int(const std::vector<std::string>& args, std::ostream& out,
+                      std::ostream& err, ASTCache& cache)>;
+
+/// '$XDG_RUNTIME_DIR/sas.sock', or a per-user socket in /tmp
+std::string default_socket_path();
+
+/// Listen on a Unix socket, answering one client at a time from the
+/// client's working directory. Clients run by other users are refused.
+/// Only returns if the socket cannot be used.
+int serve(const std::string& socket_path, std::size_t cache_bytes,
+          const ServeRequest& handle);
+
+/// Send 'args' to a server and copy its output to stdout and stderr.
+/// Returns the exit status of the request.
+int run_client(const std::string& socket_path,
+               const std::vector<std::string>& args);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef SAS_SHARD
+#define SAS_SHARD
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "output.hpp"
+
+/// '--shard K/N': the Kth of N processes sharing a search, each searching a
+/// share of the files. Every shard walks all the paths and numbers the files
+/// in the order they are found, which is the same in every process (see
+/// walk_paths), so that they agree on each file's ID. Shard outputs are
+/// combined by '--merge' into the output of a single search of the paths.
+struct Shard {
+    /// From 0, unlike the K given on the command line
+    std::size_t index;
+    std::size_t count;
+};
+
+/// Parse 'K/N'. Throws std::invalid_argument unless 1 <= K <= N.
+Shard parse_shard(const std::string& spec);
+
+/// The files of 'shard', with their IDs (their positions in 'files'), in ID
+/// order. Files are dealt out largest first, each to the shard with the
+/// fewest bytes so far, so the shards get similar amounts of source (and
+/// the same shares wherever they run).
+std::vector<std::pair<std::size_t, std::string>>
+shard_files(std::vector<std::string> files, const Shard& shard);
+
+/// Writes a shard's output: the bytes "SASS" and a uint32 version, a header
+/// giving the output format, the shard and the queries searched for (so
+/// shards of different searches are not merged), then a record for each
+/// file with matches, holding its ID and formatted matches, and an end
+/// record once every file has been searched. Integers are in host byte
+/// order.
+class ShardWriter {
+public:
+    ShardWriter(std::ostream& out, OutputFormat format, const Shard& shard,
+                const std::string& search);
+
+    /// Files must be written in ID order
+    void write(std::size_t file_id, const std::string& formatted);
+
+    /// Mark the shard as complete
+    void finish();
+
+private:
+    void write_uint32(std::uint32_t value);
+    void write_uint64(std::uint64_t value);
+
+    std::ostream& m_out;
+};
+
+/// '--merge': combine the outputs of every shard of a search, writing the
+/// files' matches in ID order. Throws std::runtime_error if a shard output
+/// is missing, incomplete or from another search.
+void merge_shards(const std::vector<std::string>& paths, std::ostream& out);
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef SAS_STATS
+#define SAS_STATS
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+/// Instrumentation behind '--stats' and '--trace'. Nothing is recorded
+/// until enable_stats() is called, so a normal search only pays for
+/// checking a flag.
+
+/// The stages of searching a file. Clang preprocesses while it parses, so
+/// preprocessing, parsing and Sema are a single stage.
+enum class Stage { Read, Prefilter, Parse, Match, Output };
+
+/// The custom matchers in matchers.hpp, and the regexes they evaluate
+enum class Counter {
+    UnqualifiedName,
+    Type,
+    Parameter,
+    Parameters,
+    Namespace,
+    Class,
+    Qualifiers,
+    Regex
+};
+
+namespace stats_detail {
+
+const std::size_t counter_count = static_cast<std::size_t>(Counter::Regex) + 1;
+
+extern std::atomic<bool> enabled;
+extern std::atomic<std::uint64_t> evaluated[counter_count];
+extern std::atomic<std::uint64_t> passed[counter_count];
+}
+
+/// Start recording. With a non-empty 'trace_file', each file and stage is
+/// also recorded as a trace event for write_trace().
+void enable_stats(const std::string& trace_file = {});
+
+/// Stop recording and discard everything recorded, so that each of a
+/// server's requests reports only its own search
+void reset_stats();
+
+inline bool stats_enabled() {
+    return stats_detail::enabled.load(std::memory_order_relaxed);
+}
+
+/// Count an evaluation of a matcher (or regex), returning its result
+inline bool count_evaluation(Counter counter, bool result) {
+    if (stats_enabled()) {
+        auto index = static_cast<std::size_t>(counter);
+        stats_detail::evaluated[index].fetch_add(1, std::memory_order_relaxed);
+        if (result) {
+            stats_detail::passed[index].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    return result;
+}
+
+/// Attributes the stages timed on this thread to 'file' until destroyed.
+/// The times of every FileStats of a file are added up, so writing a file's
+/// output is counted with its search.
+class FileStats {
+public:
+    explicit FileStats(const std::string& file);
+    ~FileStats();
+
+    FileStats(const FileStats&) = delete;
+    FileStats& operator=(const FileStats&) = delete;
+
+private:
+    friend class StageTimer;
+
+    double m_seconds[static_cast<std::size_t>(Stage::Output) + 1] = {};
+    std::string m_file;
+    std::chrono::steady_clock::time_point m_start;
+    FileStats* m_parent;
+};
+
+/// Times a stage until destroyed. Stages may nest (matching runs inside the
+/// parse); each is charged only for the time not spent in nested stages.
+class StageTimer {
+public:
+    explicit StageTimer(Stage stage);
+    ~StageTimer();
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+    Stage m_stage;
+    bool m_enabled;
+    std::chrono::steady_clock::time_point m_start;
+    double m_nested = 0;
+    StageTimer* m_parent = nullptr;
+};
+
+/// The process's peak resident set size in bytes, or 0 if unknown
+std::size_t peak_rss();
+
+/// Per-file timings (slowest first), totals for each stage, matcher
+/// counters and peak RSS
+void print_stats(std::ostream& out);
+
+/// Write the recorded events in the Chrome trace-event format. Throws
+/// std::runtime_error if the file cannot be written.
+void write_trace();
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef SAS_WALKER
+#define SAS_WALKER
+
+#include <boost/program_options.hpp>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace po = boost::program_options;
+
+/// Call 'visit' for every file to search under 'paths'. Files named
+/// directly are always visited. Directories are only entered if
+/// 'recursive', and then:
+///
+/// - files without a searched extension (see should_search_path) are
+///   skipped before they are handed on
+/// - hidden entries are skipped unless '--hidden' is given, and VCS
+///   directories (.git, .hg, .svn) are always skipped
+/// - entries matching the patterns of a .gitignore or .sasignore in their
+///   directory or any directory above it (up to the walked path) are
+///   skipped, unless '--no-ignore' is given
+///
+/// 'visit_directory', if given, is called for every directory entered.
+///
+/// Files are visited in the order given, and those under a directory in
+/// name order, a subdirectory's files where its name sorts. With more than
+/// one '-j' worker, directories are read in parallel, so 'visit_directory'
+/// may be called concurrently, in no particular order; the files found are
+/// still visited in the same order as by a single worker, from the calling
+/// thread, each as soon as every directory before it has been read.
+void walk_paths(const std::vector<std::string>& paths, bool recursive,
+                const po::variables_map& config,
+                const std::function<void(const std::string&)>& visit,
+                const std::function<void(const std::string&)>&
+                    visit_directory = {});
+
+#endif
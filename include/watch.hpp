@@ -0,0 +1,26 @@
+#ifndef SAS_WATCH
+#define SAS_WATCH
+
+#include <boost/program_options.hpp>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "search.hpp"
+
+namespace po = boost::program_options;
+
+/// Search the files under 'paths' (as walk_paths() finds them), then watch
+/// them with inotify. Whenever files change, only those files are searched
+/// again, and the whole result set is printed anew, with the results of
+/// unchanged files coming from memory. Files and directories that appear
+/// or disappear, and changed ignore files, lead to the paths being walked
+/// again, which searches only the files that are new.
+///
+/// Only returns (with an exit status) if inotify fails.
+int watch_paths(const std::vector<std::string>& paths, bool recursive,
+                const po::variables_map& config,
+                const ParallelSearch::SearchFile& search, std::ostream& out,
+                std::ostream& err);
+
+#endif
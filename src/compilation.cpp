@@ -0,0 +1,365 @@
+#ifndef __STDC_LIMIT_MACROS
+#define __STDC_LIMIT_MACROS
+#endif
+
+#ifndef __STDC_CONSTANT_MACROS
+#define __STDC_CONSTANT_MACROS
+#endif
+
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+#include <boost/filesystem.hpp>
+
+#include "clang/Basic/LangOptions.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Lex/Lexer.h"
+#include "clang/Tooling/CompilationDatabase.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/MD5.h"
+
+#include "compilation.hpp"
+
+using namespace clang;
+using namespace clang::tooling;
+
+namespace fs = boost::filesystem;
+
+namespace {
+
+const char* const builtin_include = "-I/usr/lib/clang/3.7.1/include";
+
+std::mutex databases_mutex;
+std::map<std::string, std::unique_ptr<CompilationDatabase>> databases;
+
+CompilationDatabase& database(const std::string& build_dir) {
+    std::lock_guard<std::mutex> lock(databases_mutex);
+    auto& db = databases[build_dir];
+    if (!db) {
+        std::string error;
+        db = CompilationDatabase::loadFromDirectory(build_dir, error);
+        if (!db) {
+            throw std::runtime_error(error);
+        }
+    }
+    return *db;
+}
+
+std::string absolute(const std::string& path, const std::string& directory) {
+    boost::system::error_code ec;
+    auto canonical = fs::canonical(path, directory, ec);
+    return ec ? fs::absolute(path, directory).string() : canonical.string();
+}
+
+/// Turn a compilation database entry into arguments for a syntax-only run
+/// on 'file'. Outputs and the input itself are dropped, and include paths
+/// are made absolute since the command's directory is not ours.
+std::vector<std::string> adjust_command(const CompileCommand& command,
+                                        const std::string& file) {
+    const auto& line = command.CommandLine;
+    const auto& dir = command.Directory;
+    std::vector<std::string> args{"-w"};
+
+    // Skip the compiler itself
+    for (std::size_t i = 1; i < line.size(); ++i) {
+        const auto& arg = line[i];
+        if (arg == "-c" || arg == "-MD" || arg == "-MMD") {
+            continue;
+        }
+        if (arg == "-o" || arg == "-MF" || arg == "-MT" || arg == "-MQ") {
+            ++i;
+            continue;
+        }
+        if (arg[0] != '-' && absolute(arg, dir) == file) {
+            continue;
+        }
+        if ((arg == "-I" || arg == "-isystem" || arg == "-iquote" ||
+             arg == "-idirafter" || arg == "-include") &&
+            i + 1 < line.size()) {
+            args.push_back(arg);
+            args.push_back(absolute(line[++i], dir));
+        } else if (arg.size() > 2 && arg.compare(0, 2, "-I") == 0) {
+            args.push_back("-I" + absolute(arg.substr(2), dir));
+        } else {
+            args.push_back(arg);
+        }
+    }
+    args.push_back(builtin_include);
+    return args;
+}
+
+/// Generates a PCH for a preamble, recording the headers it depends on so a
+/// stale PCH can be detected without loading it
+class CachedPCHAction : public GeneratePCHAction {
+public:
+    CachedPCHAction(const std::string& output, const std::string& deps)
+        : m_output{output}, m_deps{deps} {}
+
+protected:
+    bool BeginInvocation(CompilerInstance& CI) override {
+        CI.getFrontendOpts().OutputFile = m_output;
+        CI.getDependencyOutputOpts().OutputFile = m_deps;
+        CI.getDependencyOutputOpts().Targets = {"pch"};
+        return true;
+    }
+
+private:
+    std::string m_output;
+    std::string m_deps;
+};
+
+/// Read the prerequisites listed in a make-style dependency file
+std::vector<std::string> read_dependencies(const std::string& path) {
+    std::ifstream in(path);
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    auto text = buffer.str();
+
+    std::vector<std::string> deps;
+    std::string current;
+    bool in_target = true;
+    for (std::size_t i = 0; i < text.size(); ++i) {
+        char c = text[i];
+        if (c == '\\' && i + 1 < text.size()) {
+            // Either an escaped space or a line continuation
+            if (text[i + 1] == ' ') {
+                current.push_back(' ');
+            }
+            ++i;
+            continue;
+        }
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            if (!current.empty() && !in_target) {
+                deps.push_back(current);
+            }
+            current.clear();
+            continue;
+        }
+        if (c == ':' && in_target) {
+            in_target = false;
+            current.clear();
+            continue;
+        }
+        current.push_back(c);
+    }
+    if (!current.empty() && !in_target) {
+        deps.push_back(current);
+    }
+    return deps;
+}
+
+/// A precompiled preamble, and the leading bytes of the file it stands for
+struct Preamble {
+    std::string pch;
+    unsigned size = 0;
+    /// Whether the file continues at the start of a line
+    bool at_line_start = false;
+};
+
+/// A directory of precompiled preambles, keyed by the parse arguments, the
+/// including directory and the preamble text. A preamble is compiled the
+/// second time it is seen (or reused if an earlier run compiled it) and
+/// rebuilt whenever one of the headers it includes changes.
+class PreambleCache {
+public:
+    explicit PreambleCache(const std::string& dir) : m_dir{dir} {
+        fs::create_directories(m_dir);
+    }
+
+    /// The preamble to use for 'source', with an empty PCH if there is none
+    Preamble lookup(const std::string& file, llvm::StringRef source,
+                    const std::vector<std::string>& args) {
+        LangOptions lang_opts;
+        lang_opts.CPlusPlus = true;
+        auto bounds = Lexer::ComputePreamble(source, lang_opts);
+        if (bounds.first == 0) {
+            return {};
+        }
+        auto preamble = source.substr(0, bounds.first);
+        auto include_dir = fs::absolute(file).parent_path().string();
+
+        llvm::MD5 hash;
+        for (const auto& arg : args) {
+            hash.update(arg);
+            hash.update(llvm::StringRef("", 1));
+        }
+        hash.update(include_dir);
+        hash.update(llvm::StringRef("", 1));
+        hash.update(preamble);
+        llvm::MD5::MD5Result result;
+        hash.final(result);
+        llvm::SmallString<32> key;
+        llvm::MD5::stringifyResult(result, key);
+
+        auto base = (fs::path(m_dir) / key.str().str()).string();
+        auto pch = base + ".pch";
+
+        Entry* entry;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            entry = &m_entries[key.str().str()];
+        }
+
+        // Building a PCH is a full parse of its headers, so only one worker
+        // builds a given preamble and the others wait for it
+        std::lock_guard<std::mutex> lock(entry->mutex);
+        if (entry->failed) {
+            return {};
+        }
+        Preamble found{pch, bounds.first, bounds.second};
+        if (is_fresh(pch, base + ".d")) {
+            return found;
+        }
+        if (++entry->seen < 2) {
+            return {};
+        }
+        if (!build(base, preamble, include_dir, file, args)) {
+            entry->failed = true;
+            return {};
+        }
+        return found;
+    }
+
+private:
+    struct Entry {
+        std::mutex mutex;
+        int seen = 0;
+        bool failed = false;
+    };
+
+    static bool is_fresh(const std::string& pch, const std::string& deps) {
+        boost::system::error_code ec;
+        auto built = fs::last_write_time(pch, ec);
+        if (ec || !fs::exists(deps)) {
+            return false;
+        }
+        for (const auto& dep : read_dependencies(deps)) {
+            auto modified = fs::last_write_time(dep, ec);
+            if (ec || modified > built) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool build(const std::string& base, llvm::StringRef preamble,
+                      const std::string& include_dir, const std::string& file,
+                      const std::vector<std::string>& args) {
+        // The PCH records the header it was built from, so the header is
+        // written once and never touched again
+        auto header = base + ".h";
+        if (!fs::exists(header)) {
+            auto tmp = fs::unique_path(header + ".%%%%-%%%%").string();
+            {
+                std::ofstream out(tmp, std::ios::binary);
+                out.write(preamble.data(), preamble.size());
+            }
+            fs::rename(tmp, header);
+        }
+
+        auto language =
+            fs::extension(file) == ".c" ? "c-header" : "c++-header";
+        std::vector<std::string> command{"clang-tool", "-fsyntax-only"};
+        command.insert(command.end(), args.begin(), args.end());
+        command.insert(command.end(),
+                       {"-x", language, "-iquote", include_dir, header});
+
+        IntrusiveRefCntPtr<FileManager> files(
+            new FileManager(FileSystemOptions()));
+        ToolInvocation invocation(
+            command, new CachedPCHAction(base + ".pch", base + ".d"),
+            files.get());
+        return invocation.run();
+    }
+
+    std::string m_dir;
+    std::mutex m_mutex;
+    std::map<std::string, Entry> m_entries;
+};
+
+std::mutex caches_mutex;
+std::map<std::string, std::unique_ptr<PreambleCache>> caches;
+
+PreambleCache& preamble_cache(const std::string& dir) {
+    std::lock_guard<std::mutex> lock(caches_mutex);
+    auto& cache = caches[dir];
+    if (!cache) {
+        cache.reset(new PreambleCache(dir));
+    }
+    return *cache;
+}
+}
+
+void load_compilation_database(const po::variables_map& config) {
+    if (config.count("build-path")) {
+        database(config["build-path"].as<std::string>());
+    }
+}
+
+ParseCommand compile_command(const std::string& file,
+                             const po::variables_map& config) {
+    // Files are always parsed under their real path, so their includes
+    // resolve. Without other flags, everything is parsed as C++.
+    auto path = absolute(file, fs::current_path().string());
+    ParseCommand command{path,
+                         {"-w", "-x", "c++", "-std=c++14", builtin_include}};
+
+    if (config.count("build-path")) {
+        auto& db = database(config["build-path"].as<std::string>());
+
+        std::vector<CompileCommand> commands;
+        {
+            std::lock_guard<std::mutex> lock(databases_mutex);
+            commands = db.getCompileCommands(path);
+        }
+
+        // Files missing from the database (e.g., headers) keep the default
+        // flags
+        if (!commands.empty()) {
+            command.arguments = adjust_command(commands.front(), path);
+        }
+    }
+    return command;
+}
+
+bool has_forced_includes(const std::string& file,
+                         const po::variables_map& config) {
+    // Only a compilation database gives flags of its own
+    if (!config.count("build-path")) {
+        return false;
+    }
+    for (const auto& arg : compile_command(file, config).arguments) {
+        if (arg.compare(0, 8, "-include") == 0 ||
+            arg.compare(0, 8, "-imacros") == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ParseCommand parse_command(const std::string& file, llvm::StringRef source,
+                           const po::variables_map& config) {
+    auto command = compile_command(file, config);
+    if (config.count("pch-cache")) {
+        auto preamble = preamble_cache(config["pch-cache"].as<std::string>())
+                            .lookup(file, source, command.arguments);
+        if (!preamble.pch.empty()) {
+            // The PCH replaces the file's leading #include block, which is
+            // skipped rather than read again: headers without guards would
+            // otherwise be included twice. Offsets in the file are kept.
+            command.arguments.push_back("-include-pch");
+            command.arguments.push_back(preamble.pch);
+            command.arguments.push_back("-Xclang");
+            command.arguments.push_back(
+                "-preamble-bytes=" + std::to_string(preamble.size) +
+                (preamble.at_line_start ? ",1" : ",0"));
+        }
+    }
+
+    return command;
+}
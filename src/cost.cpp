@@ -0,0 +1,71 @@
+#include <algorithm>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "clang/AST/ASTContext.h"
+#include "clang/Basic/SourceManager.h"
+
+#include "cost.hpp"
+
+namespace {
+
+const std::size_t megabyte = 1024 * 1024;
+
+/// Before anything has been measured: clang's baseline with a few system
+/// headers, plus a generous multiple of the file
+const std::size_t base_cost = 64 * megabyte;
+const std::size_t cost_per_byte = 64;
+
+/// Sema, the preprocessor and the allocators hold about as much again as
+/// the AST and buffers that are measured
+const double margin = 2.0;
+
+thread_local ParseMeasure* current_measure = nullptr;
+}
+
+std::size_t CostModel::estimate(std::size_t file_size) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_files == 0) {
+        return base_cost + cost_per_byte * file_size;
+    }
+    auto average_size = std::max(m_total_size / m_files, 1.0);
+    auto average_cost = m_total_cost / m_files;
+    auto scale = std::max(1.0, file_size / average_size);
+    return static_cast<std::size_t>(average_cost * scale * margin);
+}
+
+void CostModel::record(std::size_t file_size, std::size_t cost) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ++m_files;
+    m_total_size += file_size;
+    m_total_cost += cost;
+}
+
+ParseMeasure::ParseMeasure() : m_parent{current_measure} {
+    current_measure = this;
+}
+
+ParseMeasure::~ParseMeasure() { current_measure = m_parent; }
+
+std::size_t ast_memory(clang::ASTContext& context) {
+    auto& sm = context.getSourceManager();
+    auto buffers = sm.getMemoryBufferSizes();
+    return context.getASTAllocatedMemory() +
+           context.getSideTableAllocatedMemory() + sm.getContentCacheSize() +
+           sm.getDataStructureSizes() + buffers.malloc_bytes +
+           buffers.mmap_bytes;
+}
+
+void record_parse_memory(clang::ASTContext& context) {
+    if (current_measure) {
+        current_measure->m_bytes += ast_memory(context);
+    }
+}
+
+void release_free_memory() {
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
@@ -0,0 +1,1574 @@
+#include <algorithm>
+#include <cctype>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "clang/Basic/IdentifierTable.h"
+#include "clang/Basic/LangOptions.h"
+#include "clang/Lex/Lexer.h"
+#include "llvm/ADT/StringRef.h"
+
+#include "fast.hpp"
+#include "lines.hpp"
+
+using namespace clang;
+
+namespace {
+
+const std::size_t npos = static_cast<std::size_t>(-1);
+
+using context_t = std::pair<IndexedDecl::ContextKind, std::string>;
+
+/// A token of the file, with identifiers resolved to keywords where they
+/// are one
+struct LexedToken {
+    tok::TokenKind kind;
+    llvm::StringRef text;
+    unsigned offset;
+};
+
+LangOptions lexer_options() {
+    LangOptions options;
+    options.CPlusPlus = 1;
+    options.CPlusPlus11 = 1;
+    options.CPlusPlus14 = 1;
+    options.LineComment = 1;
+    options.Bool = 1;
+    return options;
+}
+
+/// Every token of the file outside preprocessor directives, ending with an
+/// eof token
+std::vector<LexedToken> lex(llvm::StringRef source) {
+    auto options = lexer_options();
+    IdentifierTable identifiers(options);
+    Lexer lexer(SourceLocation(), options, source.begin(), source.begin(),
+                source.end());
+
+    std::vector<LexedToken> tokens;
+    bool directive = false;
+    Token token;
+    for (;;) {
+        lexer.LexFromRawLexer(token);
+        if (token.is(tok::eof)) {
+            break;
+        }
+        // A directive runs to the end of its line, which an escaped newline
+        // continues
+        if (token.isAtStartOfLine()) {
+            directive = token.is(tok::hash);
+        }
+        if (directive) {
+            continue;
+        }
+        auto length = token.getLength();
+        auto offset = static_cast<unsigned>(lexer.getBufferLocation() -
+                                            source.begin() - length);
+        llvm::StringRef text(source.begin() + offset, length);
+        auto kind = token.getKind();
+        if (kind == tok::raw_identifier) {
+            kind = identifiers.get(text).getTokenID();
+        }
+        tokens.push_back({kind, text, offset});
+    }
+    tokens.push_back(
+        {tok::eof, llvm::StringRef(), static_cast<unsigned>(source.size())});
+    return tokens;
+}
+
+/// The line and column numbers of an offset, as clang counts them
+std::pair<int, int> position(const LineIndex& lines, unsigned offset) {
+    auto line = lines.line_of(offset);
+    return {static_cast<int>(line),
+            static_cast<int>(offset - lines.start_of(line) + 1)};
+}
+
+bool is_builtin_type(tok::TokenKind kind) {
+    switch (kind) {
+    case tok::kw_void:
+    case tok::kw_bool:
+    case tok::kw__Bool:
+    case tok::kw_char:
+    case tok::kw_wchar_t:
+    case tok::kw_char16_t:
+    case tok::kw_char32_t:
+    case tok::kw_short:
+    case tok::kw_int:
+    case tok::kw_long:
+    case tok::kw_float:
+    case tok::kw_double:
+    case tok::kw_signed:
+    case tok::kw_unsigned:
+    case tok::kw_auto:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool is_cv(tok::TokenKind kind) {
+    return kind == tok::kw_const || kind == tok::kw_volatile ||
+           kind == tok::kw_restrict;
+}
+
+/// Storage classes and function specifiers, which are not part of a type
+bool is_specifier(tok::TokenKind kind) {
+    switch (kind) {
+    case tok::kw_static:
+    case tok::kw_extern:
+    case tok::kw_inline:
+    case tok::kw_virtual:
+    case tok::kw_explicit:
+    case tok::kw_mutable:
+    case tok::kw_thread_local:
+    case tok::kw___thread:
+    case tok::kw__Thread_local:
+    case tok::kw_register:
+    case tok::kw_constexpr:
+    case tok::kw_friend:
+    case tok::kw_typedef:
+    case tok::kw__Noreturn:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool is_class_key(tok::TokenKind kind) {
+    return kind == tok::kw_class || kind == tok::kw_struct ||
+           kind == tok::kw_union;
+}
+
+bool is_word(const LexedToken& token) {
+    return !token.text.empty() &&
+           (std::isalnum(static_cast<unsigned char>(token.text[0])) ||
+            token.text[0] == '_');
+}
+
+bool is_pointer_operator(tok::TokenKind kind) {
+    return kind == tok::star || kind == tok::amp || kind == tok::ampamp;
+}
+
+/// Whether clang puts a space between two tokens when printing a type,
+/// e.g. 'const char *', 'int &' and 'std::map<int, int>'
+bool needs_space(const LexedToken& prev, const LexedToken& next) {
+    if (is_word(prev) && is_word(next)) {
+        return true;
+    }
+    if (is_pointer_operator(next.kind)) {
+        return is_word(prev) || prev.kind == tok::greater ||
+               prev.kind == tok::greatergreater || prev.kind == tok::r_paren;
+    }
+    return prev.kind == tok::comma;
+}
+
+/// Recognizes declarations in a file's tokens. Statements are split at
+/// ';', '{' and '}' outside brackets, and each is recognized by its shape:
+/// a braced scope is a namespace, a class, a function body or a block, and
+/// a statement ending in ';' is a declaration or an expression. Scopes are
+/// tracked to qualify what is declared in them, as the DeclContexts of the
+/// real declarations would.
+class Recognizer {
+public:
+    explicit Recognizer(llvm::StringRef source)
+        : m_tokens(lex(source)), m_lines(source) {}
+
+    std::vector<IndexedDecl> run();
+
+private:
+    struct Scope {
+        enum Kind { Namespace, Record, Function, Block, Opaque };
+        Kind kind;
+        /// The named contexts the scope adds, innermost first
+        std::vector<context_t> contexts;
+        /// The declaration whose body the scope is, which ends at its '}'
+        std::size_t decl;
+    };
+
+    /// The part of a declaration before its declarators
+    struct DeclSpec {
+        std::size_t begin;
+        std::size_t end;
+        /// The tokens spelling the type, without the specifiers
+        std::vector<std::size_t> type;
+        bool has_type = false;
+        bool is_static = false;
+        bool is_typedef = false;
+        bool is_friend = false;
+        bool is_constexpr = false;
+        /// The 'class', 'struct' or 'union' of an elaborated type
+        std::size_t class_key = npos;
+    };
+
+    /// The name a declarator declares, e.g. 'A::f', '~S' or 'operator=='
+    struct DeclaratorId {
+        std::string name;
+        /// Outermost first
+        std::vector<std::string> qualifiers;
+        /// For a conversion function, the type it converts to
+        std::string conversion;
+        bool special = false;
+    };
+
+    struct Declarator {
+        DeclaratorId id;
+        /// The variable's type, or the function's return type
+        std::string type;
+        bool function = false;
+        std::size_t params_begin = npos;
+        std::size_t params_end = npos;
+        /// The initializer, or a constructor's member initializers
+        std::size_t init_begin = npos;
+        std::size_t init_end = npos;
+        /// The last token of the declaration
+        std::size_t end = npos;
+    };
+
+    /// What a declaration declared, for the scope that may follow it
+    struct Declared {
+        bool declaration = false;
+        /// The function whose body follows
+        std::size_t function = npos;
+        /// The contexts the function's body adds, innermost first
+        std::vector<context_t> contexts;
+    };
+
+    struct Call {
+        std::size_t decl;
+        std::size_t arguments;
+    };
+
+    const LexedToken& at(std::size_t i) const {
+        return m_tokens[std::min(i, m_tokens.size() - 1)];
+    }
+    bool is(std::size_t i, tok::TokenKind kind) const {
+        return at(i).kind == kind;
+    }
+    bool is_text(std::size_t i, llvm::StringRef text) const {
+        return is(i, tok::identifier) && at(i).text == text;
+    }
+
+    std::size_t skip_balanced(std::size_t i) const;
+    std::size_t skip_angles(std::size_t i, std::size_t e, bool header) const;
+    std::size_t skip_attribute(std::size_t i, std::size_t e) const;
+    std::size_t skip_attributes(std::size_t i, std::size_t e) const;
+    std::size_t skip_template_headers(std::size_t i, std::size_t e) const;
+    std::size_t skip_prefixes(std::size_t s, std::size_t e, bool process);
+    std::size_t find_top_level(std::size_t s, std::size_t e,
+                               tok::TokenKind kind) const;
+    std::vector<std::pair<std::size_t, std::size_t>>
+    split_list(std::size_t s, std::size_t e) const;
+    std::size_t item_end(std::size_t s, std::size_t e) const;
+
+    std::size_t qualified_name(std::size_t i, std::size_t e,
+                               std::vector<std::size_t>* tokens) const;
+    std::size_t declarator_id(std::size_t i, std::size_t e,
+                              DeclaratorId& id) const;
+    std::size_t operator_name(std::size_t i, std::size_t e,
+                              DeclaratorId& id) const;
+    std::size_t class_head(std::size_t s, std::size_t e) const;
+    void decl_specifiers(std::size_t i, std::size_t e, DeclSpec& spec) const;
+    bool names_constructor(const DeclSpec& spec) const;
+    bool looks_like_parameter(std::size_t s, std::size_t e) const;
+    bool looks_like_parameters(std::size_t open, std::size_t close) const;
+    std::size_t declarator(std::size_t i, std::size_t e, const DeclSpec& spec,
+                           bool special, bool head, Declarator& d) const;
+
+    Declared declaration(std::size_t s, std::size_t e, bool head);
+    void parameters(std::size_t s, std::size_t e, std::size_t function);
+    void condition(tok::TokenKind kind, std::size_t s, std::size_t e);
+    void statement(std::size_t s, std::size_t e);
+    bool initializer_brace(std::size_t s, std::size_t i);
+    void open_scope(std::size_t s, std::size_t i);
+    void close_scope(std::size_t i);
+    void scan_calls(std::size_t s, std::size_t e);
+    std::vector<IndexedDecl> resolve_calls();
+
+    bool in_function() const;
+    bool in_record() const;
+    std::vector<context_t> contexts() const;
+    std::vector<context_t>
+    qualify(const std::vector<std::string>& names) const;
+
+    std::string spell(const std::vector<std::size_t>& tokens) const;
+    std::string spell(std::size_t s, std::size_t e) const;
+    std::pair<int, int> end_position(std::size_t last) const;
+    std::size_t add(IndexedDecl::Kind kind, const std::string& name,
+                    std::size_t first, std::size_t last,
+                    std::vector<context_t> qualifiers);
+
+    std::vector<LexedToken> m_tokens;
+    LineIndex m_lines;
+    std::vector<Scope> m_scopes;
+    std::vector<IndexedDecl> m_decls;
+    std::vector<Call> m_calls;
+    /// The namespaces and classes seen so far, to tell which a qualifier
+    /// names
+    std::unordered_map<std::string, IndexedDecl::ContextKind> m_known;
+};
+
+std::vector<IndexedDecl> Recognizer::run() {
+    // The translation unit, which ends the chain of named contexts
+    m_scopes.push_back({Scope::Opaque, {}, npos});
+
+    std::size_t start = 0;
+    std::size_t i = 0;
+    while (!is(i, tok::eof)) {
+        switch (at(i).kind) {
+        case tok::l_paren:
+        case tok::l_square:
+            i = skip_balanced(i);
+            break;
+        case tok::semi:
+            statement(start, i);
+            start = ++i;
+            break;
+        case tok::l_brace:
+            if (initializer_brace(start, i)) {
+                i = skip_balanced(i);
+            } else {
+                open_scope(start, i);
+                start = ++i;
+            }
+            break;
+        case tok::r_brace:
+            // e.g. the last enumerator, or a statement missing its ';'
+            statement(start, i);
+            close_scope(i);
+            start = ++i;
+            break;
+        default:
+            ++i;
+        }
+    }
+    statement(start, i);
+    return resolve_calls();
+}
+
+/// Given an opening bracket, the index after the bracket closing it
+std::size_t Recognizer::skip_balanced(std::size_t i) const {
+    int depth = 0;
+    for (; !is(i, tok::eof); ++i) {
+        switch (at(i).kind) {
+        case tok::l_paren:
+        case tok::l_square:
+        case tok::l_brace:
+            ++depth;
+            break;
+        case tok::r_paren:
+        case tok::r_square:
+        case tok::r_brace:
+            if (--depth <= 0) {
+                return i + 1;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return i;
+}
+
+/// Given a '<', the index after the '>' closing a template argument list,
+/// or npos if the '<' is a comparison. A template header's list may also
+/// hold default arguments.
+std::size_t Recognizer::skip_angles(std::size_t i, std::size_t e,
+                                    bool header) const {
+    int depth = 0;
+    while (i < e) {
+        switch (at(i).kind) {
+        case tok::less:
+            ++depth;
+            break;
+        case tok::greater:
+            if (--depth == 0) {
+                return i + 1;
+            }
+            break;
+        case tok::greatergreater:
+            depth -= 2;
+            if (depth <= 0) {
+                return depth == 0 ? i + 1 : npos;
+            }
+            break;
+        case tok::l_paren:
+        case tok::l_square:
+            i = skip_balanced(i);
+            continue;
+        case tok::semi:
+        case tok::l_brace:
+        case tok::r_brace:
+            return npos;
+        case tok::equal:
+        case tok::ampamp:
+        case tok::pipepipe:
+        case tok::equalequal:
+        case tok::exclaimequal:
+        case tok::lessequal:
+        case tok::greaterequal:
+            if (!header) {
+                return npos;
+            }
+            break;
+        default:
+            break;
+        }
+        ++i;
+    }
+    return npos;
+}
+
+std::size_t Recognizer::skip_attribute(std::size_t i, std::size_t e) const {
+    if (i >= e) {
+        return i;
+    }
+    if (is(i, tok::l_square) && is(i + 1, tok::l_square)) {
+        return skip_balanced(i);
+    }
+    if ((is(i, tok::kw_alignas) || is_text(i, "__attribute__") ||
+         is(i, tok::kw___attribute) || is_text(i, "__declspec")) &&
+        is(i + 1, tok::l_paren)) {
+        return skip_balanced(i + 1);
+    }
+    return i;
+}
+
+std::size_t Recognizer::skip_attributes(std::size_t i, std::size_t e) const {
+    for (auto next = skip_attribute(i, e); next != i;
+         next = skip_attribute(i, e)) {
+        i = next;
+    }
+    return i;
+}
+
+std::size_t Recognizer::skip_template_headers(std::size_t i,
+                                              std::size_t e) const {
+    while (is(i, tok::kw_template) && is(i + 1, tok::less)) {
+        auto close = skip_angles(i + 1, e, true);
+        if (close == npos) {
+            return i;
+        }
+        i = close;
+    }
+    return i;
+}
+
+/// Skip what may come before the declaration or expression of a statement:
+/// labels, and the heads of control statements. With 'process', variables
+/// declared in conditions are recognized, and calls in them are found.
+std::size_t Recognizer::skip_prefixes(std::size_t s, std::size_t e,
+                                      bool process) {
+    while (s < e) {
+        auto kind = at(s).kind;
+        switch (kind) {
+        case tok::kw_else:
+        case tok::kw_do:
+        case tok::kw_try:
+            ++s;
+            continue;
+        case tok::kw_if:
+            if (is(s + 1, tok::kw_constexpr)) {
+                ++s;
+            }
+        // Fall through
+        case tok::kw_while:
+        case tok::kw_for:
+        case tok::kw_switch:
+        case tok::kw_catch: {
+            if (!is(s + 1, tok::l_paren)) {
+                return s;
+            }
+            auto close = skip_balanced(s + 1);
+            if (process) {
+                condition(kind, s + 2, close - 1);
+            }
+            s = close;
+            continue;
+        }
+        case tok::kw_case:
+            while (s < e && !is(s, tok::colon)) {
+                s = is(s, tok::l_paren) ? skip_balanced(s) : s + 1;
+            }
+            ++s;
+            continue;
+        case tok::kw_default:
+        case tok::kw_public:
+        case tok::kw_protected:
+        case tok::kw_private:
+            if (!is(s + 1, tok::colon)) {
+                return s;
+            }
+            s += 2;
+            continue;
+        case tok::identifier:
+            if (!is(s + 1, tok::colon) || !in_function()) {
+                return s;
+            }
+            s += 2;
+            continue;
+        default:
+            return s;
+        }
+    }
+    return s;
+}
+
+/// The first 'kind' token outside brackets, or npos
+std::size_t Recognizer::find_top_level(std::size_t s, std::size_t e,
+                                       tok::TokenKind kind) const {
+    for (auto i = s; i < e;) {
+        if (is(i, kind)) {
+            return i;
+        }
+        if (is(i, tok::l_paren) || is(i, tok::l_square) ||
+            is(i, tok::l_brace)) {
+            i = skip_balanced(i);
+        } else {
+            ++i;
+        }
+    }
+    return npos;
+}
+
+/// Split a comma-separated list, keeping template argument lists together
+std::vector<std::pair<std::size_t, std::size_t>>
+Recognizer::split_list(std::size_t s, std::size_t e) const {
+    std::vector<std::pair<std::size_t, std::size_t>> parts;
+    if (s >= e) {
+        return parts;
+    }
+    auto start = s;
+    for (auto i = s; i < e;) {
+        switch (at(i).kind) {
+        case tok::l_paren:
+        case tok::l_square:
+        case tok::l_brace:
+            i = skip_balanced(i);
+            continue;
+        case tok::less:
+            if (i > s && is(i - 1, tok::identifier)) {
+                auto close = skip_angles(i, e, false);
+                if (close != npos) {
+                    i = close;
+                    continue;
+                }
+            }
+            break;
+        case tok::comma:
+            parts.emplace_back(start, i);
+            start = i + 1;
+            break;
+        default:
+            break;
+        }
+        ++i;
+    }
+    parts.emplace_back(start, e);
+    return parts;
+}
+
+/// The end of the first item of a comma-separated list
+std::size_t Recognizer::item_end(std::size_t s, std::size_t e) const {
+    auto parts = split_list(s, e);
+    return parts.empty() ? e : parts.front().second;
+}
+
+/// A possibly qualified name such as '::std::vector<int>', or 'i' if there
+/// is none. Its tokens are added to 'tokens'.
+std::size_t Recognizer::qualified_name(std::size_t i, std::size_t e,
+                                       std::vector<std::size_t>* tokens) const {
+    auto start = i;
+    if (is(i, tok::coloncolon)) {
+        ++i;
+    }
+    for (;;) {
+        if (is(i, tok::kw_template)) {
+            ++i;
+        }
+        if (i >= e || !is(i, tok::identifier)) {
+            return start;
+        }
+        ++i;
+        if (is(i, tok::less)) {
+            auto close = skip_angles(i, e, false);
+            if (close != npos) {
+                i = close;
+            }
+        }
+        // A '::' followed by anything else (e.g. 'S::~S') is left to the
+        // declarator
+        if (i + 1 >= e || !is(i, tok::coloncolon) ||
+            !(is(i + 1, tok::identifier) || is(i + 1, tok::kw_template))) {
+            break;
+        }
+        ++i;
+    }
+    if (tokens) {
+        for (auto j = start; j < i; ++j) {
+            tokens->push_back(j);
+        }
+    }
+    return i;
+}
+
+std::size_t Recognizer::declarator_id(std::size_t i, std::size_t e,
+                                      DeclaratorId& id) const {
+    if (is(i, tok::coloncolon)) {
+        ++i;
+    }
+    for (;;) {
+        if (i >= e) {
+            return npos;
+        }
+        if (is(i, tok::tilde) && is(i + 1, tok::identifier)) {
+            id.name = "~" + at(i + 1).text.str();
+            id.special = true;
+            return i + 2;
+        }
+        if (is(i, tok::kw_operator)) {
+            return operator_name(i, e, id);
+        }
+        if (!is(i, tok::identifier)) {
+            return npos;
+        }
+        auto name = at(i).text.str();
+        ++i;
+        if (is(i, tok::less)) {
+            auto close = skip_angles(i, e, false);
+            if (close != npos) {
+                i = close;
+            }
+        }
+        if (!is(i, tok::coloncolon) || i + 1 >= e) {
+            id.name = name;
+            return i;
+        }
+        id.qualifiers.push_back(name);
+        ++i;
+    }
+}
+
+/// The name of an operator function, as clang gives it: 'operator==',
+/// 'operator()', 'operator new' or, for a conversion, 'operator bool'
+std::size_t Recognizer::operator_name(std::size_t i, std::size_t e,
+                                      DeclaratorId& id) const {
+    id.special = true;
+    auto j = i + 1;
+    if ((is(j, tok::l_paren) && is(j + 1, tok::r_paren)) ||
+        (is(j, tok::l_square) && is(j + 1, tok::r_square))) {
+        id.name = "operator" + at(j).text.str() + at(j + 1).text.str();
+        return j + 2;
+    }
+    if (is(j, tok::kw_new) || is(j, tok::kw_delete)) {
+        id.name = "operator " + at(j).text.str();
+        ++j;
+        if (is(j, tok::l_square) && is(j + 1, tok::r_square)) {
+            id.name += "[]";
+            j += 2;
+        }
+        return j;
+    }
+    if (j >= e || is(j, tok::l_paren)) {
+        return npos;
+    }
+    if (tok::getPunctuatorSpelling(at(j).kind)) {
+        id.name = "operator" + at(j).text.str();
+        return j + 1;
+    }
+    auto open = j;
+    while (open < e && !is(open, tok::l_paren)) {
+        ++open;
+    }
+    id.conversion = spell(j, open);
+    id.name = "operator " + id.conversion;
+    return open;
+}
+
+/// Given the start of a statement ending at 'e', the class key of the class
+/// (or enum) it is the head of, or npos
+std::size_t Recognizer::class_head(std::size_t s, std::size_t e) const {
+    s = skip_template_headers(s, e);
+    // A class may be defined as part of a declaration, e.g. in
+    // 'typedef struct {...} S;'
+    for (;;) {
+        auto next = skip_attribute(s, e);
+        if (next != s) {
+            s = next;
+        } else if (is_specifier(at(s).kind) || is_cv(at(s).kind)) {
+            ++s;
+        } else {
+            break;
+        }
+    }
+    auto key = s;
+    if (!is_class_key(at(key).kind) && !is(key, tok::kw_enum)) {
+        return npos;
+    }
+    ++s;
+    if (is(key, tok::kw_enum) &&
+        (is(s, tok::kw_class) || is(s, tok::kw_struct))) {
+        ++s;
+    }
+    s = skip_attributes(s, e);
+    s = qualified_name(s, e, nullptr);
+    if (is_text(s, "final") || is_text(s, "sealed")) {
+        ++s;
+    }
+    return s == e || is(s, tok::colon) ? key : npos;
+}
+
+void Recognizer::decl_specifiers(std::size_t i, std::size_t e,
+                                 DeclSpec& spec) const {
+    spec.begin = i;
+    while (i < e) {
+        auto next = skip_attribute(i, e);
+        if (next != i) {
+            i = next;
+            continue;
+        }
+        auto kind = at(i).kind;
+        if (is_specifier(kind)) {
+            spec.is_static |= kind == tok::kw_static;
+            spec.is_typedef |= kind == tok::kw_typedef;
+            spec.is_friend |= kind == tok::kw_friend;
+            spec.is_constexpr |= kind == tok::kw_constexpr;
+            ++i;
+        } else if (is_cv(kind)) {
+            spec.type.push_back(i++);
+        } else if (is_builtin_type(kind)) {
+            spec.type.push_back(i++);
+            spec.has_type = true;
+        } else if (kind == tok::kw_decltype || kind == tok::kw_typeof) {
+            auto end = is(i + 1, tok::l_paren) ? skip_balanced(i + 1) : i + 1;
+            for (; i < end; ++i) {
+                spec.type.push_back(i);
+            }
+            spec.has_type = true;
+        } else if (spec.has_type) {
+            // The name being declared
+            break;
+        } else if (is_class_key(kind) || kind == tok::kw_enum ||
+                   kind == tok::kw_typename) {
+            if (is_class_key(kind)) {
+                spec.class_key = i;
+            }
+            spec.type.push_back(i++);
+            if (kind == tok::kw_enum &&
+                (is(i, tok::kw_class) || is(i, tok::kw_struct))) {
+                spec.type.push_back(i++);
+            }
+            i = qualified_name(skip_attributes(i, e), e, &spec.type);
+            spec.has_type = true;
+        } else {
+            auto end = qualified_name(i, e, &spec.type);
+            if (end == i) {
+                break;
+            }
+            i = end;
+            spec.has_type = true;
+        }
+    }
+    spec.end = i;
+}
+
+/// Whether what was taken for a type is the name of a constructor, as in
+/// 'S(int);' in the class S or 'S::S(int) {'
+bool Recognizer::names_constructor(const DeclSpec& spec) const {
+    std::vector<llvm::StringRef> names;
+    for (auto i : spec.type) {
+        if (is(i, tok::identifier)) {
+            names.push_back(at(i).text);
+        } else if (!is(i, tok::coloncolon)) {
+            // e.g. 'const', or template arguments
+            if (is(i, tok::less) || is_cv(at(i).kind) ||
+                is_builtin_type(at(i).kind)) {
+                return false;
+            }
+        }
+    }
+    if (names.size() >= 2) {
+        return names.back() == names[names.size() - 2];
+    }
+    if (names.size() == 1 && in_record()) {
+        const auto& record = m_scopes.back().contexts.front().second;
+        return names.back() == record;
+    }
+    return false;
+}
+
+/// Whether a parenthesized list item declares a parameter rather than being
+/// an argument. In a function, 'Foo x(y);' initializes a variable, while
+/// elsewhere 'Foo f(Bar);' declares a function.
+bool Recognizer::looks_like_parameter(std::size_t s, std::size_t e) const {
+    if (s >= e) {
+        return false;
+    }
+    auto kind = at(s).kind;
+    if (kind == tok::ellipsis || is_builtin_type(kind) || is_cv(kind) ||
+        is_class_key(kind) || kind == tok::kw_enum ||
+        kind == tok::kw_typename || kind == tok::kw_decltype ||
+        kind == tok::kw_register || skip_attribute(s, e) != s) {
+        return true;
+    }
+    if (kind != tok::identifier) {
+        return false;
+    }
+    auto i = qualified_name(s, e, nullptr);
+    while (i < e && is_cv(at(i).kind)) {
+        ++i;
+    }
+    if (i == e) {
+        return !in_function();
+    }
+    switch (at(i).kind) {
+    case tok::identifier:
+    case tok::star:
+    case tok::amp:
+    case tok::ampamp:
+    case tok::ellipsis:
+    case tok::l_square:
+        return true;
+    case tok::equal:
+        return !in_function();
+    case tok::l_paren:
+        return is(i + 1, tok::star) || is(i + 1, tok::amp);
+    default:
+        return false;
+    }
+}
+
+bool Recognizer::looks_like_parameters(std::size_t open,
+                                       std::size_t close) const {
+    for (const auto& part : split_list(open + 1, close - 1)) {
+        if (!looks_like_parameter(part.first, part.second)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Parse one declarator from 'i', returning the index after it, or npos if
+/// there is none. A 'special' declarator (a constructor, destructor or
+/// conversion) has no return type. With 'head', the statement is followed
+/// by a body, so a constructor's member initializers may end it.
+std::size_t Recognizer::declarator(std::size_t i, std::size_t e,
+                                   const DeclSpec& spec, bool special,
+                                   bool head, Declarator& d) const {
+    auto type = spec.type;
+    while (i < e) {
+        auto next = skip_attribute(i, e);
+        if (next != i) {
+            i = next;
+        } else if (is_pointer_operator(at(i).kind) || is_cv(at(i).kind) ||
+                   is(i, tok::ellipsis)) {
+            type.push_back(i++);
+        } else {
+            break;
+        }
+    }
+
+    std::string suffix;
+    if (is(i, tok::l_paren) && (is(i + 1, tok::star) || is(i + 1, tok::amp))) {
+        // A pointer to a function or array, e.g. 'int (*f)(int)'
+        auto close = skip_balanced(i);
+        auto j = i + 1;
+        while (j < close - 1 && (is_pointer_operator(at(j).kind) ||
+                                 is_cv(at(j).kind))) {
+            ++j;
+        }
+        // Otherwise it is an expression, e.g. 'f(*p, q)'
+        if (declarator_id(j, close - 1, d.id) != close - 1) {
+            return npos;
+        }
+        suffix = " (" + spell(i + 1, j) + ")";
+        i = close;
+        d.end = close - 1;
+        while (i < e && (is(i, tok::l_paren) || is(i, tok::l_square))) {
+            auto end = skip_balanced(i);
+            suffix += spell(i, end);
+            d.end = end - 1;
+            i = end;
+        }
+    } else {
+        i = declarator_id(i, e, d.id);
+        if (i == npos) {
+            return npos;
+        }
+        d.end = i - 1;
+        special |= d.id.special;
+        if (is(i, tok::l_paren)) {
+            auto close = skip_balanced(i);
+            if (close > e) {
+                return npos;
+            }
+            if (special || looks_like_parameters(i, close)) {
+                d.function = true;
+                d.params_begin = i + 1;
+                d.params_end = close - 1;
+                d.end = close - 1;
+                i = close;
+            } else {
+                // 'Foo x(1, 2)'
+                d.init_begin = i + 1;
+                d.init_end = close - 1;
+                d.end = close - 1;
+                i = close;
+            }
+        } else {
+            while (is(i, tok::l_square)) {
+                auto close = skip_balanced(i);
+                suffix += (suffix.empty() ? " " : "") + spell(i, close);
+                d.end = close - 1;
+                i = close;
+            }
+        }
+    }
+
+    if (d.function) {
+        std::string trailing;
+        for (;;) {
+            auto next = skip_attribute(i, e);
+            if (next != i) {
+                i = next;
+            } else if (i < e && (is_cv(at(i).kind) || is(i, tok::amp) ||
+                                 is(i, tok::ampamp) || is_text(i, "override") ||
+                                 is_text(i, "final"))) {
+                d.end = i++;
+            } else if (i < e &&
+                       (is(i, tok::kw_noexcept) || is(i, tok::kw_throw))) {
+                d.end = i++;
+                if (is(i, tok::l_paren)) {
+                    i = skip_balanced(i);
+                    d.end = i - 1;
+                }
+            } else if (i < e && is(i, tok::arrow)) {
+                auto end = i + 1;
+                while (end < e && !is(end, tok::equal) &&
+                       !is(end, tok::colon) && !is(end, tok::comma)) {
+                    end = is(end, tok::l_paren) ? skip_balanced(end) : end + 1;
+                }
+                trailing = spell(i + 1, end);
+                d.end = end - 1;
+                i = end;
+            } else {
+                break;
+            }
+        }
+        // '= 0', '= default' or '= delete'
+        if (is(i, tok::equal) && i + 2 <= e) {
+            i += 2;
+        }
+        if (head && is(i, tok::colon)) {
+            d.init_begin = i + 1;
+            d.init_end = e;
+            i = e;
+        }
+        if (special) {
+            d.type = d.id.conversion.empty() ? "void" : d.id.conversion;
+        } else if (!trailing.empty()) {
+            d.type = trailing;
+        } else {
+            d.type = spell(type);
+        }
+        return i;
+    }
+
+    if (i < e && is(i, tok::colon)) {
+        // A bit-field's width
+        auto end = item_end(i, e);
+        d.end = end - 1;
+        i = end;
+    } else if (i < e && is(i, tok::equal)) {
+        auto end = item_end(i + 1, e);
+        d.init_begin = i + 1;
+        d.init_end = end;
+        d.end = end - 1;
+        i = end;
+    } else if (i < e && is(i, tok::l_brace)) {
+        auto close = skip_balanced(i);
+        d.init_begin = i + 1;
+        d.init_end = close - 1;
+        d.end = close - 1;
+        i = close;
+    }
+    d.type = (spec.is_constexpr ? "const " : "") + spell(type) + suffix;
+    return i;
+}
+
+Recognizer::Declared Recognizer::declaration(std::size_t s, std::size_t e,
+                                             bool head) {
+    Declared result;
+    s = skip_template_headers(s, e);
+    if (is(s, tok::kw_extern) && is(s + 1, tok::string_literal)) {
+        s += 2;
+    }
+    if (s >= e) {
+        return result;
+    }
+    switch (at(s).kind) {
+    case tok::kw_template:
+    case tok::kw_typedef:
+    case tok::kw_using:
+    case tok::kw_namespace:
+    case tok::kw_static_assert:
+    case tok::kw_enum:
+    case tok::kw_asm:
+        // Nothing a search reports
+        result.declaration = true;
+        return result;
+    default:
+        break;
+    }
+
+    DeclSpec spec;
+    decl_specifiers(s, e, spec);
+    if (spec.is_typedef) {
+        result.declaration = true;
+        return result;
+    }
+    auto i = spec.end;
+    bool special = false;
+    if (spec.has_type &&
+        (is(i, tok::coloncolon) ||
+         (is(i, tok::l_paren) && names_constructor(spec)))) {
+        // The name was taken for a type, e.g. in 'S::S(', 'S::~S(' or
+        // 'S::operator bool('
+        i = spec.type.front();
+        spec.type.clear();
+        special = true;
+    } else if (!spec.has_type) {
+        if (!is(i, tok::tilde) && !is(i, tok::kw_operator)) {
+            return result;
+        }
+        special = true;
+    }
+
+    if (spec.class_key != npos && i == e) {
+        // 'class S;'
+        DeclaratorId id;
+        declarator_id(spec.class_key + 1, e, id);
+        if (!spec.is_friend) {
+            auto qualifiers = qualify(id.qualifiers);
+            auto here = contexts();
+            qualifiers.insert(qualifiers.end(), here.begin(), here.end());
+            add(IndexedDecl::RecordKind, id.name, spec.class_key, e - 1,
+                std::move(qualifiers));
+            m_known[id.name] = IndexedDecl::RecordContext;
+        }
+        result.declaration = true;
+        return result;
+    }
+
+    std::vector<Declarator> declarators;
+    for (;;) {
+        Declarator d;
+        i = declarator(i, e, spec, special, head, d);
+        if (i == npos) {
+            return result;
+        }
+        declarators.push_back(std::move(d));
+        if (i < e && is(i, tok::comma)) {
+            ++i;
+            continue;
+        }
+        if (i != e) {
+            return result;
+        }
+        break;
+    }
+    result.declaration = true;
+
+    auto here = contexts();
+    for (const auto& d : declarators) {
+        auto qualifiers = qualify(d.id.qualifiers);
+        qualifiers.insert(qualifiers.end(), here.begin(), here.end());
+        if (!d.function) {
+            // Other members are fields, which are not variables
+            if ((!in_record() || spec.is_static) && !spec.is_friend) {
+                auto index = add(IndexedDecl::VariableKind, d.id.name,
+                                 spec.begin, d.end, std::move(qualifiers));
+                m_decls[index].type = d.type;
+            }
+            scan_calls(d.init_begin, d.init_end);
+            continue;
+        }
+
+        auto index = add(IndexedDecl::FunctionKind, d.id.name, spec.begin,
+                         d.end, qualifiers);
+        m_decls[index].type = d.type;
+        // A function's parameters and body are in its own context
+        std::vector<context_t> inner{{IndexedDecl::OtherContext, d.id.name}};
+        auto explicit_qualifiers = qualify(d.id.qualifiers);
+        inner.insert(inner.end(), explicit_qualifiers.begin(),
+                     explicit_qualifiers.end());
+        auto function_contexts = m_scopes.back().contexts;
+        m_scopes.push_back({Scope::Function, inner, index});
+        parameters(d.params_begin, d.params_end, index);
+        scan_calls(d.init_begin, d.init_end);
+        m_scopes.pop_back();
+        if (head && &d == &declarators.back()) {
+            result.function = index;
+            result.contexts = std::move(inner);
+        }
+    }
+    return result;
+}
+
+/// Add the parameters of a function, within its scope
+void Recognizer::parameters(std::size_t s, std::size_t e,
+                            std::size_t function) {
+    auto parts = split_list(s, e);
+    if (parts.size() == 1 && parts[0].second == parts[0].first + 1 &&
+        is(parts[0].first, tok::kw_void)) {
+        // '(void)'
+        return;
+    }
+    for (const auto& part : parts) {
+        if (part.first == part.second || is(part.first, tok::ellipsis)) {
+            continue;
+        }
+        DeclSpec spec;
+        decl_specifiers(part.first, part.second, spec);
+        Declarator d;
+        auto end = declarator(spec.end, part.second, spec, false, false, d);
+        if (end == npos) {
+            // Unnamed, e.g. 'int' or 'const char*'
+            auto stop = find_top_level(spec.end, part.second, tok::equal);
+            if (stop == npos) {
+                stop = part.second;
+            }
+            auto type = spec.type;
+            for (auto i = spec.end; i < stop; ++i) {
+                type.push_back(i);
+            }
+            d.type = spell(type);
+            d.id.name.clear();
+            auto equal = find_top_level(part.first, part.second, tok::equal);
+            if (equal != npos) {
+                d.init_begin = equal + 1;
+                d.init_end = part.second;
+            }
+        }
+
+        m_decls[function].parameters.emplace_back(d.type, d.id.name);
+        auto index = add(IndexedDecl::VariableKind, d.id.name, part.first,
+                         part.second - 1, contexts());
+        m_decls[index].type = d.type;
+        scan_calls(d.init_begin, d.init_end);
+    }
+}
+
+/// The parenthesized head of a control statement. A condition can only
+/// declare a variable with an initializer, as in 'if (auto x = f())'.
+void Recognizer::condition(tok::TokenKind kind, std::size_t s,
+                           std::size_t e) {
+    if (kind == tok::kw_for) {
+        // 'init; condition; increment' or 'declaration : range'
+        auto split = find_top_level(s, e, tok::semi);
+        auto colon = find_top_level(s, e, tok::colon);
+        if (colon < split) {
+            split = colon;
+        }
+        if (split != npos) {
+            if (!declaration(s, split, false).declaration) {
+                scan_calls(s, split);
+            }
+            scan_calls(split + 1, e);
+            return;
+        }
+    }
+    if (kind == tok::kw_catch) {
+        if (!is(s, tok::ellipsis)) {
+            declaration(s, e, false);
+        }
+        return;
+    }
+    if (find_top_level(s, e, tok::equal) != npos &&
+        declaration(s, e, false).declaration) {
+        return;
+    }
+    scan_calls(s, e);
+}
+
+void Recognizer::statement(std::size_t s, std::size_t e) {
+    s = skip_prefixes(s, e, true);
+    if (s >= e) {
+        return;
+    }
+    switch (at(s).kind) {
+    case tok::kw_return:
+    case tok::kw_throw:
+    case tok::kw_goto:
+    case tok::kw_break:
+    case tok::kw_continue:
+    case tok::kw_delete:
+        scan_calls(s + 1, e);
+        return;
+    default:
+        break;
+    }
+    if (!declaration(s, e, false).declaration) {
+        scan_calls(s, e);
+    }
+}
+
+/// Whether a '{' is part of the statement before it (an initializer, a
+/// lambda's body or an enum's enumerators) rather than opening a scope
+bool Recognizer::initializer_brace(std::size_t s, std::size_t i) {
+    s = skip_template_headers(skip_prefixes(s, i, false), i);
+    if (s == i) {
+        return false;
+    }
+    if (is(s, tok::kw_extern) && is(s + 1, tok::string_literal)) {
+        return false;
+    }
+    if (is(s, tok::kw_namespace) ||
+        (is(s, tok::kw_inline) && is(s + 1, tok::kw_namespace))) {
+        return false;
+    }
+    if (is(s, tok::kw_return) || is(s, tok::kw_throw)) {
+        return true;
+    }
+    auto prev = at(i - 1).kind;
+    if (prev == tok::equal || prev == tok::comma) {
+        return true;
+    }
+    for (auto equal = find_top_level(s, i, tok::equal); equal != npos;
+         equal = find_top_level(equal + 1, i, tok::equal)) {
+        if (!is(equal - 1, tok::kw_operator)) {
+            return true;
+        }
+    }
+    auto key = class_head(s, i);
+    if (key != npos) {
+        return is(key, tok::kw_enum);
+    }
+    auto paren = find_top_level(s, i, tok::l_paren);
+    if (paren != npos) {
+        // After a function's parameters, a brace opens its body, unless it
+        // initializes a member, as in 'S() : m{0} {'
+        auto colon = find_top_level(skip_balanced(paren), i, tok::colon);
+        return colon != npos &&
+               (prev == tok::identifier || prev == tok::greater);
+    }
+    // 'int x{0}'
+    return s + 1 < i && (prev == tok::identifier || prev == tok::r_square);
+}
+
+void Recognizer::open_scope(std::size_t s, std::size_t i) {
+    s = skip_prefixes(s, i, true);
+    auto start = skip_template_headers(s, i);
+    if (start == i) {
+        m_scopes.push_back({Scope::Block, {}, npos});
+        return;
+    }
+    if (is(start, tok::kw_extern) && is(start + 1, tok::string_literal)) {
+        // A linkage specification, which is not a named context
+        m_scopes.push_back({Scope::Opaque, {}, npos});
+        return;
+    }
+    if (is(start, tok::kw_inline)) {
+        ++start;
+    }
+    if (is(start, tok::kw_namespace)) {
+        std::vector<std::string> names;
+        for (auto j = start + 1; j < i; ++j) {
+            if (is(j, tok::identifier)) {
+                names.push_back(at(j).text.str());
+                m_known[names.back()] = IndexedDecl::NamespaceContext;
+            }
+        }
+        if (names.empty()) {
+            names.emplace_back();
+        }
+        Scope scope{Scope::Namespace, {}, npos};
+        for (auto name = names.rbegin(); name != names.rend(); ++name) {
+            scope.contexts.emplace_back(IndexedDecl::NamespaceContext, *name);
+        }
+        m_scopes.push_back(std::move(scope));
+        return;
+    }
+
+    auto key = class_head(start, i);
+    if (key != npos) {
+        auto j = key + 1;
+        j = skip_attributes(j, i);
+        DeclaratorId id;
+        declarator_id(j, i, id);
+        auto qualifiers = qualify(id.qualifiers);
+        auto here = contexts();
+        qualifiers.insert(qualifiers.end(), here.begin(), here.end());
+        auto index =
+            add(IndexedDecl::RecordKind, id.name, key, key, qualifiers);
+        if (!id.name.empty()) {
+            m_known[id.name] = IndexedDecl::RecordContext;
+        }
+        Scope scope{Scope::Record,
+                    {{IndexedDecl::RecordContext, id.name}},
+                    index};
+        auto explicit_qualifiers = qualify(id.qualifiers);
+        scope.contexts.insert(scope.contexts.end(),
+                              explicit_qualifiers.begin(),
+                              explicit_qualifiers.end());
+        m_scopes.push_back(std::move(scope));
+        return;
+    }
+
+    auto declared = declaration(s, i, true);
+    if (declared.function != npos) {
+        m_scopes.push_back(
+            {Scope::Function, std::move(declared.contexts), declared.function});
+        return;
+    }
+    if (!declared.declaration) {
+        scan_calls(start, i);
+    }
+    m_scopes.push_back({Scope::Block, {}, npos});
+}
+
+void Recognizer::close_scope(std::size_t i) {
+    // An unmatched '}' (e.g. from an '#if' branch) is ignored
+    if (m_scopes.size() == 1) {
+        return;
+    }
+    auto scope = std::move(m_scopes.back());
+    m_scopes.pop_back();
+    if (scope.decl != npos) {
+        m_decls[scope.decl].range.second = end_position(i);
+    }
+}
+
+/// Find the calls in an expression. The function a call refers to is
+/// only known once the whole file has been seen (see resolve_calls()).
+void Recognizer::scan_calls(std::size_t s, std::size_t e) {
+    if (s == npos) {
+        return;
+    }
+    for (auto i = s; i < e; ++i) {
+        if (!is(i, tok::identifier)) {
+            continue;
+        }
+        auto open = i + 1;
+        if (is(open, tok::less)) {
+            open = skip_angles(open, e, false);
+            if (open == npos) {
+                continue;
+            }
+        }
+        if (open >= e || !is(open, tok::l_paren)) {
+            continue;
+        }
+        // Constructing an object is not a call
+        auto known = m_known.find(at(i).text.str());
+        if ((known != m_known.end() &&
+             known->second == IndexedDecl::RecordContext) ||
+            (i > s && is(i - 1, tok::kw_new))) {
+            continue;
+        }
+
+        // The call starts at the object or qualifier of its callee
+        auto first = i;
+        while (first >= s + 2 &&
+               (is(first - 1, tok::coloncolon) || is(first - 1, tok::period) ||
+                is(first - 1, tok::arrow)) &&
+               (is(first - 2, tok::identifier) ||
+                is(first - 2, tok::kw_this))) {
+            first -= 2;
+        }
+        auto close = std::min(skip_balanced(open), e);
+        auto index = add(IndexedDecl::CallKind, at(i).text.str(), first,
+                         close - 1, {});
+        m_calls.push_back({index, split_list(open + 1, close - 1).size()});
+    }
+}
+
+/// Complete each call from the function it calls: one declared in the file
+/// with the same name, preferring one with as many parameters as the call
+/// has arguments. Calls of functions declared elsewhere are dropped.
+std::vector<IndexedDecl> Recognizer::resolve_calls() {
+    std::unordered_map<std::string, std::vector<std::size_t>> functions;
+    for (std::size_t i = 0; i < m_decls.size(); ++i) {
+        if (m_decls[i].kind == IndexedDecl::FunctionKind) {
+            functions[m_decls[i].name].push_back(i);
+        }
+    }
+
+    std::vector<bool> unresolved(m_decls.size(), false);
+    for (const auto& call : m_calls) {
+        auto& decl = m_decls[call.decl];
+        auto found = functions.find(decl.name);
+        if (found == functions.end()) {
+            unresolved[call.decl] = true;
+            continue;
+        }
+        auto callee = found->second.front();
+        for (auto index : found->second) {
+            if (m_decls[index].parameters.size() == call.arguments) {
+                callee = index;
+                break;
+            }
+        }
+        decl.type = m_decls[callee].type;
+        decl.qualifiers = m_decls[callee].qualifiers;
+        decl.parameters = m_decls[callee].parameters;
+    }
+
+    std::vector<IndexedDecl> decls;
+    decls.reserve(m_decls.size());
+    for (std::size_t i = 0; i < m_decls.size(); ++i) {
+        if (!unresolved[i]) {
+            decls.push_back(std::move(m_decls[i]));
+        }
+    }
+    return decls;
+}
+
+/// Whether a statement is in a function body, where it may declare a local
+bool Recognizer::in_function() const {
+    for (auto scope = m_scopes.rbegin(); scope != m_scopes.rend(); ++scope) {
+        if (scope->kind != Scope::Block) {
+            return scope->kind == Scope::Function;
+        }
+    }
+    return false;
+}
+
+bool Recognizer::in_record() const {
+    return m_scopes.back().kind == Scope::Record;
+}
+
+/// The named contexts enclosing the current scope, innermost first. Like a
+/// chain of DeclContexts, it ends at the first context that is not named,
+/// such as the translation unit or an 'extern "C"' block.
+std::vector<context_t> Recognizer::contexts() const {
+    std::vector<context_t> result;
+    for (auto scope = m_scopes.rbegin(); scope != m_scopes.rend(); ++scope) {
+        if (scope->kind == Scope::Opaque) {
+            break;
+        }
+        result.insert(result.end(), scope->contexts.begin(),
+                      scope->contexts.end());
+    }
+    return result;
+}
+
+/// The contexts named by the qualifiers of a declarator (outermost first),
+/// innermost first. A name not seen as a namespace or class is taken to be
+/// a class if it is innermost (as in an out-of-line member definition),
+/// and a namespace otherwise.
+std::vector<context_t>
+Recognizer::qualify(const std::vector<std::string>& names) const {
+    std::vector<context_t> result;
+    for (auto name = names.rbegin(); name != names.rend(); ++name) {
+        auto known = m_known.find(*name);
+        if (known != m_known.end()) {
+            result.emplace_back(known->second, *name);
+        } else if (result.empty()) {
+            result.emplace_back(IndexedDecl::RecordContext, *name);
+        } else {
+            result.emplace_back(IndexedDecl::NamespaceContext, *name);
+        }
+    }
+    return result;
+}
+
+std::string Recognizer::spell(const std::vector<std::size_t>& tokens) const {
+    std::string result;
+    const LexedToken* prev = nullptr;
+    for (auto i : tokens) {
+        const auto& token = at(i);
+        if (prev && needs_space(*prev, token)) {
+            result += ' ';
+        }
+        result += token.text;
+        prev = &token;
+    }
+    return result;
+}
+
+std::string Recognizer::spell(std::size_t s, std::size_t e) const {
+    std::vector<std::size_t> tokens;
+    for (auto i = s; i < e; ++i) {
+        tokens.push_back(i);
+    }
+    return spell(tokens);
+}
+
+/// The position of the last character of a token, which is where clang's
+/// ranges end
+std::pair<int, int> Recognizer::end_position(std::size_t last) const {
+    const auto& token = at(last);
+    auto length = static_cast<unsigned>(token.text.size());
+    return position(m_lines, token.offset + std::max(length, 1u) - 1);
+}
+
+std::size_t Recognizer::add(IndexedDecl::Kind kind, const std::string& name,
+                            std::size_t first, std::size_t last,
+                            std::vector<context_t> qualifiers) {
+    IndexedDecl decl;
+    decl.kind = kind;
+    decl.name = name;
+    decl.qualifiers = std::move(qualifiers);
+    decl.range = {position(m_lines, at(first).offset), end_position(last)};
+    decl.line = m_lines.line(decl.range.first.first).str();
+
+    m_decls.push_back(std::move(decl));
+    return m_decls.size() - 1;
+}
+
+/// The fields of a recognized declaration, for DeclMatcher
+class LexedDeclFields {
+public:
+    explicit LexedDeclFields(const IndexedDecl& decl) : m_decl(decl) {}
+
+    IndexedDecl::Kind kind() const { return m_decl.kind; }
+    const std::string& name() const { return m_decl.name; }
+    const std::string& type() const { return m_decl.type; }
+
+    std::size_t qualifier_count() const { return m_decl.qualifiers.size(); }
+    IndexedDecl::ContextKind qualifier_kind(std::size_t i) const {
+        return m_decl.qualifiers[i].first;
+    }
+    const std::string& qualifier_name(std::size_t i) const {
+        return m_decl.qualifiers[i].second;
+    }
+
+    std::size_t parameter_count() const { return m_decl.parameters.size(); }
+    const std::string& parameter_type(std::size_t i) const {
+        return m_decl.parameters[i].first;
+    }
+    const std::string& parameter_name(std::size_t i) const {
+        return m_decl.parameters[i].second;
+    }
+
+private:
+    const IndexedDecl& m_decl;
+};
+
+using LexedDeclMatcher = DeclMatcher<LexedDeclFields>;
+}
+
+std::vector<IndexedDecl> lex_declarations(llvm::StringRef source) {
+    return Recognizer(source).run();
+}
+
+bool lexed_match(const IndexedDecl& decl, const CompiledVariable& term) {
+    LexedDeclFields fields(decl);
+    return LexedDeclMatcher(fields)(term);
+}
+
+bool lexed_match(const IndexedDecl& decl, const CompiledFunction& term) {
+    LexedDeclFields fields(decl);
+    return LexedDeclMatcher(fields)(term);
+}
+
+bool lexed_match(const IndexedDecl& decl, const CompiledClass& term) {
+    LexedDeclFields fields(decl);
+    return LexedDeclMatcher(fields)(term);
+}
+
+bool lexed_match(const IndexedDecl& decl, const CompiledTerm& term) {
+    LexedDeclFields fields(decl);
+    return boost::apply_visitor(LexedDeclMatcher(fields), term);
+}
@@ -0,0 +1,562 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+#include "clang/Basic/VirtualFileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "git.hpp"
+
+extern char** environ;
+
+namespace fs = boost::filesystem;
+
+namespace {
+
+/// A git command running as a child process, reading what is written to it
+/// (if it was given 'input') and writing to a pipe that is read from. Its
+/// errors go to our stderr.
+class GitProcess {
+public:
+    GitProcess(const std::vector<std::string>& args, bool input) {
+        int out[2];
+        int in[2] = {-1, -1};
+        if (pipe2(out, O_CLOEXEC) != 0 || (input && pipe2(in, O_CLOEXEC))) {
+            throw std::runtime_error(std::string("Unable to run git: ") +
+                                     std::strerror(errno));
+        }
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+        if (input) {
+            posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+        }
+        std::vector<char*> argv{const_cast<char*>("git")};
+        for (const auto& arg : args) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        auto error = posix_spawnp(&m_pid, "git", &actions, nullptr,
+                                  argv.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+
+        close(out[1]);
+        m_out = out[0];
+        if (input) {
+            close(in[0]);
+            m_in = in[1];
+        }
+        if (error) {
+            close_pipes();
+            throw std::runtime_error(std::string("Unable to run git: ") +
+                                     std::strerror(error));
+        }
+    }
+
+    ~GitProcess() { wait(); }
+
+    GitProcess(const GitProcess&) = delete;
+    GitProcess& operator=(const GitProcess&) = delete;
+
+    void write(const std::string& data) {
+        const char* next = data.data();
+        auto size = data.size();
+        while (size > 0) {
+            auto written = ::write(m_in, next, size);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                throw std::runtime_error("git stopped reading its input");
+            }
+            next += written;
+            size -= written;
+        }
+    }
+
+    /// Read a line, without its newline. Returns false at the end of the
+    /// output.
+    bool read_line(std::string& line) {
+        line.clear();
+        char c;
+        while (read_some(&c, 1)) {
+            if (c == '\n') {
+                return true;
+            }
+            line.push_back(c);
+        }
+        return !line.empty();
+    }
+
+    void read(char* data, std::size_t size) {
+        while (size > 0) {
+            auto got = read_some(data, size);
+            if (got == 0) {
+                throw std::runtime_error("git stopped unexpectedly");
+            }
+            data += got;
+            size -= got;
+        }
+    }
+
+    std::string read_all() {
+        std::string output;
+        char chunk[65536];
+        while (auto got = read_some(chunk, sizeof(chunk))) {
+            output.append(chunk, got);
+        }
+        return output;
+    }
+
+    /// Wait for git to exit, returning whether it succeeded
+    bool wait() {
+        close_pipes();
+        if (m_pid < 0) {
+            return m_status;
+        }
+        int status;
+        while (waitpid(m_pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        m_pid = -1;
+        m_status = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        return m_status;
+    }
+
+private:
+    /// Read what is buffered, or else what is available from the pipe
+    std::size_t read_some(char* data, std::size_t size) {
+        if (m_next == m_end) {
+            ssize_t got;
+            do {
+                got = ::read(m_out, m_buffer, sizeof(m_buffer));
+            } while (got < 0 && errno == EINTR);
+            if (got <= 0) {
+                return 0;
+            }
+            m_next = m_buffer;
+            m_end = m_buffer + got;
+        }
+        auto count = std::min<std::size_t>(size, m_end - m_next);
+        std::memcpy(data, m_next, count);
+        m_next += count;
+        return count;
+    }
+
+    void close_pipes() {
+        if (m_in >= 0) {
+            close(m_in);
+            m_in = -1;
+        }
+        if (m_out >= 0) {
+            close(m_out);
+            m_out = -1;
+        }
+    }
+
+    pid_t m_pid = -1;
+    bool m_status = false;
+    int m_in = -1;
+    int m_out = -1;
+    char m_buffer[65536];
+    char* m_next = m_buffer;
+    char* m_end = m_buffer;
+};
+
+/// Run a git command to completion and return its output. Throws
+/// std::runtime_error with 'error' if it fails.
+std::string git_output(const std::vector<std::string>& args,
+                       const std::string& error) {
+    GitProcess git(args, false);
+    auto output = git.read_all();
+    if (!git.wait()) {
+        throw std::runtime_error(error);
+    }
+    return output;
+}
+
+/// Split the output of a command given '-z'
+std::vector<std::string> split_z(const std::string& output) {
+    std::vector<std::string> parts;
+    std::size_t start = 0;
+    for (auto end = output.find('\0'); end != std::string::npos;
+         end = output.find('\0', start)) {
+        parts.push_back(output.substr(start, end - start));
+        start = end + 1;
+    }
+    return parts;
+}
+
+std::string toplevel() {
+    auto top = git_output({"rev-parse", "--show-toplevel"},
+                          "Not in a git repository");
+    if (!top.empty() && top.back() == '\n') {
+        top.pop_back();
+    }
+    return top;
+}
+
+/// The absolute path of 'file' (relative to 'directory'), with '.' and '..'
+/// resolved as git resolves them, without following symbolic links
+std::string normal_path(const std::string& directory,
+                        const std::string& file) {
+    auto path = file.compare(0, 1, "/") == 0 ? file : directory + '/' + file;
+    std::vector<std::string> parts;
+    std::size_t start = 0;
+    while (start <= path.size()) {
+        auto end = path.find('/', start);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+        auto part = path.substr(start, end - start);
+        if (part == "..") {
+            if (!parts.empty()) {
+                parts.pop_back();
+            }
+        } else if (!part.empty() && part != ".") {
+            parts.push_back(part);
+        }
+        start = end + 1;
+    }
+    std::string normal;
+    for (const auto& part : parts) {
+        normal += '/' + part;
+    }
+    return normal.empty() ? "/" : normal;
+}
+
+/// Parse the header 'git cat-file' writes for an object, '<object> <type>
+/// <size>'. Returns false for any other line, such as '<name> missing'.
+bool parse_object_header(const std::string& header, std::string& type,
+                         std::uint64_t& size) {
+    auto type_start = header.find(' ');
+    if (type_start == std::string::npos) {
+        return false;
+    }
+    auto size_start = header.find(' ', type_start + 1);
+    if (size_start == std::string::npos || size_start + 1 == header.size() ||
+        header.find_first_not_of("0123456789", size_start + 1) !=
+            std::string::npos) {
+        return false;
+    }
+    type = header.substr(type_start + 1, size_start - type_start - 1);
+    size = std::stoull(header.substr(size_start + 1));
+    return true;
+}
+
+/// A path's entry in a revision
+struct RevisionEntry {
+    /// Whether the path is in the repository, so the revision decides
+    /// whether it exists
+    bool in_repository = false;
+    bool exists = false;
+    bool directory = false;
+    std::uint64_t size = 0;
+};
+
+/// The blobs of a revision, read by a 'git cat-file --batch' shared by
+/// every file searched, and looked up by a 'git cat-file --batch-check'
+class Revision {
+public:
+    explicit Revision(const std::string& rev)
+        : m_name{rev}, m_top{toplevel()},
+          m_directory{fs::current_path().string()},
+          m_commit{git_output({"rev-parse", "--verify", "--quiet",
+                               rev + "^{commit}"},
+                              "Unknown revision '" + rev + "'")},
+          m_objects({"cat-file", "--batch"}, true),
+          m_checks({"cat-file", "--batch-check"}, true) {
+        if (!m_commit.empty() && m_commit.back() == '\n') {
+            m_commit.pop_back();
+        }
+    }
+
+    const std::string& commit() const { return m_commit; }
+
+    std::unique_ptr<llvm::MemoryBuffer> read(const std::string& file) {
+        auto name = object_name(file);
+        if (name.empty()) {
+            throw std::runtime_error("Not in the repository");
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_objects.write(name + '\n');
+        // The header is followed by the content and a newline
+        std::string header;
+        if (!m_objects.read_line(header)) {
+            throw std::runtime_error("git stopped unexpectedly");
+        }
+        std::string type;
+        std::uint64_t length;
+        if (!parse_object_header(header, type, length)) {
+            throw std::runtime_error("Not in revision " + m_name);
+        }
+        auto buffer = llvm::MemoryBuffer::getNewUninitMemBuffer(length, file);
+        auto data = const_cast<char*>(buffer->getBufferStart());
+        m_objects.read(data, length);
+        char newline;
+        m_objects.read(&newline, 1);
+        if (type != "blob") {
+            throw std::runtime_error("Not a file in revision " + m_name);
+        }
+        return buffer;
+    }
+
+    RevisionEntry entry(const std::string& file) {
+        RevisionEntry entry;
+        auto name = object_name(file);
+        if (name.empty()) {
+            return entry;
+        }
+        entry.in_repository = true;
+
+        std::lock_guard<std::mutex> lock(m_checks_mutex);
+        m_checks.write(name + '\n');
+        std::string header;
+        if (!m_checks.read_line(header)) {
+            throw std::runtime_error("git stopped unexpectedly");
+        }
+        std::string type;
+        if (parse_object_header(header, type, entry.size)) {
+            entry.exists = type == "blob" || type == "tree";
+            entry.directory = type == "tree";
+        }
+        return entry;
+    }
+
+private:
+    /// The name of 'file' in the revision, as 'git cat-file' reads it, or
+    /// an empty string if the file is outside the repository
+    std::string object_name(const std::string& file) const {
+        auto path = normal_path(m_directory, file);
+        if (path == m_top) {
+            return m_commit + ':';
+        }
+        if (path.compare(0, m_top.size() + 1, m_top + '/') != 0) {
+            return {};
+        }
+        return m_commit + ':' + path.substr(m_top.size() + 1);
+    }
+
+    std::string m_name;
+    std::string m_top;
+    std::string m_directory;
+    std::string m_commit;
+    std::mutex m_mutex;
+    GitProcess m_objects;
+    std::mutex m_checks_mutex;
+    GitProcess m_checks;
+};
+
+std::mutex revisions_mutex;
+std::map<std::string, std::unique_ptr<Revision>> revisions;
+
+Revision& revision(const po::variables_map& config) {
+    const auto& rev = config["rev"].as<std::string>();
+    std::lock_guard<std::mutex> lock(revisions_mutex);
+    auto& found = revisions[rev];
+    if (!found) {
+        found.reset(new Revision(rev));
+    }
+    return *found;
+}
+
+/// A file of a revision, opened by clang
+class RevisionFile : public clang::vfs::File {
+public:
+    RevisionFile(const clang::vfs::Status& status,
+                 std::unique_ptr<llvm::MemoryBuffer> buffer)
+        : m_status(status), m_buffer{std::move(buffer)} {}
+
+    llvm::ErrorOr<clang::vfs::Status> status() override { return m_status; }
+
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>
+    getBuffer(const llvm::Twine&, int64_t, bool, bool) override {
+        if (!m_buffer) {
+            return std::make_error_code(std::errc::bad_file_descriptor);
+        }
+        return std::move(m_buffer);
+    }
+
+    std::error_code close() override {
+        m_buffer.reset();
+        return {};
+    }
+
+    void setName(llvm::StringRef name) override { m_status.setName(name); }
+
+private:
+    clang::vfs::Status m_status;
+    std::unique_ptr<llvm::MemoryBuffer> m_buffer;
+};
+
+/// Serves the paths in the repository from a revision, and all others from
+/// the real file system
+class RevisionFileSystem : public clang::vfs::FileSystem {
+public:
+    explicit RevisionFileSystem(Revision& revision)
+        : m_revision(revision), m_real{clang::vfs::getRealFileSystem()} {}
+
+    llvm::ErrorOr<clang::vfs::Status>
+    status(const llvm::Twine& path) override {
+        auto name = path.str();
+        RevisionEntry entry;
+        if (auto error = lookup(name, entry)) {
+            return error;
+        }
+        if (!entry.in_repository) {
+            return m_real->status(path);
+        }
+        return file_status(name, entry);
+    }
+
+    llvm::ErrorOr<std::unique_ptr<clang::vfs::File>>
+    openFileForRead(const llvm::Twine& path) override {
+        auto name = path.str();
+        RevisionEntry entry;
+        if (auto error = lookup(name, entry)) {
+            return error;
+        }
+        if (!entry.in_repository) {
+            return m_real->openFileForRead(path);
+        }
+        if (entry.directory) {
+            return std::make_error_code(std::errc::is_a_directory);
+        }
+        try {
+            return std::unique_ptr<clang::vfs::File>(new RevisionFile(
+                file_status(name, entry), m_revision.read(name)));
+        } catch (const std::runtime_error&) {
+            return std::make_error_code(std::errc::io_error);
+        }
+    }
+
+    /// The revision's directories are not listed (clang only lists
+    /// directories to find modules)
+    clang::vfs::directory_iterator dir_begin(const llvm::Twine& dir,
+                                             std::error_code& error) override {
+        RevisionEntry entry;
+        error = lookup(dir.str(), entry);
+        if (!error && !entry.in_repository) {
+            return m_real->dir_begin(dir, error);
+        }
+        return {};
+    }
+
+private:
+    /// Look up a path in the revision. A path that is not in it is an
+    /// error, so clang goes on to look in the next include directory.
+    std::error_code lookup(const std::string& path, RevisionEntry& entry) {
+        try {
+            entry = m_revision.entry(path);
+        } catch (const std::runtime_error&) {
+            return std::make_error_code(std::errc::io_error);
+        }
+        if (entry.in_repository && !entry.exists) {
+            return std::make_error_code(std::errc::no_such_file_or_directory);
+        }
+        return {};
+    }
+
+    /// A file in the working tree keeps its own unique ID, so that with
+    /// '--follow-includes' a header included from the revision is known
+    /// to be the one searched on its own (see IncludedHeaders)
+    clang::vfs::Status file_status(const std::string& path,
+                                   const RevisionEntry& entry) const {
+        auto absolute = normal_path(fs::current_path().string(), path);
+        struct stat info;
+        auto id = stat(absolute.c_str(), &info) == 0
+                      ? llvm::sys::fs::UniqueID(info.st_dev, info.st_ino)
+                      : llvm::sys::fs::UniqueID(
+                            ~0ull, std::hash<std::string>()(absolute));
+        return clang::vfs::Status(
+            path, path, id, llvm::sys::TimeValue(), 0, 0, entry.size,
+            entry.directory ? llvm::sys::fs::file_type::directory_file
+                            : llvm::sys::fs::file_type::regular_file,
+            llvm::sys::fs::all_read);
+    }
+
+    Revision& m_revision;
+    llvm::IntrusiveRefCntPtr<clang::vfs::FileSystem> m_real;
+};
+}
+
+void load_revision(const po::variables_map& config) {
+    if (config.count("rev")) {
+        revision(config);
+    }
+}
+
+std::vector<std::string> revision_files(const std::vector<std::string>& paths,
+                                        const po::variables_map& config) {
+    const auto& rev = revision(config);
+    std::vector<std::string> args{"ls-tree", "-r", "-z", rev.commit(), "--"};
+    args.insert(args.end(), paths.begin(), paths.end());
+
+    std::vector<std::string> files;
+    for (const auto& entry : split_z(git_output(
+             args, "Unable to list the files of " + rev.commit()))) {
+        // '<mode> <type> <object>\t<path>', with the path relative to the
+        // working directory. Only regular files (mode 100644 or 100755)
+        // are searched, not symbolic links or submodules.
+        auto tab = entry.find('\t');
+        if (tab != std::string::npos && entry.compare(0, 3, "100") == 0) {
+            files.push_back(entry.substr(tab + 1));
+        }
+    }
+    return files;
+}
+
+std::unique_ptr<llvm::MemoryBuffer>
+read_revision_file(const std::string& file, const po::variables_map& config) {
+    return revision(config).read(file);
+}
+
+llvm::IntrusiveRefCntPtr<clang::vfs::FileSystem>
+revision_file_system(const po::variables_map& config) {
+    return new RevisionFileSystem(revision(config));
+}
+
+ChangedFiles::ChangedFiles(const po::variables_map& config)
+    : m_directory{fs::current_path().string()} {
+    const auto& since = config["since"].as<std::string>();
+    std::vector<std::string> diff{"diff", "--name-only", "-z",
+                                  "--diff-filter=d", since};
+    if (config.count("rev")) {
+        diff.push_back(revision(config).commit());
+    }
+    diff.push_back("--");
+
+    // Both list paths relative to the top of the repository
+    auto names = split_z(git_output(
+        diff, "Unable to find the files changed since '" + since + "'"));
+    if (!config.count("rev")) {
+        auto untracked = split_z(git_output(
+            {"ls-files", "-z", "--others", "--exclude-standard",
+             "--full-name", ":/"},
+            "Unable to list untracked files"));
+        names.insert(names.end(), untracked.begin(), untracked.end());
+    }
+
+    auto top = toplevel();
+    for (const auto& name : names) {
+        m_files.insert(top + '/' + name);
+    }
+}
+
+bool ChangedFiles::contains(const std::string& file) const {
+    return m_files.count(normal_path(m_directory, file)) > 0;
+}
@@ -0,0 +1,185 @@
+#include <fstream>
+
+#include "ignore.hpp"
+
+namespace {
+
+/// Given the index of a '[', match the bracket expression against 'c'.
+/// Returns the index after the closing ']', or npos if it is unterminated.
+std::size_t match_bracket(const std::string& pattern, std::size_t i, char c,
+                          bool& matched) {
+    ++i;
+    bool negated = false;
+    if (i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^')) {
+        negated = true;
+        ++i;
+    }
+    matched = false;
+    bool first = true;
+    for (; i < pattern.size(); ++i) {
+        if (pattern[i] == ']' && !first) {
+            matched = matched != negated;
+            return i + 1;
+        }
+        first = false;
+        char low = pattern[i];
+        char high = low;
+        if (i + 2 < pattern.size() && pattern[i + 1] == '-' &&
+            pattern[i + 2] != ']') {
+            high = pattern[i + 2];
+            i += 2;
+        }
+        if (low <= c && c <= high) {
+            matched = true;
+        }
+    }
+    return std::string::npos;
+}
+
+/// Match the glob from 'p' against the text from 't'
+bool glob_match_from(const std::string& pattern, std::size_t p,
+                     const std::string& text, std::size_t t) {
+    while (p < pattern.size()) {
+        if (pattern.compare(p, 2, "**") == 0) {
+            p += 2;
+            if (p < pattern.size() && pattern[p] == '/') {
+                // '**/' matches zero or more leading directories
+                ++p;
+                for (auto s = t;; ++s) {
+                    if (glob_match_from(pattern, p, text, s)) {
+                        return true;
+                    }
+                    s = text.find('/', s);
+                    if (s == std::string::npos) {
+                        return false;
+                    }
+                }
+            }
+            for (auto s = t; s <= text.size(); ++s) {
+                if (glob_match_from(pattern, p, text, s)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        if (pattern[p] == '*') {
+            ++p;
+            for (auto s = t; s <= text.size(); ++s) {
+                if (glob_match_from(pattern, p, text, s)) {
+                    return true;
+                }
+                if (s < text.size() && text[s] == '/') {
+                    return false;
+                }
+            }
+            return false;
+        }
+        if (t == text.size()) {
+            return false;
+        }
+        if (pattern[p] == '?') {
+            if (text[t] == '/') {
+                return false;
+            }
+            ++p;
+            ++t;
+            continue;
+        }
+        if (pattern[p] == '[') {
+            bool matched;
+            auto next = match_bracket(pattern, p, text[t], matched);
+            if (next != std::string::npos) {
+                if (!matched || text[t] == '/') {
+                    return false;
+                }
+                p = next;
+                ++t;
+                continue;
+            }
+            // An unterminated bracket is an ordinary character
+        }
+        if (pattern[p] == '\\' && p + 1 < pattern.size()) {
+            ++p;
+        }
+        if (pattern[p] != text[t]) {
+            return false;
+        }
+        ++p;
+        ++t;
+    }
+    return t == text.size();
+}
+}
+
+bool glob_match(const std::string& pattern, const std::string& text) {
+    return glob_match_from(pattern, 0, text, 0);
+}
+
+bool parse_ignore_rule(std::string line, IgnoreRule& rule) {
+    if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+    }
+    // Trailing spaces are ignored unless escaped
+    while (!line.empty() && line.back() == ' ' &&
+           (line.size() < 2 || line[line.size() - 2] != '\\')) {
+        line.pop_back();
+    }
+    if (line.empty() || line[0] == '#') {
+        return false;
+    }
+
+    rule = IgnoreRule();
+    if (line[0] == '!') {
+        rule.negated = true;
+        line.erase(0, 1);
+    } else if (line[0] == '\\' && line.size() > 1 &&
+               (line[1] == '!' || line[1] == '#')) {
+        line.erase(0, 1);
+    }
+    if (!line.empty() && line.back() == '/') {
+        rule.directory_only = true;
+        line.pop_back();
+    }
+    if (!line.empty() && line[0] == '/') {
+        rule.anchored = true;
+        line.erase(0, 1);
+    }
+    if (line.empty()) {
+        return false;
+    }
+    if (line.find('/') != std::string::npos) {
+        rule.anchored = true;
+    }
+    rule.pattern = line;
+    return true;
+}
+
+void read_ignore_file(const std::string& path,
+                      std::vector<IgnoreRule>& rules) {
+    std::ifstream in(path);
+    std::string line;
+    IgnoreRule rule;
+    while (std::getline(in, line)) {
+        if (parse_ignore_rule(line, rule)) {
+            rules.push_back(std::move(rule));
+        }
+    }
+}
+
+bool is_ignored(const IgnoreList* list, const std::string& path,
+                const std::string& name, bool is_directory) {
+    for (; list; list = list->parent.get()) {
+        auto relative = path.substr(list->base.size() + 1);
+        for (auto rule = list->rules.rbegin(); rule != list->rules.rend();
+             ++rule) {
+            if (rule->directory_only && !is_directory) {
+                continue;
+            }
+            const auto& text = rule->anchored ? relative : name;
+            if (glob_match(rule->pattern, text)) {
+                return !rule->negated;
+            }
+        }
+    }
+    return false;
+}
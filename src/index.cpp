@@ -0,0 +1,519 @@
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+
+#include <sys/stat.h>
+
+#include <boost/filesystem.hpp>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "compilation.hpp"
+#include "index.hpp"
+#include "output.hpp"
+#include "scheduler.hpp"
+
+namespace fs = boost::filesystem;
+
+// An index directory holds a 'manifest' listing "<key> <path>" for every
+// indexed file, and one object per key in 'objects/'. A key is the MD5 of
+// what the declarations depend on besides the headers: the file's content,
+// its absolute path (which quoted #includes are resolved from) and its
+// compile flags. The headers are recorded in the object, with their mtimes
+// and sizes, and the object is parsed again if any of them changes. Objects
+// are mapped read-only when queried; each is laid out as
+//
+//   ObjectHeader
+//   DiskDependency[dependency_count]
+//   DiskDecl[decl_count]
+//   DiskQualifier[qualifier_count]
+//   DiskParameter[parameter_count]
+//   char strings[strings_size]    (NUL-terminated, referenced by offset)
+
+namespace {
+
+const char object_magic[4] = {'S', 'A', 'S', 'I'};
+const std::uint32_t object_version = 2;
+
+struct ObjectHeader {
+    char magic[4];
+    std::uint32_t version;
+    std::uint32_t dependency_count;
+    std::uint32_t decl_count;
+    std::uint32_t qualifier_count;
+    std::uint32_t parameter_count;
+    std::uint32_t strings_size;
+    std::uint32_t padding;
+};
+
+/// A file the parse read other than the indexed file, as it was after the
+/// parse
+struct DiskDependency {
+    std::uint32_t name;
+    std::uint32_t padding;
+    std::int64_t mtime_sec;
+    std::int64_t mtime_nsec;
+    std::int64_t size;
+};
+
+struct DiskDecl {
+    std::uint8_t kind;
+    std::uint8_t padding[3];
+    std::uint32_t name;
+    std::uint32_t type;
+    std::uint32_t line;
+    std::uint32_t qualifier_begin;
+    std::uint32_t qualifier_count;
+    std::uint32_t parameter_begin;
+    std::uint32_t parameter_count;
+    std::int32_t range[4];
+};
+
+struct DiskQualifier {
+    std::uint32_t kind;
+    std::uint32_t name;
+};
+
+struct DiskParameter {
+    std::uint32_t type;
+    std::uint32_t name;
+};
+
+/// Interns strings into the object's string table
+class StringTable {
+public:
+    std::uint32_t add(const std::string& str) {
+        auto iter = m_offsets.find(str);
+        if (iter != m_offsets.end()) {
+            return iter->second;
+        }
+        auto offset = static_cast<std::uint32_t>(m_data.size());
+        m_data.append(str.c_str(), str.size() + 1);
+        m_offsets.emplace(str, offset);
+        return offset;
+    }
+
+    const std::string& data() const { return m_data; }
+
+private:
+    std::string m_data;
+    std::map<std::string, std::uint32_t> m_offsets;
+};
+
+template <typename T>
+void write_array(std::ostream& out, const std::vector<T>& values) {
+    out.write(reinterpret_cast<const char*>(values.data()),
+              values.size() * sizeof(T));
+}
+
+void write_object(const std::string& path,
+                  const std::vector<IndexedDecl>& decls,
+                  const std::vector<std::string>& dependencies) {
+    StringTable strings;
+    std::vector<DiskDependency> disk_dependencies;
+    std::vector<DiskDecl> disk_decls;
+    std::vector<DiskQualifier> qualifiers;
+    std::vector<DiskParameter> parameters;
+
+    for (const auto& dependency : dependencies) {
+        // A file that cannot be looked at is recorded as one that changed
+        DiskDependency d{strings.add(dependency), 0, -1, -1, -1};
+        struct stat info;
+        if (stat(dependency.c_str(), &info) == 0) {
+            d.mtime_sec = info.st_mtim.tv_sec;
+            d.mtime_nsec = info.st_mtim.tv_nsec;
+            d.size = info.st_size;
+        }
+        disk_dependencies.push_back(d);
+    }
+
+    for (const auto& decl : decls) {
+        DiskDecl d{};
+        d.kind = decl.kind;
+        d.name = strings.add(decl.name);
+        d.type = strings.add(decl.type);
+        d.line = strings.add(decl.line);
+        d.qualifier_begin = qualifiers.size();
+        d.qualifier_count = decl.qualifiers.size();
+        for (const auto& q : decl.qualifiers) {
+            qualifiers.push_back({q.first, strings.add(q.second)});
+        }
+        d.parameter_begin = parameters.size();
+        d.parameter_count = decl.parameters.size();
+        for (const auto& p : decl.parameters) {
+            parameters.push_back(
+                {strings.add(p.first), strings.add(p.second)});
+        }
+        d.range[0] = decl.range.first.first;
+        d.range[1] = decl.range.first.second;
+        d.range[2] = decl.range.second.first;
+        d.range[3] = decl.range.second.second;
+        disk_decls.push_back(d);
+    }
+
+    ObjectHeader header{};
+    std::memcpy(header.magic, object_magic, sizeof(object_magic));
+    header.version = object_version;
+    header.dependency_count = disk_dependencies.size();
+    header.decl_count = disk_decls.size();
+    header.qualifier_count = qualifiers.size();
+    header.parameter_count = parameters.size();
+    header.strings_size = strings.data().size();
+
+    // Write to a temporary first so a concurrent reader never sees a
+    // partial object
+    auto tmp = fs::unique_path(path + ".%%%%-%%%%").string();
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        write_array(out, disk_dependencies);
+        write_array(out, disk_decls);
+        write_array(out, qualifiers);
+        write_array(out, parameters);
+        out.write(strings.data().data(), strings.data().size());
+        if (!out) {
+            throw std::runtime_error("Unable to write index object " + tmp);
+        }
+    }
+    fs::rename(tmp, path);
+}
+
+/// A read-only view of a memory-mapped index object
+class ObjectView {
+public:
+    explicit ObjectView(const std::string& path) {
+        auto buffer = llvm::MemoryBuffer::getFile(path);
+        if (!buffer) {
+            throw std::runtime_error("Unable to read index object " + path);
+        }
+        m_buffer = std::move(*buffer);
+
+        auto data = m_buffer->getBufferStart();
+        auto size = m_buffer->getBufferSize();
+        if (size < sizeof(ObjectHeader)) {
+            throw std::runtime_error("Corrupt index object " + path);
+        }
+        m_header = reinterpret_cast<const ObjectHeader*>(data);
+        if (std::memcmp(m_header->magic, object_magic, sizeof(object_magic)) ||
+            m_header->version != object_version) {
+            throw std::runtime_error("Incompatible index object " + path +
+                                     ", rebuild the index");
+        }
+
+        auto expected = sizeof(ObjectHeader) +
+                        m_header->dependency_count * sizeof(DiskDependency) +
+                        m_header->decl_count * sizeof(DiskDecl) +
+                        m_header->qualifier_count * sizeof(DiskQualifier) +
+                        m_header->parameter_count * sizeof(DiskParameter) +
+                        m_header->strings_size;
+        if (size != expected) {
+            throw std::runtime_error("Corrupt index object " + path);
+        }
+
+        m_dependencies = reinterpret_cast<const DiskDependency*>(m_header + 1);
+        m_decls = reinterpret_cast<const DiskDecl*>(m_dependencies +
+                                                    m_header->dependency_count);
+        m_qualifiers = reinterpret_cast<const DiskQualifier*>(
+            m_decls + m_header->decl_count);
+        m_parameters = reinterpret_cast<const DiskParameter*>(
+            m_qualifiers + m_header->qualifier_count);
+        m_strings = reinterpret_cast<const char*>(m_parameters +
+                                                  m_header->parameter_count);
+
+        // Check every reference once here, so reading a declaration never
+        // goes outside the mapping
+        if (m_header->strings_size > 0 &&
+            m_strings[m_header->strings_size - 1] != '\0') {
+            throw std::runtime_error("Corrupt index object " + path);
+        }
+        for (std::size_t i = 0; i < m_header->decl_count; ++i) {
+            const auto& d = m_decls[i];
+            if (!valid_string(d.name) || !valid_string(d.type) ||
+                !valid_string(d.line) ||
+                std::uint64_t{d.qualifier_begin} + d.qualifier_count >
+                    m_header->qualifier_count ||
+                std::uint64_t{d.parameter_begin} + d.parameter_count >
+                    m_header->parameter_count) {
+                throw std::runtime_error("Corrupt index object " + path);
+            }
+        }
+        for (std::size_t i = 0; i < m_header->dependency_count; ++i) {
+            if (!valid_string(m_dependencies[i].name)) {
+                throw std::runtime_error("Corrupt index object " + path);
+            }
+        }
+        for (std::size_t i = 0; i < m_header->qualifier_count; ++i) {
+            if (!valid_string(m_qualifiers[i].name)) {
+                throw std::runtime_error("Corrupt index object " + path);
+            }
+        }
+        for (std::size_t i = 0; i < m_header->parameter_count; ++i) {
+            if (!valid_string(m_parameters[i].type) ||
+                !valid_string(m_parameters[i].name)) {
+                throw std::runtime_error("Corrupt index object " + path);
+            }
+        }
+    }
+
+    std::size_t dependency_count() const {
+        return m_header->dependency_count;
+    }
+    const DiskDependency& dependency(std::size_t i) const {
+        return m_dependencies[i];
+    }
+    std::size_t size() const { return m_header->decl_count; }
+    const DiskDecl& decl(std::size_t i) const { return m_decls[i]; }
+    const DiskQualifier& qualifier(const DiskDecl& d, std::size_t i) const {
+        return m_qualifiers[d.qualifier_begin + i];
+    }
+    const DiskParameter& parameter(const DiskDecl& d, std::size_t i) const {
+        return m_parameters[d.parameter_begin + i];
+    }
+    /// Every offset in the object was checked when it was opened
+    llvm::StringRef string(std::uint32_t offset) const {
+        return m_strings + offset;
+    }
+
+private:
+    /// Whether a string starts inside the string table, which ends with a
+    /// NUL
+    bool valid_string(std::uint32_t offset) const {
+        return offset < m_header->strings_size;
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer> m_buffer;
+    const ObjectHeader* m_header;
+    const DiskDependency* m_dependencies;
+    const DiskDecl* m_decls;
+    const DiskQualifier* m_qualifiers;
+    const DiskParameter* m_parameters;
+    const char* m_strings;
+};
+
+/// The fields of a declaration in an index object, for DeclMatcher
+class DiskDeclFields {
+public:
+    DiskDeclFields(const ObjectView& object, const DiskDecl& decl)
+        : m_object(object), m_decl(decl) {}
+
+    IndexedDecl::Kind kind() const {
+        return static_cast<IndexedDecl::Kind>(m_decl.kind);
+    }
+    llvm::StringRef name() const { return m_object.string(m_decl.name); }
+    llvm::StringRef type() const { return m_object.string(m_decl.type); }
+
+    std::size_t qualifier_count() const { return m_decl.qualifier_count; }
+    IndexedDecl::ContextKind qualifier_kind(std::size_t i) const {
+        return static_cast<IndexedDecl::ContextKind>(
+            m_object.qualifier(m_decl, i).kind);
+    }
+    llvm::StringRef qualifier_name(std::size_t i) const {
+        return m_object.string(m_object.qualifier(m_decl, i).name);
+    }
+
+    std::size_t parameter_count() const { return m_decl.parameter_count; }
+    llvm::StringRef parameter_type(std::size_t i) const {
+        return m_object.string(m_object.parameter(m_decl, i).type);
+    }
+    llvm::StringRef parameter_name(std::size_t i) const {
+        return m_object.string(m_object.parameter(m_decl, i).name);
+    }
+
+private:
+    const ObjectView& m_object;
+    const DiskDecl& m_decl;
+};
+
+std::string manifest_path(const std::string& index_dir) {
+    return (fs::path(index_dir) / "manifest").string();
+}
+
+std::string object_path(const std::string& index_dir,
+                        const std::string& hash) {
+    return (fs::path(index_dir) / "objects" / hash).string();
+}
+
+/// Read the manifest as a list of (hash, path) in index order
+std::vector<std::pair<std::string, std::string>>
+read_manifest(const std::string& index_dir) {
+    std::ifstream in(manifest_path(index_dir));
+    if (!in) {
+        throw std::runtime_error("No index found in " + index_dir);
+    }
+
+    std::vector<std::pair<std::string, std::string>> entries;
+    std::string hash, path;
+    while (in >> hash && std::getline(in >> std::ws, path)) {
+        entries.emplace_back(hash, path);
+    }
+    return entries;
+}
+
+/// The key of the object for 'file' (see the layout above)
+std::string object_key(const std::string& file,
+                       const po::variables_map& config) {
+    auto buffer = llvm::MemoryBuffer::getFile(file);
+    if (!buffer) {
+        throw std::runtime_error(buffer.getError().message());
+    }
+
+    llvm::MD5 hash;
+    hash.update((*buffer)->getBuffer());
+    hash.update(llvm::StringRef("\0", 1));
+    hash.update(fs::absolute(file).string());
+    for (const auto& arg : compile_command(file, config).arguments) {
+        hash.update(llvm::StringRef("\0", 1));
+        hash.update(arg);
+    }
+    llvm::MD5::MD5Result result;
+    hash.final(result);
+
+    llvm::SmallString<32> str;
+    llvm::MD5::stringifyResult(result, str);
+    return str.str().str();
+}
+
+/// Whether an object exists and every file it was parsed from is as it was
+/// then. An object that cannot be read is written again.
+bool object_up_to_date(const std::string& path) {
+    if (!fs::exists(path)) {
+        return false;
+    }
+    try {
+        ObjectView object(path);
+        for (std::size_t i = 0; i < object.dependency_count(); ++i) {
+            const auto& dependency = object.dependency(i);
+            struct stat info;
+            if (stat(object.string(dependency.name).data(), &info) != 0 ||
+                info.st_mtim.tv_sec != dependency.mtime_sec ||
+                info.st_mtim.tv_nsec != dependency.mtime_nsec ||
+                info.st_size != dependency.size) {
+                return false;
+            }
+        }
+    } catch (const std::runtime_error&) {
+        return false;
+    }
+    return true;
+}
+}
+
+void build_index(const std::string& index_dir,
+                 const std::vector<std::string>& files,
+                 const po::variables_map& config) {
+    fs::create_directories(fs::path(index_dir) / "objects");
+
+    std::vector<std::string> keys(files.size());
+    std::mutex error_mutex;
+
+    // Key every file, and parse only those without an up-to-date object
+    WorkStealingPool pool(search_jobs(config));
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        pool.submit([&, i] {
+            try {
+                keys[i] = object_key(files[i], config);
+                auto object = object_path(index_dir, keys[i]);
+                if (!object_up_to_date(object)) {
+                    std::vector<std::string> dependencies;
+                    auto decls =
+                        collect_declarations(files[i], config, &dependencies);
+                    write_object(object, decls, dependencies);
+                }
+            } catch (const std::exception& e) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                std::cerr << "sas: " << files[i] << ": " << e.what()
+                          << std::endl;
+                keys[i].clear();
+            }
+        });
+    }
+    pool.wait();
+
+    auto tmp = manifest_path(index_dir) + ".tmp";
+    std::set<std::string> live;
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        for (std::size_t i = 0; i < files.size(); ++i) {
+            if (keys[i].empty()) {
+                continue;
+            }
+            out << keys[i] << " " << files[i] << "\n";
+            live.insert(keys[i]);
+        }
+    }
+    fs::rename(tmp, manifest_path(index_dir));
+
+    // Drop objects for content that is no longer in the tree
+    for (fs::directory_iterator iter(fs::path(index_dir) / "objects"), end;
+         iter != end; ++iter) {
+        if (!live.count(iter->path().filename().string())) {
+            fs::remove(iter->path());
+        }
+    }
+}
+
+namespace {
+
+template <typename Callback>
+void for_each_indexed_match(const std::string& index_dir,
+                            const CompiledTerm& term, Callback callback) {
+    for (const auto& entry : read_manifest(index_dir)) {
+        ObjectView object(object_path(index_dir, entry.first));
+        for (std::size_t i = 0; i < object.size(); ++i) {
+            const auto& decl = object.decl(i);
+            DiskDeclFields fields(object, decl);
+            if (boost::apply_visitor(DeclMatcher<DiskDeclFields>(fields),
+                                     term)) {
+                callback(entry.second, object, decl);
+            }
+        }
+    }
+}
+
+match_t decl_range(const DiskDecl& decl) {
+    return {{decl.range[0], decl.range[1]}, {decl.range[2], decl.range[3]}};
+}
+}
+
+indexed_matches_t find_indexed_matches(const std::string& index_dir,
+                                       const CompiledTerm& term) {
+    indexed_matches_t results;
+    for_each_indexed_match(
+        index_dir, term,
+        [&](const std::string& file, const ObjectView&, const DiskDecl& decl) {
+            if (results.empty() || results.back().first != file) {
+                results.emplace_back(file, std::vector<match_t>{});
+            }
+            results.back().second.push_back(decl_range(decl));
+        });
+    return results;
+}
+
+void print_indexed_matches(const std::string& index_dir,
+                           const CompiledTerm& term, OutputSink& sink) {
+    // Matches arrive grouped by file, so each file is written once its
+    // last match has been seen
+    std::unique_ptr<MatchWriter> writer;
+    std::string current;
+    std::size_t file_id = 0;
+    for_each_indexed_match(
+        index_dir, term, [&](const std::string& file,
+                             const ObjectView& object, const DiskDecl& decl) {
+            if (!writer || file != current) {
+                if (writer) {
+                    sink.write(writer->finish(), current);
+                }
+                writer.reset(new MatchWriter(sink.format(), file, file_id++));
+                current = file;
+            }
+            writer->write(decl_range(decl), object.string(decl.line), 0, {});
+        });
+    if (writer) {
+        sink.write(writer->finish(), current);
+    }
+}
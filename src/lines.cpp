@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <cstring>
+
+#include "llvm/ADT/StringRef.h"
+
+#include "lines.hpp"
+
+namespace {
+
+bool is_line_ending_pair(char first, char second) {
+    return (first == '\r' && second == '\n') ||
+           (first == '\n' && second == '\r');
+}
+}
+
+LineIndex::LineIndex(llvm::StringRef buffer)
+    : m_data{buffer.data()}, m_size{buffer.size()} {
+    m_starts.push_back(0);
+    // memchr is vectorized by the C library, so the scan runs far faster
+    // than comparing each character. Files without a '\r' search for one
+    // only once.
+    const char* end = m_data + m_size;
+    auto find = [end](const char* from, char c) {
+        auto found = static_cast<const char*>(std::memchr(from, c, end - from));
+        return found ? found : end;
+    };
+    auto newline = find(m_data, '\n');
+    auto carriage_return = find(m_data, '\r');
+    for (;;) {
+        auto line_end = std::min(newline, carriage_return);
+        if (line_end == end) {
+            break;
+        }
+        // As clang counts lines, "\r\n" and "\n\r" are a single line ending
+        auto next = line_end + 1;
+        if (next < end && is_line_ending_pair(*line_end, *next)) {
+            ++next;
+        }
+        if (next == end) {
+            break;
+        }
+        m_starts.push_back(static_cast<unsigned>(next - m_data));
+        if (newline < next) {
+            newline = find(next, '\n');
+        }
+        if (carriage_return < next) {
+            carriage_return = find(next, '\r');
+        }
+    }
+}
+
+std::size_t LineIndex::line_of(std::size_t offset) const {
+    return std::upper_bound(m_starts.begin(), m_starts.end(), offset) -
+           m_starts.begin();
+}
+
+llvm::StringRef LineIndex::line(std::size_t line) const {
+    return lines(line, line);
+}
+
+llvm::StringRef LineIndex::lines(std::size_t first, std::size_t last) const {
+    auto start = start_of(first);
+    return llvm::StringRef(m_data + start, end_of(last) - start);
+}
+
+/// The offset of the line ending of 'line', or of the end of the buffer
+std::size_t LineIndex::end_of(std::size_t line) const {
+    auto start = m_starts[line - 1];
+    // The last line is not followed by another, but may end in a line
+    // ending
+    auto end = line < m_starts.size() ? m_starts[line] : m_size;
+    if (end > start && (m_data[end - 1] == '\n' || m_data[end - 1] == '\r')) {
+        --end;
+        if (end > start && is_line_ending_pair(m_data[end - 1], m_data[end])) {
+            --end;
+        }
+    }
+    return end;
+}
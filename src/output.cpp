@@ -0,0 +1,358 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include "llvm/ADT/StringRef.h"
+
+#include "output.hpp"
+#include "stats.hpp"
+
+namespace {
+
+const char binary_magic[4] = {'S', 'A', 'S', 'M'};
+const std::uint32_t binary_version = 1;
+
+enum BinaryRecord : std::uint8_t { FileRecord = 1, MatchRecord = 2 };
+}
+
+OutputFormat output_format(const po::variables_map& config) {
+    auto files = config.count("files-with-matches") > 0;
+    auto count = config.count("count") > 0;
+    if (files || count) {
+        if (files && count) {
+            throw std::invalid_argument("-l and -c cannot be combined");
+        }
+        if (config.count("format") && !config["format"].defaulted() &&
+            config["format"].as<std::string>() != "text") {
+            throw std::invalid_argument("-l and -c only print text");
+        }
+        return files ? OutputFormat::FilesWithMatches : OutputFormat::Count;
+    }
+
+    if (!config.count("format")) {
+        return OutputFormat::Text;
+    }
+    const auto& format = config["format"].as<std::string>();
+    if (format == "text") {
+        return OutputFormat::Text;
+    } else if (format == "json") {
+        return OutputFormat::Json;
+    } else if (format == "ndjson") {
+        return OutputFormat::NDJson;
+    } else if (format == "binary") {
+        return OutputFormat::Binary;
+    }
+    throw std::invalid_argument("Unknown output format '" + format + "'");
+}
+
+SourceContext source_context(const po::variables_map& config) {
+    SourceContext context;
+    if (config.count("context")) {
+        context.before = context.after = config["context"].as<std::size_t>();
+    }
+    if (config.count("before-context")) {
+        context.before = config["before-context"].as<std::size_t>();
+    }
+    if (config.count("after-context")) {
+        context.after = config["after-context"].as<std::size_t>();
+    }
+    context.full_range = config.count("full-range") > 0;
+    return context;
+}
+
+MatchWriter::MatchWriter(OutputFormat format, const std::string& file,
+                         std::size_t file_id, const SourceContext& context)
+    : m_format{format}, m_file{file}, m_file_id{file_id}, m_context(context) {}
+
+void MatchWriter::write(const match_t& range, llvm::StringRef line,
+                        std::size_t query_id, llvm::StringRef tag) {
+    write_match(range, line, {}, {}, query_id, tag);
+}
+
+void MatchWriter::write_in_source(const match_t& range, llvm::StringRef source,
+                                  std::size_t query_id, llvm::StringRef tag) {
+    if (!m_lines || m_lines->data() != source.data()) {
+        // Lines written from another buffer say nothing of this one's
+        end_group();
+        m_lines.reset(new LineIndex(source));
+    }
+    const auto& lines = *m_lines;
+    std::size_t first = std::max(range.first.first, 1);
+    first = std::min(first, lines.size());
+    auto last = first;
+    if (m_context.full_range) {
+        last = std::max(first, std::min<std::size_t>(range.second.first,
+                                                     lines.size()));
+    }
+    auto before = first > m_context.before ? first - m_context.before : 1;
+    auto after = std::min(last + m_context.after, lines.size());
+
+    if (m_format != OutputFormat::Text) {
+        write_match(range, lines.lines(first, last),
+                    before < first ? lines.lines(before, first - 1)
+                                   : llvm::StringRef(),
+                    after > last ? lines.lines(last + 1, after)
+                                 : llvm::StringRef(),
+                    query_id, tag);
+        return;
+    }
+
+    // A match before the previous one (e.g., as --fast reports them, kind
+    // by kind) starts a group of its own, with all of its context
+    if (first < m_last_first) {
+        end_group();
+    }
+    // Lines already written around an earlier match are not written again,
+    // except those of the match itself
+    write_after_context(first);
+    auto from = std::max(before, m_last_line + 1);
+    auto grouped = m_context.before > 0 || m_context.after > 0;
+    if (grouped && m_written &&
+        (m_last_line == 0 || std::min(from, first) > m_last_line + 1)) {
+        m_buffer += "--\n";
+    }
+    for (auto row = from; row < first; ++row) {
+        append_line(tag, row, '-', lines.line(row));
+    }
+    write_match(range, lines.line(first), {}, {}, query_id, tag);
+    for (auto row = first + 1; row <= last; ++row) {
+        append_line(tag, row, ':', lines.line(row));
+    }
+    m_written = true;
+    m_last_first = first;
+    m_last_line = std::max(m_last_line, last);
+    m_after_end = after;
+    m_after_tag = tag;
+}
+
+void MatchWriter::write_after_context(std::size_t line) {
+    for (auto row = m_last_line + 1; row <= m_after_end && row < line; ++row) {
+        append_line(m_after_tag, row, '-', m_lines->line(row));
+        m_last_line = row;
+    }
+    m_after_end = 0;
+}
+
+void MatchWriter::end_group() {
+    if (m_lines) {
+        write_after_context(m_lines->size() + 1);
+    }
+    m_last_first = 0;
+    m_last_line = 0;
+    m_after_tag.clear();
+}
+
+void MatchWriter::write_match(const match_t& range, llvm::StringRef line,
+                              llvm::StringRef before, llvm::StringRef after,
+                              std::size_t query_id, llvm::StringRef tag) {
+    switch (m_format) {
+    case OutputFormat::Text:
+        if (!tag.empty()) {
+            m_buffer.append(tag.data(), tag.size());
+            m_buffer.push_back('\t');
+        }
+        append_number(range.first.first);
+        m_buffer.push_back(':');
+        append_number(range.first.second);
+        m_buffer.push_back(':');
+        m_buffer.append(line.data(), line.size());
+        m_buffer.push_back('\n');
+        break;
+
+    case OutputFormat::NDJson:
+    case OutputFormat::Json:
+        if (m_format == OutputFormat::NDJson) {
+            m_buffer += "{\"file\":";
+            append_json_string(m_buffer, m_file);
+            m_buffer += ",\"file_id\":";
+            append_number(m_file_id);
+            m_buffer += ",";
+        } else if (m_count == 0) {
+            m_buffer += "{\"file\":";
+            append_json_string(m_buffer, m_file);
+            m_buffer += ",\"file_id\":";
+            append_number(m_file_id);
+            m_buffer += ",\"matches\":[\n{";
+        } else {
+            m_buffer += ",\n{";
+        }
+        m_buffer += "\"query_id\":";
+        append_number(query_id);
+        m_buffer += ",\"range\":[";
+        append_number(range.first.first);
+        m_buffer.push_back(',');
+        append_number(range.first.second);
+        m_buffer.push_back(',');
+        append_number(range.second.first);
+        m_buffer.push_back(',');
+        append_number(range.second.second);
+        m_buffer += "],\"line\":";
+        append_json_string(m_buffer, line);
+        if (m_context.before > 0 || m_context.after > 0) {
+            m_buffer += ",\"before\":";
+            append_json_string(m_buffer, before);
+            m_buffer += ",\"after\":";
+            append_json_string(m_buffer, after);
+        }
+        m_buffer += m_format == OutputFormat::NDJson ? "}\n" : "}";
+        break;
+
+    case OutputFormat::Binary:
+        if (m_count == 0) {
+            m_buffer.push_back(FileRecord);
+            append_uint32(m_file_id);
+            append_uint32(m_file.size());
+            m_buffer += m_file;
+        }
+        m_buffer.push_back(MatchRecord);
+        append_uint32(m_file_id);
+        append_uint32(query_id);
+        append_uint32(range.first.first);
+        append_uint32(range.first.second);
+        append_uint32(range.second.first);
+        append_uint32(range.second.second);
+        break;
+
+    case OutputFormat::FilesWithMatches:
+    case OutputFormat::Count:
+        // Written by finish()
+        break;
+    }
+    ++m_count;
+}
+
+std::string MatchWriter::finish() {
+    end_group();
+    if (m_format == OutputFormat::Json && m_count > 0) {
+        m_buffer += "]}";
+    } else if (m_format == OutputFormat::FilesWithMatches && m_count > 0) {
+        m_buffer = m_file + '\n';
+    } else if (m_format == OutputFormat::Count) {
+        m_buffer = m_file + ':';
+        append_number(m_count);
+        m_buffer.push_back('\n');
+    }
+    m_count = 0;
+    m_lines.reset();
+    m_written = false;
+    return std::move(m_buffer);
+}
+
+void MatchWriter::append_line(llvm::StringRef tag, std::size_t row,
+                              char separator, llvm::StringRef line) {
+    if (!tag.empty()) {
+        m_buffer.append(tag.data(), tag.size());
+        m_buffer.push_back('\t');
+    }
+    append_number(row);
+    m_buffer.push_back(separator);
+    m_buffer.append(line.data(), line.size());
+    m_buffer.push_back('\n');
+}
+
+void MatchWriter::append_number(long long value) {
+    char digits[24];
+    auto length = std::snprintf(digits, sizeof(digits), "%lld", value);
+    m_buffer.append(digits, length);
+}
+
+void MatchWriter::append_uint32(std::uint32_t value) {
+    char bytes[sizeof(value)];
+    std::memcpy(bytes, &value, sizeof(value));
+    m_buffer.append(bytes, sizeof(bytes));
+}
+
+void append_json_string(std::string& out, llvm::StringRef str) {
+    static const char hex[] = "0123456789abcdef";
+    out.push_back('"');
+    for (char c : str) {
+        switch (c) {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                out += "\\u00";
+                out.push_back(hex[(c >> 4) & 0xf]);
+                out.push_back(hex[c & 0xf]);
+            } else {
+                out.push_back(c);
+            }
+        }
+    }
+    out.push_back('"');
+}
+
+std::string json_string(llvm::StringRef str) {
+    std::string escaped;
+    append_json_string(escaped, str);
+    return escaped;
+}
+
+std::string join_formatted(OutputFormat format,
+                           const std::vector<std::string>& formatted) {
+    std::string joined;
+    for (const auto& file : formatted) {
+        if (file.empty()) {
+            continue;
+        }
+        // The separator OutputSink puts between the objects of the array
+        if (format == OutputFormat::Json && !joined.empty()) {
+            joined += ",\n";
+        }
+        joined += file;
+    }
+    return joined;
+}
+
+OutputSink::OutputSink(std::ostream& out, OutputFormat format)
+    : m_out(out), m_format{format} {
+    if (m_format == OutputFormat::Json) {
+        m_out << "[";
+    } else if (m_format == OutputFormat::Binary) {
+        m_out.write(binary_magic, sizeof(binary_magic));
+        m_out.write(reinterpret_cast<const char*>(&binary_version),
+                    sizeof(binary_version));
+    }
+}
+
+OutputSink::~OutputSink() {
+    if (m_format == OutputFormat::Json) {
+        m_out << (m_empty ? "]\n" : "\n]\n");
+    }
+    m_out.flush();
+}
+
+void OutputSink::write(const std::string& formatted, const std::string& file) {
+    if (formatted.empty()) {
+        return;
+    }
+    std::unique_ptr<FileStats> stats;
+    if (!file.empty()) {
+        stats.reset(new FileStats(file));
+    }
+    StageTimer timer(Stage::Output);
+    if (m_format == OutputFormat::Json) {
+        m_out << (m_empty ? "\n" : ",\n");
+    }
+    m_out.write(formatted.data(), formatted.size());
+    m_unflushed += formatted.size();
+    if (m_unflushed >= flush_size) {
+        m_out.flush();
+        m_unflushed = 0;
+    }
+    m_empty = false;
+}
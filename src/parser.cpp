@@ -22,10 +22,14 @@ SASParser::SASParser(const boost::program_options::variables_map& _config)
     type %= ("#" >> required_data[_val = construct<Class>(_1)]);
 
     parameter %= (data >> ':' >> data) | lit("...")[_val = Ellipses{}];
-    qualifier = (required_data[_val = construct<Namespace>(_1)]) | type;
+    qualifier = (required_data[_val = construct<Namespace>(_1)]) |
+                type[_val = _1];
 
+    // hold[] takes back the qualifier of an iteration that fails, which is
+    // the variable's type
     qualifiers %=
-        qualifier >> *("::" >> qualifier >> !(":" >> required_data)) >> "::" |
+        qualifier >>
+            *qi::hold["::" >> qualifier >> !(":" >> required_data)] >> "::" |
         eps[_val = std::vector<Qualifier>{}];
 
     function %=
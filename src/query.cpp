@@ -0,0 +1,262 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Regex.h"
+
+#include "query.hpp"
+#include "stats.hpp"
+
+namespace {
+
+bool is_identifier_char(char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+/// Given the index of a '[', return the index of the ']' closing the bracket
+/// expression (or the end of the pattern if it is unterminated).
+std::size_t skip_bracket(const std::string& pattern, std::size_t i) {
+    const auto size = pattern.size();
+    ++i;
+    if (i < size && pattern[i] == '^') {
+        ++i;
+    }
+    // A leading ']' is part of the set
+    if (i < size && pattern[i] == ']') {
+        ++i;
+    }
+    while (i < size && pattern[i] != ']') {
+        // Skip character classes such as '[:alpha:]'
+        if (pattern[i] == '[' && i + 1 < size &&
+            (pattern[i + 1] == ':' || pattern[i + 1] == '.' ||
+             pattern[i + 1] == '=')) {
+            auto close = pattern.find(std::string{pattern[i + 1], ']'}, i + 2);
+            if (close == std::string::npos) {
+                return size;
+            }
+            i = close + 2;
+        } else {
+            ++i;
+        }
+    }
+    return i;
+}
+
+/// Given the index of a '(', return the index of its matching ')'
+std::size_t skip_group(const std::string& pattern, std::size_t i) {
+    int depth = 0;
+    for (; i < pattern.size(); ++i) {
+        if (pattern[i] == '\\') {
+            ++i;
+        } else if (pattern[i] == '[') {
+            i = skip_bracket(pattern, i);
+        } else if (pattern[i] == '(') {
+            ++depth;
+        } else if (pattern[i] == ')' && --depth == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+/// Find the identifier runs that every match of an extended regex must
+/// contain. This is deliberately conservative: groups and bracket
+/// expressions are skipped, a quantified character is dropped from its run,
+/// and any top-level alternation means nothing is required at all.
+std::vector<std::string> extract_literals(const std::string& pattern) {
+    std::vector<std::string> literals;
+    std::string run;
+
+    auto finish_run = [&] {
+        if (!run.empty()) {
+            literals.push_back(run);
+            run.clear();
+        }
+    };
+
+    for (std::size_t i = 0; i < pattern.size(); ++i) {
+        char c = pattern[i];
+        switch (c) {
+        case '|':
+            return {};
+        case '(':
+            // A group may contain alternation, so nothing in it is required
+            i = skip_group(pattern, i);
+            finish_run();
+            break;
+        case '[':
+            i = skip_bracket(pattern, i);
+            finish_run();
+            break;
+        case '*':
+        case '?':
+        case '{':
+            // The previous atom is optional
+            if (!run.empty()) {
+                run.pop_back();
+            }
+            finish_run();
+            if (c == '{') {
+                i = std::min(pattern.find('}', i), pattern.size());
+            }
+            break;
+        case '\\':
+            // Either escaped punctuation or a class like '\w', and neither
+            // belongs to an identifier run
+            ++i;
+            finish_run();
+            break;
+        default:
+            if (is_identifier_char(c)) {
+                run.push_back(c);
+            } else {
+                finish_run();
+            }
+        }
+    }
+
+    finish_run();
+    return literals;
+}
+
+bool contains(llvm::StringRef source, const std::string& literal) {
+    const char* begin = source.data();
+    const char* end = begin + source.size();
+    const auto first = literal.front();
+    const auto length = literal.size();
+
+    // memchr is vectorized by the C library, so only the candidate positions
+    // of the first character are compared in full
+    while (static_cast<std::size_t>(end - begin) >= length) {
+        auto candidate = static_cast<const char*>(
+            std::memchr(begin, first, end - begin - length + 1));
+        if (!candidate) {
+            return false;
+        }
+        if (std::memcmp(candidate, literal.data(), length) == 0) {
+            return true;
+        }
+        begin = candidate + 1;
+    }
+    return false;
+}
+
+bool contains_all(llvm::StringRef source, const CompiledRegex& regex) {
+    for (const auto& literal : regex.required_literals()) {
+        if (!contains(source, literal)) {
+            return false;
+        }
+    }
+    return true;
+}
+}
+
+CompiledRegex::CompiledRegex(const std::string& pattern)
+    : m_pattern{pattern}, m_regex{std::make_shared<llvm::Regex>(pattern)},
+      m_literals{extract_literals(pattern)} {
+    std::string error;
+    if (!m_regex->isValid(error)) {
+        throw std::invalid_argument("Invalid regex '" + pattern + "': " +
+                                    error);
+    }
+}
+
+ParameterPattern::ParameterPattern(
+    const std::vector<CompiledFunctionParameter>& parameters)
+    : m_loops(1, false) {
+    for (const auto& p : parameters) {
+        if (p.which() == 1) {
+            m_loops.back() = true;
+            m_unbounded = true;
+        } else {
+            m_parameters.push_back(boost::get<CompiledParameter>(p));
+            m_loops.push_back(false);
+        }
+    }
+}
+
+bool CompiledRegex::match(llvm::StringRef text) const {
+    return count_evaluation(Counter::Regex, m_regex->match(text));
+}
+
+namespace {
+
+class QualifierCompiler : public boost::static_visitor<CompiledQualifier> {
+public:
+    CompiledQualifier operator()(const Namespace& ns) const {
+        return CompiledNamespace{CompiledRegex{ns.name}};
+    }
+    CompiledQualifier operator()(const Class& cls) const {
+        return CompiledClass{CompiledRegex{cls.name}};
+    }
+};
+
+class ParameterCompiler
+    : public boost::static_visitor<CompiledFunctionParameter> {
+public:
+    CompiledFunctionParameter operator()(const ExplicitParameter& p) const {
+        return CompiledParameter{CompiledRegex{p.type}, CompiledRegex{p.name}};
+    }
+    CompiledFunctionParameter operator()(Ellipses e) const { return e; }
+};
+
+std::vector<CompiledQualifier>
+compile_qualifiers(const std::vector<Qualifier>& qualifiers) {
+    std::vector<CompiledQualifier> compiled;
+    for (const auto& q : qualifiers) {
+        compiled.push_back(boost::apply_visitor(QualifierCompiler(), q));
+    }
+    return compiled;
+}
+
+class TermCompiler : public boost::static_visitor<CompiledTerm> {
+public:
+    CompiledTerm operator()(const Variable& v) const {
+        return CompiledVariable{compile_qualifiers(v.qualifiers),
+                                CompiledRegex{v.type}, CompiledRegex{v.name}};
+    }
+
+    CompiledTerm operator()(const Function& f) const {
+        std::vector<CompiledFunctionParameter> parameters;
+        for (const auto& p : f.parameters) {
+            parameters.push_back(boost::apply_visitor(ParameterCompiler(), p));
+        }
+        return CompiledFunction{compile_qualifiers(f.qualifiers),
+                                CompiledRegex{f.return_type},
+                                CompiledRegex{f.name},
+                                ParameterPattern{parameters}};
+    }
+
+    CompiledTerm operator()(const Class& c) const {
+        return CompiledClass{CompiledRegex{c.name}};
+    }
+};
+}
+
+// Only names are checked: a matched declaration (and the declaration behind
+// a matched call) is always spelled in the main file, but its type may be
+// written through a typedef, 'auto' or a using-directive.
+
+bool may_match(const CompiledVariable& term, llvm::StringRef source, bool) {
+    return contains_all(source, term.name);
+}
+
+bool may_match(const CompiledFunction& term, llvm::StringRef source, bool) {
+    return contains_all(source, term.name);
+}
+
+bool may_match(const CompiledClass& term, llvm::StringRef source,
+               bool forced_includes) {
+    // Records are matched in included headers too, so the main file alone
+    // can only rule out a match when it includes nothing
+    if (forced_includes || contains(source, "include")) {
+        return true;
+    }
+    return contains_all(source, term.name);
+}
+
+CompiledTerm compile_term(const Term& term) {
+    return boost::apply_visitor(TermCompiler(), term);
+}
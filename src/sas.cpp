@@ -1,13 +1,94 @@
+#include <algorithm>
+#include <atomic>
 #include <boost/filesystem.hpp>
+#include <fstream>
+#include <functional>
+#include <mutex>
 
+#include "compilation.hpp"
+#include "git.hpp"
+#include "index.hpp"
+#include "output.hpp"
 #include "parser.hpp"
 #include "search.hpp"
+#include "server.hpp"
+#include "shard.hpp"
+#include "stats.hpp"
+#include "walker.hpp"
+#include "watch.hpp"
 
 namespace fs = boost::filesystem;
 
-int main(int argc, char** argv) {
+namespace {
+
+/// Calls its argument with every file to search
+using walk_t =
+    std::function<void(const std::function<void(const std::string&)>&)>;
+
+/// With '--shard', search the shard's share of the files 'walk' finds,
+/// writing each file's matches under its ID for --merge. 'search' names
+/// the search, so that only its shards are merged. Returns the search's
+/// ParallelSearch::admitted_peak().
+std::size_t search_shard(const walk_t& walk, const Shard& shard,
+                         const std::string& search,
+                         const ParallelSearch::SearchFile& search_file,
+                         OutputFormat format, const po::variables_map& vm,
+                         std::ostream& out, std::ostream& err) {
+    // Every shard finds every file, so that all of them number the files
+    // the same way
+    std::vector<std::string> files;
+    std::mutex files_mutex;
+    walk([&](const std::string& file) {
+        if (should_search_path(file, vm)) {
+            std::lock_guard<std::mutex> lock(files_mutex);
+            files.push_back(file);
+        }
+    });
+    auto share = shard_files(std::move(files), shard);
+
+    ShardWriter writer(out, format, shard, search);
+    std::size_t admitted = 0;
+    if (search_jobs(vm) > 1) {
+        // Each file is written in the order it was enqueued
+        std::size_t written = 0;
+        ParallelSearch parallel(
+            [&](const std::string& file, std::size_t slot) {
+                return search_file(file, share[slot].first);
+            },
+            vm,
+            [&](const std::string& file, const std::string& formatted) {
+                FileStats stats(file);
+                writer.write(share[written++].first, formatted);
+            });
+        for (const auto& file : share) {
+            parallel.enqueue(file.second);
+        }
+        parallel.wait();
+        admitted = parallel.admitted_peak();
+    } else {
+        for (const auto& file : share) {
+            try {
+                auto formatted = search_file(file.second, file.first);
+                FileStats stats(file.second);
+                writer.write(file.first, formatted);
+            } catch (const std::exception& e) {
+                err << "sas: " << file.second << ": " << e.what() << std::endl;
+            }
+        }
+    }
+    writer.finish();
+    return admitted;
+}
+
+/// Run a search with the given arguments (without the program name). A
+/// server runs each request it receives through here, with its 'cache' of
+/// parsed files.
+int run(const std::vector<std::string>& args, std::ostream& out,
+        std::ostream& err, ASTCache* cache) {
+    const auto socket_path = default_socket_path();
     po::options_description desc(
-        "Usage: sas [options] search-string path [path...]");
+        "Usage: sas [options] search-string path [path...]\n"
+        "       sas --merge shard-output [shard-output...]");
     desc.add_options()                                                      //
         ("help,h", "Print help messages")                                   //
         ("debug", "Enable debugging output")                                //
@@ -20,24 +101,172 @@ int main(int argc, char** argv) {
         ("declarations,d", "Match declaratons")                             //
         ("definitions,D",                                                   //
          "Only match declarations that are also definitions (implies -d)")  //
-        ("recursive,r", "Read all files under each directory recursively");
+        ("recursive,r", "Read all files under each directory recursively") //
+        ("hidden", "Search hidden files and directories")                   //
+        ("no-ignore",                                                       //
+         "Search files matched by .gitignore and .sasignore files")         //
+        ("full-parse",                                                      //
+         "Always parse function bodies, even when the search cannot match"  //
+         " anything inside them")                                           //
+        ("no-prefilter",                                                    //
+         "Parse every file, even if it cannot contain the searched name"    //
+         " (e.g., when the name is produced by a macro)")                   //
+        ("fast",                                                            //
+         "Search each file's tokens without preprocessing or parsing it."   //
+         " Much faster, but approximate: macros are not expanded, types"    //
+         " are matched as written and only calls of functions declared in"  //
+         " the same file are found")                                        //
+        ("query,q", po::value<std::vector<std::string>>(),                  //
+         "A search string. May be repeated to search for several at once," //
+         " parsing each file once; matches are prefixed by their query")    //
+        ("query-file,f", po::value<std::string>(),                          //
+         "Read search strings from this file, one per line (as with -q)")   //
+        ("jobs,j", po::value<std::size_t>()->default_value(1),              //
+         "Number of files to search in parallel (0 for one per core)")      //
+        ("mem-budget", po::value<std::size_t>(),                            //
+         "With -j, memory in MB that files being parsed in parallel may"    //
+         " use. Files wait while their estimated cost does not fit. The"    //
+         " peak RSS and the most memory admitted at once are printed to"    //
+         " stderr")                                                         //
+        ("build-index", po::value<std::string>(),                           //
+         "Index every file under the given paths into this directory,"      //
+         " re-parsing only files whose content changed")                    //
+        ("index", po::value<std::string>(),                                 //
+         "Answer the search from this index instead of parsing files")      //
+        ("build-path,p", po::value<std::string>(),                          //
+         "Read per-file compiler flags from compile_commands.json in this"  //
+         " directory")                                                      //
+        ("pch-cache", po::value<std::string>(),                             //
+         "Share precompiled preambles between files with the same flags"    //
+         " and leading includes, keeping them in this directory")           //
+        ("format", po::value<std::string>()->default_value("text"),         //
+         "Output format: text, json, ndjson or binary. The structured"      //
+         " formats give each match's file, file ID (its position among"     //
+         " the searched files), query ID (its position among the -q"        //
+         " queries) and range")                                             //
+        ("stats",                                                           //
+         "Print the time each file spent in each stage, how often each"     //
+         " matcher and regex was evaluated, and peak RSS to stderr")        //
+        ("trace", po::value<std::string>(),                                 //
+         "Write a Chrome trace-event file of every file and stage searched" //
+         " to this path")                                                   //
+        ("serve", po::value<std::string>()->implicit_value(socket_path),    //
+         "Answer searches sent by --connect to this Unix socket, keeping"   //
+         " the files they search parsed between searches")                  //
+        ("serve-cache", po::value<std::size_t>()->default_value(2048),      //
+         "Memory in MB a server may keep parsed files in, before evicting"  //
+         " the least recently used")                                        //
+        ("connect", po::value<std::string>()->implicit_value(socket_path),  //
+         "Send the search to the server on this Unix socket (see --serve)"  //
+         " and print its results")                                          //
+        ("watch",                                                           //
+         "Keep searching: whenever files change, search them again and"     //
+         " print the updated results")                                      //
+        ("follow-includes",                                                 //
+         "Also report matches in the headers each file includes (except"    //
+         " system headers), reporting each header location once. Headers"   //
+         " are only searched on their own if no searched file includes them")//
+        ("files-with-matches,l",                                            //
+         "Only print the path of each file with a match, stopping each"     //
+         " file's search at its first match")                               //
+        ("count,c", "Only print each file's path and number of matches")    //
+        ("max-count,m", po::value<std::size_t>(),                           //
+         "Stop searching after this many matches in all. With -j, which"    //
+         " matches are found first depends on timing")                      //
+        ("after-context,A", po::value<std::size_t>(),                       //
+         "Print this many lines of the file after each match. The"          //
+         " structured formats give them as the match's \"after\" text")     //
+        ("before-context,B", po::value<std::size_t>(),                      //
+         "Print this many lines of the file before each match (\"before\"" //
+         " in the structured formats)")                                     //
+        ("context,C", po::value<std::size_t>(),                             //
+         "Print this many lines before and after each match")               //
+        ("full-range",                                                      //
+         "Print every line a match spans, rather than only its first")      //
+        ("shard", po::value<std::string>(),                                 //
+         "Search only the Kth of N shares of the files, given as K/N, and"  //
+         " write the output for --merge to combine with the other shards'"  //
+         " into the output of a single search")                             //
+        ("merge", po::value<std::vector<std::string>>()->multitoken(),      //
+         "Combine the outputs of every --shard of a search into the output" //
+         " of a single search")                                             //
+        ("since", po::value<std::string>(),                                 //
+         "Only search the files changed since this git revision (in the"    //
+         " working tree, including untracked files, or with --rev in that"  //
+         " revision)")                                                      //
+        ("rev", po::value<std::string>(),                                   //
+         "Search the files under the paths in this git revision, read from" //
+         " the repository (with the headers they include) without checking" //
+         " them out");
 
     po::positional_options_description p;
     p.add("search-string", 1);
     p.add("paths", -1);
 
     po::variables_map vm;
-    po::store(po::command_line_parser(argc, argv)
+    po::store(po::command_line_parser(args)
                   .options(desc)
                   .positional(p)
                   .run(),
               vm);
 
     if (vm.count("help")) {
-        std::cout << desc << std::endl;
+        out << desc << std::endl;
         return 0;
     }
 
+    if (vm.count("merge")) {
+        if (vm.count("search-string")) {
+            err << "sas: --merge takes only shard outputs" << std::endl;
+            return 1;
+        }
+        try {
+            merge_shards(vm["merge"].as<std::vector<std::string>>(), out);
+        } catch (const std::runtime_error& e) {
+            err << "sas: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (cache &&
+        (vm.count("serve") || vm.count("connect") || vm.count("watch"))) {
+        err << "sas: --serve, --connect and --watch cannot be sent to a server"
+            << std::endl;
+        return 1;
+    }
+    if (cache && vm.count("rev")) {
+        err << "sas: --rev cannot be sent to a server" << std::endl;
+        return 1;
+    }
+    // Nor can options that have the server write files
+    for (const char* option : {"trace", "build-index", "pch-cache"}) {
+        if (cache && vm.count(option)) {
+            err << "sas: --" << option << " cannot be sent to a server"
+                << std::endl;
+            return 1;
+        }
+    }
+    if (vm.count("connect")) {
+        // The server parses the arguments again, from our directory
+        std::vector<std::string> forwarded;
+        for (const auto& arg : args) {
+            if (arg.compare(0, 9, "--connect") != 0) {
+                forwarded.push_back(arg);
+            }
+        }
+        return run_client(vm["connect"].as<std::string>(), forwarded);
+    }
+    if (vm.count("serve")) {
+        auto handle = [](const std::vector<std::string>& request,
+                         std::ostream& out, std::ostream& err,
+                         ASTCache& cache) {
+            return run(request, out, err, &cache);
+        };
+        return serve(vm["serve"].as<std::string>(),
+                     vm["serve-cache"].as<std::size_t>() * 1024 * 1024, handle);
+    }
+
     // If no match-mode is specified, look for anything
     if (!vm.count("expressions") && !vm.count("declarations") &&
         !vm.count("definitions")) {
@@ -54,26 +283,378 @@ int main(int argc, char** argv) {
 
     po::notify(vm);
 
-    const auto search_string = vm["search-string"].as<std::string>();
-    auto term = parse_search_string(search_string, vm);
+    try {
+        load_compilation_database(vm);
+        load_revision(vm);
+    } catch (const std::runtime_error& e) {
+        err << "sas: " << e.what() << std::endl;
+        return 1;
+    }
+
+    // A server runs every request in the same process, so each request's
+    // stats start from nothing
+    reset_stats();
+    if (vm.count("stats") || vm.count("trace")) {
+        enable_stats(vm.count("trace") ? vm["trace"].as<std::string>() : "");
+    }
+    // With --mem-budget, the most estimated parse memory any search
+    // admitted at once
+    std::size_t admitted = 0;
+    auto report = [&] {
+        if (vm.count("stats")) {
+            print_stats(err);
+        }
+        if (vm.count("mem-budget")) {
+            err << "sas: peak RSS: " << peak_rss() / (1024 * 1024)
+                << "MB, at most " << admitted / (1024 * 1024)
+                << "MB estimated parse memory admitted at once ("
+                << vm["mem-budget"].as<std::size_t>() << "MB budget)"
+                << std::endl;
+        }
+        try {
+            write_trace();
+        } catch (const std::runtime_error& e) {
+            err << "sas: " << e.what() << std::endl;
+        }
+    };
+
+    OutputFormat format;
+    try {
+        format = output_format(vm);
+    } catch (const std::invalid_argument& e) {
+        err << "sas: " << e.what() << std::endl;
+        return 1;
+    }
+
+    if (vm.count("index") &&
+        (vm.count("after-context") || vm.count("before-context") ||
+         vm.count("context") || vm.count("full-range"))) {
+        err << "sas: -A, -B, -C and --full-range cannot be combined with"
+               " --index"
+            << std::endl;
+        return 1;
+    }
+
+    // Only a parallel search waits for memory to be free
+    if (vm.count("mem-budget")) {
+        if (vm["jobs"].as<std::size_t>() == 1) {
+            err << "sas: --mem-budget needs -j" << std::endl;
+            return 1;
+        }
+        for (const char* option : {"watch", "index", "build-index"}) {
+            if (vm.count(option)) {
+                err << "sas: --mem-budget cannot be combined with --"
+                    << option << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    Shard shard{0, 1};
+    if (vm.count("shard")) {
+        for (const char* option : {"follow-includes", "max-count", "watch",
+                                   "index", "build-index"}) {
+            if (vm.count(option)) {
+                err << "sas: --shard cannot be combined with --" << option
+                    << std::endl;
+                return 1;
+            }
+        }
+        try {
+            shard = parse_shard(vm["shard"].as<std::string>());
+        } catch (const std::invalid_argument& e) {
+            err << "sas: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    std::unique_ptr<ChangedFiles> changed;
+    if (vm.count("since") || vm.count("rev")) {
+        for (const char* option : {"watch", "index", "build-index"}) {
+            if (vm.count(option)) {
+                err << "sas: --since and --rev cannot be combined with --"
+                    << option << std::endl;
+                return 1;
+            }
+        }
+    }
+    if (vm.count("since")) {
+        try {
+            changed.reset(new ChangedFiles(vm));
+        } catch (const std::runtime_error& e) {
+            err << "sas: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    // Without a search string every positional argument is a path
+    auto all_positional_paths = [&] {
+        std::vector<std::string> paths;
+        if (vm.count("search-string")) {
+            paths.push_back(vm["search-string"].as<std::string>());
+        }
+        if (vm.count("paths")) {
+            const auto& rest = vm["paths"].as<std::vector<std::string>>();
+            paths.insert(paths.end(), rest.begin(), rest.end());
+        }
+        return paths;
+    };
+
+    if (vm.count("build-index")) {
+        std::vector<std::string> files;
+        std::mutex files_mutex;
+        walk_paths(all_positional_paths(), true, vm,
+                   [&](const std::string& file) {
+                       if (fs::is_regular_file(file) &&
+                           should_search_path(file, vm)) {
+                           std::lock_guard<std::mutex> lock(files_mutex);
+                           files.push_back(file);
+                       }
+                   });
+        build_index(vm["build-index"].as<std::string>(), files, vm);
+        report();
+        return 0;
+    }
+
+    // Parse and compile every query up front, so that a bad search string
+    // or regex is reported before any file is parsed
+    auto compile = [&](const std::string& search_string) {
+        return compile_term(parse_search_string(search_string, vm));
+    };
 
-    auto paths = vm["paths"].as<std::vector<std::string>>();
+    std::vector<std::string> paths;
+    std::vector<NamedQuery> queries;
+    ParallelSearch::SearchFile search_file;
+    std::unique_ptr<IncludedHeaders> headers;
+    if (vm.count("follow-includes")) {
+        if (vm.count("fast")) {
+            err << "sas: --fast cannot be combined with --follow-includes"
+                << std::endl;
+            return 1;
+        }
+        headers.reset(new IncludedHeaders);
+    }
+    std::unique_ptr<MatchLimit> limit;
+    if (vm.count("max-count")) {
+        limit.reset(new MatchLimit(vm["max-count"].as<std::size_t>()));
+    }
 
-    for (const auto& path : paths) {
-        if (fs::is_directory(path)) {
-            if (!vm.count("recursive")) {
-                std::cerr << "sas: " << path << ": Is a directory" << std::endl;
-                continue;
-            } else {
-                for (fs::recursive_directory_iterator iter(path), end;
-                     iter != end; ++iter) {
-                    print_matches(iter->path().string(), term, vm);
+    if (vm.count("query") || vm.count("query-file")) {
+        std::vector<std::string> search_strings;
+        if (vm.count("query")) {
+            search_strings = vm["query"].as<std::vector<std::string>>();
+        }
+        if (vm.count("query-file")) {
+            const auto& query_file = vm["query-file"].as<std::string>();
+            std::ifstream in(query_file);
+            if (!in) {
+                err << "sas: " << query_file << ": Unable to read queries"
+                    << std::endl;
+                return 1;
+            }
+            std::string line;
+            while (std::getline(in, line)) {
+                if (!line.empty()) {
+                    search_strings.push_back(line);
                 }
             }
+        }
+
+        for (const auto& search_string : search_strings) {
+            try {
+                queries.push_back({search_string, compile(search_string)});
+            } catch (const std::invalid_argument& e) {
+                err << "sas: " << search_string << ": " << e.what()
+                    << std::endl;
+                return 1;
+            }
+        }
+
+        if (vm.count("index")) {
+            err << "sas: --index answers a single search string" << std::endl;
+            return 1;
+        }
+
+        paths = all_positional_paths();
+        search_file = [&](const std::string& file, std::size_t id) {
+            if (limit && limit->reached()) {
+                return std::string();
+            }
+            if (cache && !vm.count("fast")) {
+                return format_ast_matches(file, *cache->get(file, vm), queries,
+                                          true, vm, id, headers.get(),
+                                          limit.get());
+            }
+            return format_batch_matches(file, queries, vm, id, headers.get(),
+                                        limit.get());
+        };
+    } else {
+        const auto search_string = vm["search-string"].as<std::string>();
+        try {
+            queries.push_back({search_string, compile(search_string)});
+        } catch (const std::invalid_argument& e) {
+            err << "sas: " << e.what() << std::endl;
+            return 1;
+        }
+        const auto& term = queries.front().term;
+
+        if (vm.count("index")) {
+            try {
+                OutputSink sink(out, format);
+                print_indexed_matches(vm["index"].as<std::string>(), term,
+                                      sink);
+            } catch (const std::runtime_error& e) {
+                err << "sas: " << e.what() << std::endl;
+                return 1;
+            }
+            report();
+            return 0;
+        }
+
+        paths = vm["paths"].as<std::vector<std::string>>();
+        search_file = [&](const std::string& file, std::size_t id) {
+            if (limit && limit->reached()) {
+                return std::string();
+            }
+            if (cache && !vm.count("fast")) {
+                return format_ast_matches(file, *cache->get(file, vm), queries,
+                                          false, vm, id, headers.get(),
+                                          limit.get());
+            }
+            return format_matches(file, term, vm, id, headers.get(),
+                                  limit.get());
+        };
+    }
+
+    if (vm.count("watch")) {
+        // Re-searching a file cannot take back the matches of the headers
+        // it included, and a -m limit would be used up by the first search,
+        // leaving nothing for the updates
+        for (const char* option : {"follow-includes", "max-count"}) {
+            if (vm.count(option)) {
+                err << "sas: --watch cannot be combined with --" << option
+                    << std::endl;
+                return 1;
+            }
+        }
+        return watch_paths(paths, vm.count("recursive"), vm, search_file, out,
+                           err);
+    }
+
+    // The files under the paths, in the working tree or the --rev revision,
+    // and with --since only those changed since its revision
+    std::vector<std::string> revision;
+    if (vm.count("rev")) {
+        try {
+            revision = revision_files(paths, vm);
+        } catch (const std::runtime_error& e) {
+            err << "sas: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    walk_t walk = [&](const std::function<void(const std::string&)>& visit) {
+        auto visit_changed = [&](const std::string& file) {
+            if (!changed || changed->contains(file)) {
+                visit(file);
+            }
+        };
+        if (vm.count("rev")) {
+            for (const auto& file : revision) {
+                visit_changed(file);
+            }
+        } else {
+            walk_paths(paths, vm.count("recursive"), vm, visit_changed);
+        }
+    };
+
+    if (vm.count("shard")) {
+        std::string search;
+        for (const auto& query : queries) {
+            search += query.text;
+            search.push_back('\n');
+        }
+        try {
+            admitted = search_shard(walk, shard, search, search_file, format,
+                                    vm, out, err);
+        } catch (const std::runtime_error& e) {
+            err << "sas: " << e.what() << std::endl;
+            return 1;
+        }
+        report();
+        return 0;
+    }
+
+    // Declared before the search, so the output is completed after the last
+    // file is written
+    OutputSink sink(out, format);
+    std::unique_ptr<ParallelSearch> parallel;
+    if (search_jobs(vm) > 1) {
+        parallel.reset(new ParallelSearch(search_file, vm, sink));
+    }
+
+    std::atomic<std::size_t> file_id{0};
+    auto search_now = [&](const std::string& file) {
+        if (parallel) {
+            if (should_search_path(file, vm)) {
+                ++file_id;
+            }
+            parallel->enqueue(file);
+        } else if (should_search_path(file, vm)) {
+            try {
+                sink.write(search_file(file, file_id++), file);
+            } catch (const std::exception& e) {
+                err << "sas: " << file << ": " << e.what() << std::endl;
+            }
+        }
+    };
+
+    // With --follow-includes, headers wait until every other file has been
+    // searched, to find out whether any of them included the header
+    std::vector<std::string> deferred;
+    std::mutex deferred_mutex;
+    auto search = [&](const std::string& file) {
+        if (headers && is_header(file)) {
+            std::lock_guard<std::mutex> lock(deferred_mutex);
+            deferred.push_back(file);
         } else {
-            print_matches(path, term, vm);
+            search_now(file);
+        }
+    };
+
+    walk(search);
+
+    if (parallel) {
+        parallel->wait();
+        admitted = parallel->admitted_peak();
+    }
+    if (!deferred.empty()) {
+        if (parallel) {
+            // The first search's pool is closed, so the headers get their
+            // own, numbered after the files already searched
+            std::size_t first_id = file_id;
+            parallel.reset(new ParallelSearch(
+                [&, first_id](const std::string& file, std::size_t id) {
+                    return search_file(file, first_id + id);
+                },
+                vm, sink));
+        }
+        for (const auto& header : deferred) {
+            if (!headers->included(header)) {
+                search_now(header);
+            }
+        }
+        if (parallel) {
+            parallel->wait();
+            admitted = std::max(admitted, parallel->admitted_peak());
         }
     }
+    report();
 
     return 0;
 }
+}
+
+int main(int argc, char** argv) {
+    return run(std::vector<std::string>(argv + 1, argv + argc), std::cout,
+               std::cerr, nullptr);
+}
@@ -0,0 +1,133 @@
+#include <algorithm>
+
+#include "scheduler.hpp"
+
+std::size_t resolve_jobs(std::size_t jobs) {
+    if (jobs == 0) {
+        jobs = std::thread::hardware_concurrency();
+    }
+    return jobs ? jobs : 1;
+}
+
+WorkStealingPool::WorkStealingPool(std::size_t workers) {
+    workers = resolve_jobs(workers);
+    for (std::size_t i = 0; i < workers; ++i) {
+        m_workers.emplace_back(new Worker);
+    }
+    for (std::size_t i = 0; i < workers; ++i) {
+        m_threads.emplace_back([this, i] { run(i); });
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() { wait(); }
+
+void WorkStealingPool::submit(Task task) {
+    std::size_t index;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        index = m_next_worker++ % m_workers.size();
+    }
+    {
+        auto& worker = *m_workers[index];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_queued;
+    }
+    m_cv.notify_one();
+}
+
+void WorkStealingPool::wait() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+    }
+    m_cv.notify_all();
+    for (auto& thread : m_threads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+}
+
+bool WorkStealingPool::pop(std::size_t index, Task& task) {
+    const auto count = m_workers.size();
+    for (std::size_t i = 0; i < count; ++i) {
+        auto& worker = *m_workers[(index + i) % count];
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            if (worker.tasks.empty()) {
+                continue;
+            }
+            // Take our own work in submission order, but steal from the
+            // opposite end so we contend with the owner as little as possible
+            if (i == 0) {
+                task = std::move(worker.tasks.front());
+                worker.tasks.pop_front();
+            } else {
+                task = std::move(worker.tasks.back());
+                worker.tasks.pop_back();
+            }
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        --m_queued;
+        return true;
+    }
+    return false;
+}
+
+void WorkStealingPool::run(std::size_t index) {
+    for (;;) {
+        Task task;
+        if (pop(index, task)) {
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this] { return m_queued > 0 || m_closed; });
+        if (m_queued <= 0 && m_closed) {
+            return;
+        }
+    }
+}
+
+std::size_t OrderedOutput::reserve() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_next_slot++;
+}
+
+void OrderedOutput::complete(std::size_t slot, std::string file,
+                             std::string text) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_ready.emplace(slot, std::make_pair(std::move(file), std::move(text)));
+
+    auto iter = m_ready.begin();
+    while (iter != m_ready.end() && iter->first == m_next_flush) {
+        m_write(iter->second.first, iter->second.second);
+        iter = m_ready.erase(iter);
+        ++m_next_flush;
+    }
+}
+
+void MemoryBudget::acquire(std::size_t cost) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [&] { return m_used == 0 || m_used + cost <= m_budget; });
+    m_used += cost;
+    m_peak = std::max(m_peak, m_used);
+}
+
+void MemoryBudget::release(std::size_t cost) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_used -= cost;
+    }
+    m_cv.notify_all();
+}
+
+std::size_t MemoryBudget::peak() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_peak;
+}
@@ -6,34 +6,43 @@
 #define __STDC_CONSTANT_MACROS
 #endif
 
+#include <algorithm>
+#include <exception>
 #include <fstream>
 #include <type_traits>
+#include <unordered_map>
+
+#include <sys/stat.h>
 
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
 #include "clang/Lex/Lexer.h"
 #include "clang/Basic/TargetOptions.h"
 #include "clang/Basic/TargetInfo.h"
+#include "clang/Frontend/ASTUnit.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/ASTConsumers.h"
+#include "clang/Frontend/FrontendAction.h"
 #include "clang/ASTMatchers/ASTMatchers.h"
 #include "clang/ASTMatchers/ASTMatchFinder.h"
+#include "llvm/Support/MemoryBuffer.h"
 
 #include "search.hpp"
+#include "compilation.hpp"
+#include "cost.hpp"
+#include "fast.hpp"
+#include "git.hpp"
+#include "index.hpp"
+#include "lines.hpp"
 #include "matchers.hpp"
+#include "output.hpp"
+#include "scheduler.hpp"
+#include "stats.hpp"
 
 using namespace clang;
 using namespace clang::tooling;
 using namespace clang::ast_matchers;
 
-std::string get_line_from_offset(StringRef buffer, std::size_t offset) {
-    assert(buffer.size() > offset);
-
-    auto line_start = buffer.find_last_of("\r\n", offset) + 1;
-    auto line_end = buffer.find_first_of("\r\n", offset);
-    return std::string(buffer.begin() + line_start, buffer.begin() + line_end);
-}
-
 ///  Adapted from clang CIndex.cpp
 ///
 /// Clang internally represents ranges where the end location points to the
@@ -60,7 +69,9 @@ SourceRange translateSourceRange(const ASTContext* context,
     return Result;
 }
 
-using node_context_t = std::tuple<match_t, StringRef, std::size_t>;
+/// The range of a node, the buffer of the file it was expanded in, the
+/// offset of its start in that buffer, and that file
+using node_context_t = std::tuple<match_t, StringRef, std::size_t, FileID>;
 
 template <typename U>
 node_context_t node_context(const ASTContext* context, const SourceManager* sm,
@@ -82,15 +93,8 @@ node_context_t node_context(const ASTContext* context, const SourceManager* sm,
 
     return node_context_t{{{start_row, start_column}, {end_row, end_column}},
                           buffer,
-                          offset};
-}
-
-void print_context(const node_context_t& context) {
-    const auto& bounds = std::get<0>(context);
-    std::cout << bounds.first.first << ":" << bounds.first.second << ":"
-              << get_line_from_offset(std::get<1>(context),
-                                      std::get<2>(context))
-              << std::endl;
+                          offset,
+                          file_id};
 }
 
 node_context_t get_variable_context(const MatchFinder::MatchResult& Result) {
@@ -113,62 +117,317 @@ node_context_t get_type_context(const MatchFinder::MatchResult& Result) {
     return node_context(Result.Context, Result.SourceManager, d);
 }
 
+/// The matches a file's parse finds in its headers, with
+/// '--follow-includes'. Each header's matches are written under its own
+/// path, unless some file has already reported them, and are limited by a
+/// FileLimit of the header's own. With '-l', a header is listed by the first
+/// file that reports a match in it.
+class HeaderWriters {
+public:
+    HeaderWriters(OutputFormat format, std::size_t file_id,
+                  IncludedHeaders& headers, const SourceContext& context,
+                  MatchLimit* limit = nullptr)
+        : m_format{format}, m_file_id{file_id}, m_headers(headers),
+          m_context(context), m_limit{limit} {}
+
+    /// The writer for a match in a header, or null if the match has already
+    /// been reported or the header's limit rejects it
+    MatchWriter* writer(const SourceManager& sm, FileID file, unsigned offset,
+                        std::size_t query_id) {
+        const auto* entry = sm.getFileEntryForID(file);
+        if (!entry) {
+            return nullptr;
+        }
+        auto index = m_indices.find(entry);
+        if (index == m_indices.end()) {
+            const auto& id = entry->getUniqueID();
+            m_files.push_back(
+                {{id.getDevice(), id.getFile()},
+                 MatchWriter(m_format, entry->getName(), m_file_id,
+                             m_context),
+                 limit()});
+            index = m_indices.emplace(entry, m_files.size() - 1).first;
+        }
+        auto& header = m_files[index->second];
+        if (header.limit && !header.limit->accept()) {
+            return nullptr;
+        }
+        // A location is only claimed once it is certain to be written, and
+        // a header is listed once, whichever of its matches is first
+        auto first = m_format == OutputFormat::FilesWithMatches
+                         ? m_headers.first_report(header.key, 0, 0)
+                         : m_headers.first_report(header.key, offset,
+                                                  query_id);
+        if (!first) {
+            if (header.limit) {
+                header.limit->revoke();
+            }
+            return nullptr;
+        }
+        header.reported = true;
+        return &header.writer;
+    }
+
+    /// The file's own matches, followed by those in its headers (in the
+    /// order they were first matched)
+    std::string finish(MatchWriter& main) {
+        std::vector<std::string> formatted{main.finish()};
+        for (auto& header : m_files) {
+            if (header.reported) {
+                formatted.push_back(header.writer.finish());
+            }
+        }
+        return join_formatted(m_format, formatted);
+    }
+
+private:
+    struct Header {
+        IncludedHeaders::file_key_t key;
+        MatchWriter writer;
+        std::unique_ptr<FileLimit> limit;
+        bool reported = false;
+    };
+
+    std::unique_ptr<FileLimit> limit() const {
+        auto first_only = m_format == OutputFormat::FilesWithMatches;
+        if (!first_only && !m_limit) {
+            return nullptr;
+        }
+        return std::unique_ptr<FileLimit>(new FileLimit(first_only, m_limit));
+    }
+
+    OutputFormat m_format;
+    std::size_t m_file_id;
+    IncludedHeaders& m_headers;
+    SourceContext m_context;
+    MatchLimit* m_limit;
+    std::vector<Header> m_files;
+    std::unordered_map<const FileEntry*, std::size_t> m_indices;
+};
+
 template <typename T>
 class Printer : public MatchFinder::MatchCallback {
 public:
+    /// A non-empty tag (the query, in a batch) prefixes every text line.
+    /// Given 'headers', matches outside the main file are written there,
+    /// under the headers' own limits. Given 'limit', only the matches in the
+    /// main file it accepts are written.
+    explicit Printer(MatchWriter& writer, std::size_t query_id = 0,
+                     const std::string& tag = {},
+                     HeaderWriters* headers = nullptr,
+                     FileLimit* limit = nullptr)
+        : m_writer(writer), m_query_id{query_id}, m_tag{tag},
+          m_headers{headers}, m_limit{limit} {}
+
     virtual void run(const MatchFinder::MatchResult& Result) {
+        if (!m_headers && m_limit && m_limit->stopped()) {
+            return;
+        }
         node_context_t context;
-        if (std::is_same<T, Variable>::value) {
+        if (std::is_same<T, CompiledVariable>::value) {
             context = get_variable_context(Result);
-        } else if (std::is_same<T, Function>::value) {
+        } else if (std::is_same<T, CompiledFunction>::value) {
             context = get_function_context(Result);
-        } else if (std::is_same<T, Class>::value) {
+        } else if (std::is_same<T, CompiledClass>::value) {
             context = get_type_context(Result);
         }
-        print_context(context);
+        auto writer = &m_writer;
+        if (m_headers &&
+            std::get<3>(context) != Result.SourceManager->getMainFileID()) {
+            writer = m_headers->writer(*Result.SourceManager,
+                                       std::get<3>(context),
+                                       std::get<2>(context), m_query_id);
+            if (!writer) {
+                return;
+            }
+        } else if (m_limit && !m_limit->accept()) {
+            return;
+        }
+        writer->write_in_source(std::get<0>(context), std::get<1>(context),
+                                m_query_id, m_tag);
     }
+
+private:
+    MatchWriter& m_writer;
+    std::size_t m_query_id;
+    std::string m_tag;
+    HeaderWriters* m_headers;
+    FileLimit* m_limit;
 };
 
 template <typename T>
 class MatchListBuilder : public MatchFinder::MatchCallback {
 public:
+    explicit MatchListBuilder(std::vector<match_t>& matches)
+        : m_matches(matches) {}
+
     virtual void run(const MatchFinder::MatchResult& Result) {
         node_context_t context;
-        if (std::is_same<T, Variable>::value) {
+        if (std::is_same<T, CompiledVariable>::value) {
             context = get_variable_context(Result);
-        } else if (std::is_same<T, Function>::value) {
+        } else if (std::is_same<T, CompiledFunction>::value) {
             context = get_function_context(Result);
-        } else if (std::is_same<T, Class>::value) {
+        } else if (std::is_same<T, CompiledClass>::value) {
             context = get_type_context(Result);
         }
-        matches.push_back(std::get<0>(context));
+        m_matches.push_back(std::get<0>(context));
     }
 
-    std::vector<match_t> matches;
+private:
+    std::vector<match_t>& m_matches;
+};
+
+/// Records every declaration that addMatchersForTerm could match, whatever
+/// the term, so it can be written to the index.
+class DeclarationCollector : public MatchFinder::MatchCallback {
+public:
+    virtual void run(const MatchFinder::MatchResult& Result) {
+        IndexedDecl decl;
+        node_context_t context;
+        if (auto d = Result.Nodes.getNodeAs<VarDecl>("varDecl")) {
+            decl.kind = IndexedDecl::VariableKind;
+            decl.name = d->getNameAsString();
+            decl.type = d->getType().getAsString();
+            add_qualifiers(d, decl);
+            context = node_context(Result.Context, Result.SourceManager, d);
+        } else if (auto d =
+                       Result.Nodes.getNodeAs<FunctionDecl>("funcDecl")) {
+            decl.kind = IndexedDecl::FunctionKind;
+            add_function(d, decl);
+            context = node_context(Result.Context, Result.SourceManager, d);
+        } else if (auto e = Result.Nodes.getNodeAs<CallExpr>("funcCall")) {
+            decl.kind = IndexedDecl::CallKind;
+            add_function(Result.Nodes.getNodeAs<FunctionDecl>("callee"), decl);
+            context = node_context(Result.Context, Result.SourceManager, e);
+        } else if (auto d = Result.Nodes.getNodeAs<RecordDecl>("typeDecl")) {
+            decl.kind = IndexedDecl::RecordKind;
+            decl.name = d->getNameAsString();
+            context = node_context(Result.Context, Result.SourceManager, d);
+        }
+        decl.range = std::get<0>(context);
+        auto buffer = std::get<1>(context);
+        if (!m_lines || m_lines->data() != buffer.data()) {
+            m_lines.reset(new LineIndex(buffer));
+        }
+        decl.line = m_lines->line(m_lines->line_of(std::get<2>(context))).str();
+        decls.push_back(std::move(decl));
+    }
+
+    std::vector<IndexedDecl> decls;
+
+private:
+    /// The lines of the buffer the last declaration was found in
+    std::unique_ptr<LineIndex> m_lines;
+
+    static void add_qualifiers(const NamedDecl* d, IndexedDecl& decl) {
+        auto context = d->getDeclContext();
+        while (context && isa<NamedDecl>(context)) {
+            auto kind = IndexedDecl::OtherContext;
+            if (isa<NamespaceDecl>(context)) {
+                kind = IndexedDecl::NamespaceContext;
+            } else if (isa<RecordDecl>(context)) {
+                kind = IndexedDecl::RecordContext;
+            }
+            decl.qualifiers.emplace_back(
+                kind, cast<NamedDecl>(context)->getNameAsString());
+            context = context->getParent();
+        }
+    }
+
+    static void add_function(const FunctionDecl* d, IndexedDecl& decl) {
+        decl.name = d->getNameAsString();
+        decl.type = d->getReturnType().getAsString();
+        add_qualifiers(d, decl);
+        for (const auto* param : d->params()) {
+            decl.parameters.emplace_back(param->getType().getAsString(),
+                                         param->getNameAsString());
+        }
+    }
+};
+
+/// The caches of matchers that are run on more than one translation unit.
+/// A cache's keys point into the AST it was filled from, so every cache is
+/// cleared before the matchers are run on the next one.
+class MatcherCaches {
+public:
+    template <typename T>
+    std::shared_ptr<T> make() {
+        auto cache = std::make_shared<T>();
+        m_caches.push_back([cache] { cache->clear(); });
+        return cache;
+    }
+
+    void clear() {
+        for (const auto& clear_cache : m_caches) {
+            clear_cache();
+        }
+    }
+
+private:
+    std::vector<std::function<void()>> m_caches;
+};
+
+/// How the matchers for a term are built
+struct MatcherOptions {
+    /// Match declarations in the headers the main file includes, as well as
+    /// in the main file (see IncludedHeaders)
+    bool headers = false;
+    /// Stop matching once the limit is reached
+    const FileLimit* limit = nullptr;
+    /// Given for matchers that outlive one translation unit
+    MatcherCaches* caches = nullptr;
+
+    internal::Matcher<Decl> running() const {
+        if (limit) {
+            // The limit is the main file's, while each header has its own
+            return headers ? untilRunStopped(limit) : untilStopped(limit);
+        }
+        return anything();
+    }
+
+    template <typename T>
+    std::shared_ptr<T> cache() const {
+        return caches ? caches->make<T>() : std::make_shared<T>();
+    }
 };
 
 template <typename Callback>
-void addMatchersForTerm(const Variable& v, MatchFinder& finder,
-                        Callback* callback) {
+void addMatchersForTerm(const CompiledVariable& v, MatchFinder& finder,
+                        Callback* callback,
+                        const MatcherOptions& options = {}) {
 
+    auto contexts = options.cache<MatchCache<DeclContext>>();
+    auto types = options.cache<TypeMatchCache>();
     auto varDeclMatcher =
-        varDecl(allOf(isExpansionInMainFile(), matchesUnqualifiedName(v.name),
-                      hasType(matchesType(v.type)),
-                      matchesQualifiers(v.qualifiers), unless(isImplicit())))
+        varDecl(allOf(options.running(),
+                      isExpansionInSearchedFile(options.headers),
+                      matchesUnqualifiedName(v.name),
+                      hasType(matchesType(v.type, types)),
+                      matchesQualifiers(v.qualifiers, contexts),
+                      unless(isImplicit())))
             .bind("varDecl");
 
     finder.addMatcher(varDeclMatcher, callback);
 }
 
 template <typename Callback>
-void addMatchersForTerm(const Function& f, MatchFinder& finder,
-                        Callback* callback) {
+void addMatchersForTerm(const CompiledFunction& f, MatchFinder& finder,
+                        Callback* callback,
+                        const MatcherOptions& options = {}) {
 
-    auto declMatcher = functionDecl(
-        allOf(isExpansionInMainFile(), matchesUnqualifiedName(f.name),
-              returns(matchesType(f.return_type)), unless(isImplicit()),
-              matchesQualifiers(f.qualifiers),
-              matchesParameters(f.parameters)));
+    // Declarations and call sites share the caches, so each declaration is
+    // checked once however often it is called
+    auto contexts = options.cache<MatchCache<DeclContext>>();
+    auto decls = options.cache<MatchCache<FunctionDecl>>();
+    auto types = options.cache<TypeMatchCache>();
+    auto declMatcher = functionDecl(memoizedFunction(
+        functionDecl(allOf(
+            options.running(), isExpansionInSearchedFile(options.headers),
+            matchesUnqualifiedName(f.name),
+            returns(matchesType(f.return_type, types)), unless(isImplicit()),
+            matchesQualifiers(f.qualifiers, contexts),
+            matchesParameters(f.parameters, types))),
+        decls));
 
     auto funcDeclMatcher = declMatcher.bind("funcDecl");
 
@@ -180,77 +439,811 @@ void addMatchersForTerm(const Function& f, MatchFinder& finder,
 }
 
 template <typename Callback>
-void addMatchersForTerm(const Class& c, MatchFinder& finder,
-                        Callback* callback) {
+void addMatchersForTerm(const CompiledClass& c, MatchFinder& finder,
+                        Callback* callback,
+                        const MatcherOptions& options = {}) {
 
+    // Classes are matched wherever they are declared, except that following
+    // includes stops at system headers
+    internal::Matcher<Decl> location = anything();
+    if (options.headers) {
+        location = isExpansionInSearchedFile(true);
+    }
     auto typeDeclMatcher =
-        recordDecl(allOf(matchesClass(c), unless(isImplicit())))
+        recordDecl(allOf(options.running(), matchesClass(c),
+                         unless(isImplicit()), location))
             .bind("typeDecl");
     finder.addMatcher(typeDeclMatcher, callback);
 }
 
+// Whether a match of the term in 'source' may lie inside a function body,
+// or be instantiated there. A local variable's innermost context is its
+// function, so it can never satisfy a qualifier. But a body may be the first
+// to use a template (e.g., 'S<int>::x = 1;' instantiates the member S<int>::x
+// where S is declared), so a file that declares templates needs its bodies.
+// Classes and functions can be declared locally (or be members of a
+// lambda), so those terms always need bodies.
+
+bool needs_function_bodies(const CompiledVariable& v, StringRef source) {
+    return v.qualifiers.empty() || source.find("template") != StringRef::npos;
+}
+
+bool needs_function_bodies(const CompiledFunction&, StringRef) { return true; }
+
+bool needs_function_bodies(const CompiledClass&, StringRef) { return true; }
+
+template <typename T>
+bool skip_function_bodies(const T& term, StringRef source,
+                          const po::variables_map& config) {
+    return !config.count("full-parse") && !needs_function_bodies(term, source);
+}
+
+/// Map a file into memory (or read it, if it is too small to be worth
+/// mapping). Clang is handed this buffer directly, so the source is never
+/// copied. With '--rev', the file is read from the revision instead.
+std::unique_ptr<llvm::MemoryBuffer>
+load_source(const std::string& file, const po::variables_map& config) {
+    StageTimer timer(Stage::Read);
+    if (config.count("rev")) {
+        return read_revision_file(file, config);
+    }
+    auto buffer = llvm::MemoryBuffer::getFile(file);
+    if (!buffer) {
+        throw std::runtime_error(buffer.getError().message());
+    }
+    return std::move(*buffer);
+}
+
+/// Run a frontend action over a file's source, with the flags from
+/// parse_command(). Skipped function bodies are neither parsed nor
+/// type-checked. Given 'files', its cache of the files and directories
+/// looked up (e.g., while searching include paths) is used and kept.
+void run_frontend(FrontendAction* action, const std::string& file,
+                  StringRef source, const po::variables_map& config,
+                  bool skip_bodies = false, FileManager* files = nullptr) {
+    auto command = parse_command(file, source, config);
+    if (skip_bodies) {
+        command.arguments.push_back("-Xclang");
+        command.arguments.push_back("-skip-function-bodies");
+    }
+
+    std::vector<std::string> args{"clang-tool", "-fsyntax-only"};
+    args.insert(args.end(), command.arguments.begin(),
+                command.arguments.end());
+    args.push_back(command.filename);
+
+    // The file is remapped to our buffer, which clang wraps without copying
+    // instead of reading the file again. With '--rev', the headers it
+    // includes are read from the revision too.
+    IntrusiveRefCntPtr<vfs::FileSystem> file_system;
+    if (config.count("rev")) {
+        file_system = revision_file_system(config);
+    }
+    IntrusiveRefCntPtr<FileManager> manager(
+        files ? files : new FileManager(FileSystemOptions(), file_system));
+    ToolInvocation invocation(args, action, manager.get());
+    invocation.mapVirtualFile(command.filename, source);
+    StageTimer timer(Stage::Parse);
+    invocation.run();
+}
+
+void add_included_files(const SourceManager& sm, IncludedHeaders& headers) {
+    for (auto file = sm.fileinfo_begin(); file != sm.fileinfo_end(); ++file) {
+        const auto& id = file->first->getUniqueID();
+        headers.add_included({id.getDevice(), id.getFile()});
+    }
+}
+
+/// Runs a MatchFinder's matchers once the whole file has been parsed, timing
+/// them as a stage of their own. Given 'headers', the files the parse
+/// included are added to them. The parse is measured for '--mem-budget'.
+class TimedMatchConsumer : public ASTConsumer {
+public:
+    TimedMatchConsumer(std::unique_ptr<ASTConsumer> consumer,
+                       IncludedHeaders* headers)
+        : m_consumer{std::move(consumer)}, m_headers{headers} {}
+
+    void HandleTranslationUnit(ASTContext& context) override {
+        StageTimer timer(Stage::Match);
+        m_consumer->HandleTranslationUnit(context);
+        if (m_headers) {
+            add_included_files(context.getSourceManager(), *m_headers);
+        }
+        record_parse_memory(context);
+    }
+
+private:
+    std::unique_ptr<ASTConsumer> m_consumer;
+    IncludedHeaders* m_headers;
+};
+
+class MatchAction : public ASTFrontendAction {
+public:
+    explicit MatchAction(MatchFinder& finder,
+                         IncludedHeaders* headers = nullptr)
+        : m_finder(finder), m_headers{headers} {}
+
+protected:
+    std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance&,
+                                                   StringRef) override {
+        return std::unique_ptr<ASTConsumer>(
+            new TimedMatchConsumer(m_finder.newASTConsumer(), m_headers));
+    }
+
+private:
+    MatchFinder& m_finder;
+    IncludedHeaders* m_headers;
+};
+
+template <typename T>
+bool rejected_by_prefilter(const T& term, StringRef source,
+                           const po::variables_map& config,
+                           bool forced_includes = false) {
+    StageTimer timer(Stage::Prefilter);
+    return !config.count("no-prefilter") &&
+           !may_match(term, source, forced_includes);
+}
+
+class MayMatchVisitor : public boost::static_visitor<bool> {
+public:
+    MayMatchVisitor(StringRef source, bool forced_includes)
+        : m_source(source), m_forced_includes{forced_includes} {}
+    template <typename T>
+    bool operator()(const T& term) const {
+        return may_match(term, m_source, m_forced_includes);
+    }
+
+private:
+    StringRef m_source;
+    bool m_forced_includes;
+};
+
+// A batch can only be skipped if none of its queries could match
+bool rejected_by_prefilter(const std::vector<NamedQuery>& queries,
+                           StringRef source, const po::variables_map& config,
+                           bool forced_includes = false) {
+    StageTimer timer(Stage::Prefilter);
+    return !config.count("no-prefilter") &&
+           std::none_of(queries.begin(), queries.end(),
+                        [&](const NamedQuery& query) {
+                            return boost::apply_visitor(
+                                MayMatchVisitor(source, forced_includes),
+                                query.term);
+                        });
+}
+
+/// The declarations '--fast' recognizes in a file's source, or none if the
+/// prefilter rules out every match of 'query' (a term or a batch)
+template <typename Query>
+std::vector<IndexedDecl> lex_file(StringRef source, const Query& query,
+                                  const po::variables_map& config) {
+    if (rejected_by_prefilter(query, source, config)) {
+        return {};
+    }
+
+    StageTimer timer(Stage::Parse);
+    return lex_declarations(source);
+}
+
+class NeedsBodiesVisitor : public boost::static_visitor<bool> {
+public:
+    explicit NeedsBodiesVisitor(StringRef source) : m_source{source} {}
+
+    template <typename T>
+    bool operator()(const T& term) const {
+        return needs_function_bodies(term, m_source);
+    }
+
+private:
+    StringRef m_source;
+};
+
+using callback_list_t =
+    std::vector<std::unique_ptr<MatchFinder::MatchCallback>>;
+
+/// Adds a term's matchers to a MatchFinder shared by a whole batch. The
+/// callback for the term's kind is created by 'make_callback' and kept
+/// alive in 'callbacks'.
+template <typename MakeCallback>
+class BatchMatcherVisitor : public boost::static_visitor<> {
+public:
+    BatchMatcherVisitor(MatchFinder& finder, callback_list_t& callbacks,
+                        MakeCallback make_callback,
+                        const MatcherOptions& options = {})
+        : m_finder(finder), m_callbacks(callbacks),
+          m_make_callback(make_callback), m_options(options) {}
+
+    template <typename T>
+    void operator()(const T& term) const {
+        auto callback = m_make_callback(term);
+        addMatchersForTerm(term, m_finder, callback.get(), m_options);
+        m_callbacks.emplace_back(std::move(callback));
+    }
+
+private:
+    MatchFinder& m_finder;
+    callback_list_t& m_callbacks;
+    MakeCallback m_make_callback;
+    MatcherOptions m_options;
+};
+
+/// Run every query of a batch over a file in a single parse.
+/// 'make_callback(term, i)' creates the callback for the i'th query.
+/// Given 'headers', the files the parse includes are added to them.
+template <typename MakeCallback>
+void run_batch(const std::string& file, const std::vector<NamedQuery>& queries,
+               const po::variables_map& config, MakeCallback make_callback,
+               IncludedHeaders* headers = nullptr,
+               const FileLimit* limit = nullptr) {
+    auto buffer = load_source(file, config);
+    auto source = buffer->getBuffer();
+
+    if (rejected_by_prefilter(queries, source, config,
+                              has_forced_includes(file, config))) {
+        return;
+    }
+
+    MatchFinder finder;
+    callback_list_t callbacks;
+    MatcherOptions options{headers != nullptr, limit};
+    // Templates in the headers may be instantiated in the file's bodies too
+    bool skip_bodies = !config.count("full-parse") && !headers;
+    for (std::size_t i = 0; i < queries.size(); ++i) {
+        auto make = [&, i](const auto& term) { return make_callback(term, i); };
+        BatchMatcherVisitor<decltype(make)> visitor(finder, callbacks, make,
+                                                    options);
+        boost::apply_visitor(visitor, queries[i].term);
+        if (boost::apply_visitor(NeedsBodiesVisitor(source),
+                                 queries[i].term)) {
+            skip_bodies = false;
+        }
+    }
+
+    run_frontend(new MatchAction(finder, headers), file, source, config,
+                 skip_bodies);
+}
+
 bool should_search_path(const std::string& file,
                         const po::variables_map& config) {
-    auto p = boost::filesystem::path(file);
-    auto extension = boost::filesystem::extension(p);
-    if (!config.count("search-all-extensions") && extension != ".cpp" &&
-        extension != ".c" && extension != ".h" && extension != ".hpp") {
+    if (config.count("search-all-extensions")) {
+        return true;
+    }
+    // Called for every file a walk finds, so the extension is found without
+    // building a path
+    StringRef name(file);
+    auto dot = name.rfind('.');
+    if (dot == StringRef::npos || name.find('/', dot) != StringRef::npos) {
         return false;
     }
-    return true;
+    auto extension = name.substr(dot);
+    return extension == ".cpp" || extension == ".c" || extension == ".h" ||
+           extension == ".hpp";
 }
 
-void print_matches(const std::string& file, Term& term,
-                   const po::variables_map& config) {
+bool is_header(const std::string& file) {
+    StringRef name(file);
+    return name.endswith(".h") || name.endswith(".hpp") ||
+           name.endswith(".hh") || name.endswith(".hxx");
+}
+
+void IncludedHeaders::add_included(file_key_t file) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_included.insert(file);
+}
+
+bool IncludedHeaders::included(const std::string& path) const {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_included.count({info.st_dev, info.st_ino}) > 0;
+}
+
+bool IncludedHeaders::first_report(file_key_t file, unsigned offset,
+                                   std::size_t query_id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_reported.emplace(file, offset, query_id).second;
+}
+
+std::size_t search_jobs(const po::variables_map& config) {
+    if (!config.count("jobs")) {
+        return 1;
+    }
+    return resolve_jobs(config["jobs"].as<std::size_t>());
+}
+
+std::string format_matches(const std::string& file, const CompiledTerm& term,
+                           const po::variables_map& config,
+                           std::size_t file_id, IncludedHeaders* headers,
+                           MatchLimit* limit) {
     if (!should_search_path(file, config)) {
+        return {};
+    }
+    if (headers || limit || config.count("files-with-matches")) {
+        // A batch of one, which can write the matches in headers separately
+        // and stop at a limit
+        return format_batch_matches(file, {{{}, term}}, config, file_id,
+                                    headers, limit);
+    }
+    FileStats stats(file);
+    MatchWriter writer(output_format(config), file, file_id,
+                       source_context(config));
+    boost::apply_visitor(MatchPrintVisitor(file, config, writer), term);
+    return writer.finish();
+}
+
+void print_matches(const std::string& file, const CompiledTerm& term,
+                   const po::variables_map& config, std::ostream& out) {
+    OutputSink sink(out, output_format(config));
+    sink.write(format_matches(file, term, config), file);
+}
+
+void print_matches(const std::vector<std::string>& files,
+                   const CompiledTerm& term, const po::variables_map& config) {
+    OutputSink sink(std::cout, output_format(config));
+    if (search_jobs(config) == 1) {
+        std::size_t file_id = 0;
+        for (const auto& file : files) {
+            if (!should_search_path(file, config)) {
+                continue;
+            }
+            // As ParallelSearch does, a file that cannot be searched is
+            // reported and the others are still searched
+            try {
+                sink.write(format_matches(file, term, config, file_id++),
+                           file);
+            } catch (const std::exception& e) {
+                std::cerr << "sas: " << file << ": " << e.what() << std::endl;
+            }
+        }
         return;
     }
-    boost::apply_visitor(MatchPrintVisitor(file, config), term);
+
+    ParallelSearch search(term, config, sink);
+    for (const auto& file : files) {
+        search.enqueue(file);
+    }
+    search.wait();
 }
 
-std::vector<match_t> find_matches(const std::string& file, Term& term,
+std::vector<match_t> find_matches(const std::string& file,
+                                  const CompiledTerm& term,
                                   const po::variables_map& config) {
     if (!should_search_path(file, config)) {
         return {};
     }
+    FileStats stats(file);
     return boost::apply_visitor(MatchBuildListVisitor(file, config), term);
 }
 
+std::vector<std::vector<match_t>>
+find_matches(const std::vector<std::string>& files, const CompiledTerm& term,
+             const po::variables_map& config) {
+    std::vector<std::vector<match_t>> results(files.size());
+
+    if (search_jobs(config) == 1) {
+        for (std::size_t i = 0; i < files.size(); ++i) {
+            results[i] = find_matches(files[i], term, config);
+        }
+        return results;
+    }
+
+    // An exception must not escape a worker, so each file's is kept and
+    // the first file's rethrown, as a search of one file after another
+    // would throw it
+    std::vector<std::exception_ptr> errors(files.size());
+    WorkStealingPool pool(search_jobs(config));
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        pool.submit([&, i] {
+            try {
+                results[i] = find_matches(files[i], term, config);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    pool.wait();
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    return results;
+}
+
+std::unique_ptr<FileLimit> file_limit(const po::variables_map& config,
+                                      MatchLimit* limit) {
+    auto first_only = config.count("files-with-matches") > 0;
+    if (!first_only && !limit) {
+        return nullptr;
+    }
+    return std::unique_ptr<FileLimit>(new FileLimit(first_only, limit));
+}
+
+std::string format_batch_matches(const std::string& file,
+                                 const std::vector<NamedQuery>& queries,
+                                 const po::variables_map& config,
+                                 std::size_t file_id, IncludedHeaders* headers,
+                                 MatchLimit* limit) {
+    if (!should_search_path(file, config)) {
+        return {};
+    }
+    FileStats stats(file);
+    auto format = output_format(config);
+    auto context = source_context(config);
+    MatchWriter writer(format, file, file_id, context);
+    std::unique_ptr<HeaderWriters> header_writers;
+    if (headers) {
+        header_writers.reset(
+            new HeaderWriters(format, file_id, *headers, context, limit));
+    }
+    auto limits = file_limit(config, limit);
+    if (config.count("fast")) {
+        auto buffer = load_source(file, config);
+        auto source = buffer->getBuffer();
+        auto decls = lex_file(source, queries, config);
+        StageTimer timer(Stage::Match);
+        for (const auto& decl : decls) {
+            for (std::size_t i = 0; i < queries.size(); ++i) {
+                if (lexed_match(decl, queries[i].term) &&
+                    (!limits || limits->accept())) {
+                    writer.write_in_source(decl.range, source, i,
+                                           queries[i].text);
+                }
+            }
+        }
+        return writer.finish();
+    }
+    run_batch(file, queries, config,
+              [&](const auto& term, std::size_t i) {
+                  using T = typename std::decay<decltype(term)>::type;
+                  return std::unique_ptr<Printer<T>>(
+                      new Printer<T>(writer, i, queries[i].text,
+                                     header_writers.get(), limits.get()));
+              },
+              headers, limits.get());
+    return header_writers ? header_writers->finish(writer) : writer.finish();
+}
+
+std::string format_ast_matches(const std::string& file, ASTUnit& unit,
+                               const std::vector<NamedQuery>& queries,
+                               bool tagged, const po::variables_map& config,
+                               std::size_t file_id, IncludedHeaders* headers,
+                               MatchLimit* limit) {
+    FileStats stats(file);
+    auto format = output_format(config);
+    auto context = source_context(config);
+    MatchWriter writer(format, file, file_id, context);
+    std::unique_ptr<HeaderWriters> header_writers;
+    if (headers) {
+        header_writers.reset(
+            new HeaderWriters(format, file_id, *headers, context, limit));
+        add_included_files(unit.getSourceManager(), *headers);
+    }
+    auto limits = file_limit(config, limit);
+    MatchFinder finder;
+    callback_list_t callbacks;
+    MatcherOptions options{headers != nullptr, limits.get()};
+    for (std::size_t i = 0; i < queries.size(); ++i) {
+        auto make = [&, i](const auto& term) {
+            using T = typename std::decay<decltype(term)>::type;
+            return std::unique_ptr<Printer<T>>(new Printer<T>(
+                writer, i, tagged ? queries[i].text : std::string(),
+                header_writers.get(), limits.get()));
+        };
+        BatchMatcherVisitor<decltype(make)> visitor(finder, callbacks, make,
+                                                    options);
+        boost::apply_visitor(visitor, queries[i].term);
+    }
+
+    StageTimer timer(Stage::Match);
+    finder.matchAST(unit.getASTContext());
+    return header_writers ? header_writers->finish(writer) : writer.finish();
+}
+
+void print_batch_matches(const std::string& file,
+                         const std::vector<NamedQuery>& queries,
+                         const po::variables_map& config, std::ostream& out) {
+    OutputSink sink(out, output_format(config));
+    sink.write(format_batch_matches(file, queries, config), file);
+}
+
+std::vector<std::vector<match_t>>
+find_batch_matches(const std::string& file,
+                   const std::vector<NamedQuery>& queries,
+                   const po::variables_map& config) {
+    std::vector<std::vector<match_t>> results(queries.size());
+    if (!should_search_path(file, config)) {
+        return results;
+    }
+    FileStats stats(file);
+    if (config.count("fast")) {
+        auto buffer = load_source(file, config);
+        auto decls = lex_file(buffer->getBuffer(), queries, config);
+        StageTimer timer(Stage::Match);
+        for (const auto& decl : decls) {
+            for (std::size_t i = 0; i < queries.size(); ++i) {
+                if (lexed_match(decl, queries[i].term)) {
+                    results[i].push_back(decl.range);
+                }
+            }
+        }
+        return results;
+    }
+    run_batch(file, queries, config, [&](const auto& term, std::size_t i) {
+        using T = typename std::decay<decltype(term)>::type;
+        return std::unique_ptr<MatchListBuilder<T>>(
+            new MatchListBuilder<T>(results[i]));
+    });
+    return results;
+}
+
+void print_matches(const std::string& file, const Term& term,
+                   const po::variables_map& config, std::ostream& out) {
+    print_matches(file, compile_term(term), config, out);
+}
+
+void print_matches(const std::vector<std::string>& files, const Term& term,
+                   const po::variables_map& config) {
+    print_matches(files, compile_term(term), config);
+}
+
+std::vector<match_t> find_matches(const std::string& file, const Term& term,
+                                  const po::variables_map& config) {
+    return find_matches(file, compile_term(term), config);
+}
+
+std::vector<std::vector<match_t>>
+find_matches(const std::vector<std::string>& files, const Term& term,
+             const po::variables_map& config) {
+    return find_matches(files, compile_term(term), config);
+}
+
+ParallelSearch::ParallelSearch(SearchFile search,
+                               const po::variables_map& config,
+                               WriteFile write)
+    : m_search(search), m_config(config),
+      m_output(new OrderedOutput(std::move(write))),
+      m_pool(new WorkStealingPool(search_jobs(config))) {
+    if (config.count("mem-budget")) {
+        auto megabytes = config["mem-budget"].as<std::size_t>();
+        m_budget.reset(new MemoryBudget(megabytes * 1024 * 1024));
+        m_costs.reset(new CostModel);
+    }
+}
+
+ParallelSearch::ParallelSearch(SearchFile search,
+                               const po::variables_map& config,
+                               OutputSink& sink)
+    : ParallelSearch(
+          search, config,
+          [&sink](const std::string& file, const std::string& formatted) {
+              sink.write(formatted, file);
+          }) {}
+
+ParallelSearch::ParallelSearch(const CompiledTerm& term,
+                               const po::variables_map& config,
+                               OutputSink& sink)
+    : ParallelSearch(
+          [term, &config](const std::string& file, std::size_t id) {
+              return format_matches(file, term, config, id);
+          },
+          config, sink) {}
+
+ParallelSearch::~ParallelSearch() { wait(); }
+
+void ParallelSearch::enqueue(const std::string& file) {
+    if (!should_search_path(file, m_config)) {
+        return;
+    }
+
+    auto slot = m_output->reserve();
+    m_pool->submit([this, file, slot] {
+        std::string formatted;
+        try {
+            formatted = m_budget ? search_within_budget(file, slot)
+                                 : m_search(file, slot);
+        } catch (const std::exception& e) {
+            std::cerr << "sas: " << file << ": " << e.what() << std::endl;
+        }
+        m_output->complete(slot, file, std::move(formatted));
+    });
+}
+
+void ParallelSearch::wait() { m_pool->wait(); }
+
+std::size_t ParallelSearch::admitted_peak() const {
+    return m_budget ? m_budget->peak() : 0;
+}
+
+std::string ParallelSearch::search_within_budget(const std::string& file,
+                                                 std::size_t slot) {
+    struct stat info;
+    std::size_t size = stat(file.c_str(), &info) == 0 ? info.st_size : 0;
+
+    ParseMeasure measure;
+    std::string formatted;
+    {
+        // Workers wait here, rather than parsing, while the files being
+        // parsed are expected to use the whole budget
+        MemoryReservation reservation(*m_budget, m_costs->estimate(size));
+        formatted = m_search(file, slot);
+    }
+    release_free_memory();
+    if (measure.bytes() > 0) {
+        m_costs->record(size, measure.bytes());
+    }
+    return formatted;
+}
+
 template <typename T>
-void MatchPrintVisitor::operator()(T& term) const {
-    std::ifstream ifs{this->m_root_filename};
-    std::stringstream buffer;
-    buffer << ifs.rdbuf();
+void MatchPrintVisitor::operator()(const T& term) const {
+    auto buffer = load_source(m_root_filename, m_config);
+    auto source = buffer->getBuffer();
+
+    if (m_config.count("fast")) {
+        auto decls = lex_file(source, term, m_config);
+        StageTimer timer(Stage::Match);
+        for (const auto& decl : decls) {
+            if (lexed_match(decl, term)) {
+                m_writer.write_in_source(decl.range, source, 0, {});
+            }
+        }
+        return;
+    }
+
+    if (rejected_by_prefilter(
+            term, source, m_config,
+            has_forced_includes(m_root_filename, m_config))) {
+        return;
+    }
 
     MatchFinder finder;
-    Printer<T> printer;
+    Printer<T> printer(m_writer);
 
     addMatchersForTerm(term, finder, &printer);
 
-    auto action_factory = newFrontendActionFactory(&finder);
-    auto action = action_factory->create();
-
-    runToolOnCodeWithArgs(action, buffer.str(),
-                          {"-w", "-std=c++14",
-                           "-I/usr/lib/clang/3.7.1/include"});
+    run_frontend(new MatchAction(finder), m_root_filename, source, m_config,
+                 skip_function_bodies(term, source, m_config));
 }
 
 template <typename T>
-std::vector<match_t> MatchBuildListVisitor::operator()(T& term) const {
-    std::ifstream ifs{this->m_root_filename};
-    std::stringstream buffer;
-    buffer << ifs.rdbuf();
+std::vector<match_t> MatchBuildListVisitor::operator()(const T& term) const {
+    auto buffer = load_source(m_root_filename, m_config);
+    auto source = buffer->getBuffer();
+
+    if (m_config.count("fast")) {
+        auto decls = lex_file(source, term, m_config);
+        StageTimer timer(Stage::Match);
+        std::vector<match_t> matches;
+        for (const auto& decl : decls) {
+            if (lexed_match(decl, term)) {
+                matches.push_back(decl.range);
+            }
+        }
+        return matches;
+    }
+
+    if (rejected_by_prefilter(
+            term, source, m_config,
+            has_forced_includes(m_root_filename, m_config))) {
+        return {};
+    }
 
     MatchFinder finder;
-    MatchListBuilder<T> builder;
+    std::vector<match_t> matches;
+    MatchListBuilder<T> builder(matches);
 
     addMatchersForTerm(term, finder, &builder);
 
-    auto action_factory = newFrontendActionFactory(&finder);
-    auto action = action_factory->create();
+    run_frontend(new MatchAction(finder), m_root_filename, source, m_config,
+                 skip_function_bodies(term, source, m_config));
+    return matches;
+}
+
+std::vector<IndexedDecl>
+collect_declarations(const std::string& file, const po::variables_map& config,
+                     std::vector<std::string>* dependencies) {
+    FileStats stats(file);
+    auto buffer = load_source(file, config);
+
+    MatchFinder finder;
+    DeclarationCollector collector;
+
+    auto inMainFile = allOf(isExpansionInMainFile(), unless(isImplicit()));
+    auto funcDeclMatcher = functionDecl(inMainFile);
+
+    finder.addMatcher(varDecl(inMainFile).bind("varDecl"), &collector);
+    finder.addMatcher(funcDeclMatcher.bind("funcDecl"), &collector);
+    finder.addMatcher(
+        callExpr(hasDeclaration(funcDeclMatcher.bind("callee")))
+            .bind("funcCall"),
+        &collector);
+    finder.addMatcher(recordDecl(inMainFile).bind("typeDecl"), &collector);
 
-    runToolOnCodeWithArgs(action, buffer.str(),
-                          {"-w", "-std=c++14",
-                           "-I/usr/lib/clang/3.7.1/include"});
-    return builder.matches;
+    IntrusiveRefCntPtr<FileManager> files(
+        new FileManager(FileSystemOptions()));
+    run_frontend(new MatchAction(finder), file, buffer->getBuffer(), config,
+                 false, files.get());
+
+    if (dependencies) {
+        SmallVector<const FileEntry*, 64> entries;
+        files->GetUniqueIDMapping(entries);
+        for (auto entry : entries) {
+            boost::system::error_code error;
+            if (entry && !boost::filesystem::equivalent(entry->getName(), file,
+                                                        error)) {
+                dependencies->push_back(entry->getName());
+            }
+        }
+    }
+    return collector.decls;
+}
+
+namespace sas {
+
+struct Searcher::Matchers {
+    MatchFinder finder;
+    callback_list_t callbacks;
+    MatcherCaches caches;
+    /// The matches in the file being searched
+    std::vector<match_t> matches;
+    IntrusiveRefCntPtr<FileManager> files{
+        new FileManager(FileSystemOptions())};
+};
+
+Searcher::Searcher(const Term& term, const po::variables_map& config)
+    : m_queries{{{}, compile_term(term)}}, m_config{config},
+      m_matchers{new Matchers} {
+    const auto& compiled = m_queries.front().term;
+    MatcherOptions options;
+    options.caches = &m_matchers->caches;
+    auto& matches = m_matchers->matches;
+    auto make = [&matches](const auto& kind) {
+        using T = typename std::decay<decltype(kind)>::type;
+        return std::unique_ptr<MatchListBuilder<T>>(
+            new MatchListBuilder<T>(matches));
+    };
+    BatchMatcherVisitor<decltype(make)> visitor(
+        m_matchers->finder, m_matchers->callbacks, make, options);
+    boost::apply_visitor(visitor, compiled);
+}
+
+Searcher::~Searcher() = default;
+
+void Searcher::search(const std::string& file,
+                      const MatchCallback& on_match) {
+    for (const auto& match : search(file)) {
+        on_match(match);
+    }
+}
+
+std::vector<match_t> Searcher::search(const std::string& file) {
+    if (m_config.count("fast")) {
+        // There is nothing to set up
+        return find_batch_matches(file, m_queries, m_config).front();
+    }
+    if (!should_search_path(file, m_config)) {
+        return {};
+    }
+    FileStats stats(file);
+    auto buffer = load_source(file, m_config);
+    auto source = buffer->getBuffer();
+
+    if (rejected_by_prefilter(m_queries, source, m_config,
+                              has_forced_includes(file, m_config))) {
+        return {};
+    }
+
+    m_matchers->caches.clear();
+    m_matchers->matches.clear();
+    auto skip_bodies =
+        !m_config.count("full-parse") &&
+        !boost::apply_visitor(NeedsBodiesVisitor(source),
+                              m_queries.front().term);
+    run_frontend(new MatchAction(m_matchers->finder), file, source, m_config,
+                 skip_bodies, m_matchers->files.get());
+    return std::move(m_matchers->matches);
+}
 }
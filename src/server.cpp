@@ -0,0 +1,449 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <streambuf>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "clang/Basic/FileManager.h"
+#include "clang/Frontend/ASTUnit.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "compilation.hpp"
+#include "cost.hpp"
+#include "server.hpp"
+#include "stats.hpp"
+
+// Requests and responses are sent as frames. A request is a count followed
+// by that many strings (each a length and its bytes): the client's working
+// directory, then its arguments. The response is a sequence of frames of a
+// channel byte, a length and the data, ending with the exit status. All
+// integers are 32 bits in host order, as both ends are on the same machine.
+
+namespace {
+
+enum Channel : std::uint8_t { Stdout = 1, Stderr = 2, Status = 3 };
+
+std::string content_hash(llvm::StringRef source) {
+    llvm::MD5 hash;
+    hash.update(source);
+    llvm::MD5::MD5Result result;
+    hash.final(result);
+
+    llvm::SmallString<32> str;
+    llvm::MD5::stringifyResult(result, str);
+    return str.str().str();
+}
+
+bool write_all(int fd, const char* data, std::size_t size) {
+    while (size > 0) {
+        // A client that has gone away must not kill the server with SIGPIPE
+        auto written = send(fd, data, size, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool read_all(int fd, char* data, std::size_t size) {
+    while (size > 0) {
+        auto got = read(fd, data, size);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        data += got;
+        size -= got;
+    }
+    return true;
+}
+
+bool write_u32(int fd, std::uint32_t value) {
+    return write_all(fd, reinterpret_cast<const char*>(&value), sizeof value);
+}
+
+bool read_u32(int fd, std::uint32_t& value) {
+    return read_all(fd, reinterpret_cast<char*>(&value), sizeof value);
+}
+
+bool write_frame(int fd, Channel channel, const char* data,
+                 std::uint32_t size) {
+    auto tag = static_cast<char>(channel);
+    return write_all(fd, &tag, 1) && write_u32(fd, size) &&
+           write_all(fd, data, size);
+}
+
+bool read_string(int fd, std::string& str) {
+    std::uint32_t size;
+    if (!read_u32(fd, size)) {
+        return false;
+    }
+    str.resize(size);
+    return read_all(fd, &str[0], size);
+}
+
+/// Sends everything written to it to a client as frames of one channel.
+/// Once the client has gone, output is discarded.
+class FrameBuffer : public std::streambuf {
+public:
+    FrameBuffer(int fd, Channel channel) : m_fd{fd}, m_channel{channel} {
+        setp(m_buffer, m_buffer + sizeof m_buffer);
+    }
+
+    ~FrameBuffer() { sync(); }
+
+protected:
+    int_type overflow(int_type c) override {
+        if (sync() != 0) {
+            return traits_type::eof();
+        }
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override {
+        auto size = pptr() - pbase();
+        if (size > 0 && m_connected) {
+            m_connected = write_frame(m_fd, m_channel, pbase(), size);
+        }
+        setp(m_buffer, m_buffer + sizeof m_buffer);
+        return 0;
+    }
+
+private:
+    int m_fd;
+    Channel m_channel;
+    bool m_connected = true;
+    char m_buffer[64 * 1024];
+};
+
+void answer(int client, ASTCache& cache, const ServeRequest& handle) {
+    std::uint32_t count;
+    std::string cwd;
+    if (!read_u32(client, count) || count == 0 || !read_string(client, cwd)) {
+        return;
+    }
+    std::vector<std::string> args(count - 1);
+    for (auto& arg : args) {
+        if (!read_string(client, arg)) {
+            return;
+        }
+    }
+
+    std::int32_t status = 1;
+    {
+        FrameBuffer out_buffer(client, Stdout);
+        FrameBuffer err_buffer(client, Stderr);
+        std::ostream out(&out_buffer);
+        std::ostream err(&err_buffer);
+        try {
+            // Paths in the request are relative to the client
+            if (chdir(cwd.c_str()) != 0) {
+                throw std::runtime_error(cwd + ": " + std::strerror(errno));
+            }
+            status = handle(args, out, err, cache);
+        } catch (const std::exception& e) {
+            err << "sas: " << e.what() << std::endl;
+        }
+        out.flush();
+        err.flush();
+    }
+    write_frame(client, Status, reinterpret_cast<const char*>(&status),
+                sizeof status);
+}
+
+int connect_socket(const std::string& socket_path, bool listen_on) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof address.sun_path) {
+        std::cerr << "sas: " << socket_path << ": Socket path is too long"
+                  << std::endl;
+        return -1;
+    }
+    std::strcpy(address.sun_path, socket_path.c_str());
+
+    auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        std::cerr << "sas: " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+
+    auto addr = reinterpret_cast<const sockaddr*>(&address);
+    int result;
+    if (listen_on) {
+        // A socket left behind by a server that was killed
+        unlink(socket_path.c_str());
+        result = bind(fd, addr, sizeof address);
+        if (result == 0) {
+            result = listen(fd, SOMAXCONN);
+        }
+    } else {
+        result = connect(fd, addr, sizeof address);
+    }
+    if (result != 0) {
+        std::cerr << "sas: " << socket_path << ": " << std::strerror(errno)
+                  << std::endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+}
+
+std::shared_ptr<clang::ASTUnit>
+ASTCache::get(const std::string& file, const po::variables_map& config) {
+    char* resolved = realpath(file.c_str(), nullptr);
+    if (!resolved) {
+        throw std::runtime_error(std::strerror(errno));
+    }
+    std::string path(resolved);
+    std::free(resolved);
+
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        throw std::runtime_error(std::strerror(errno));
+    }
+
+    // Function bodies are always parsed, so the AST can answer any query
+    // whether or not '--full-parse' is given. What it contains depends on
+    // the flags ('--pch-cache' is refused by run()).
+    auto key = path;
+    for (const auto& arg : compile_command(path, config).arguments) {
+        key += '\0' + arg;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto iter = m_entries.find(key);
+        if (iter != m_entries.end() &&
+            iter->second.mtime_sec == info.st_mtim.tv_sec &&
+            iter->second.mtime_nsec == info.st_mtim.tv_nsec &&
+            iter->second.size == info.st_size &&
+            headers_unchanged(iter->second)) {
+            touch(iter->second);
+            return iter->second.unit;
+        }
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer> buffer;
+    {
+        StageTimer timer(Stage::Read);
+        auto loaded = llvm::MemoryBuffer::getFile(path);
+        if (!loaded) {
+            throw std::runtime_error(loaded.getError().message());
+        }
+        buffer = std::move(*loaded);
+    }
+    auto source = buffer->getBuffer();
+    auto hash = content_hash(source);
+
+    {
+        // Touched without being changed (e.g., by a checkout)
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto iter = m_entries.find(key);
+        if (iter != m_entries.end() && iter->second.hash == hash &&
+            headers_unchanged(iter->second)) {
+            iter->second.mtime_sec = info.st_mtim.tv_sec;
+            iter->second.mtime_nsec = info.st_mtim.tv_nsec;
+            iter->second.size = info.st_size;
+            touch(iter->second);
+            return iter->second.unit;
+        }
+    }
+
+    auto command = parse_command(path, source, config);
+    std::shared_ptr<clang::ASTUnit> unit;
+    {
+        StageTimer timer(Stage::Parse);
+        unit = clang::tooling::buildASTFromCodeWithArgs(
+            source, command.arguments, command.filename);
+    }
+    if (!unit) {
+        throw std::runtime_error("Unable to parse");
+    }
+
+    // Every file the parse read other than the file itself: its headers,
+    // and any PCH with those the PCH was built from
+    std::vector<Header> headers;
+    llvm::SmallVector<const clang::FileEntry*, 64> files;
+    unit->getFileManager().GetUniqueIDMapping(files);
+    for (auto entry : files) {
+        if (!entry || entry->getName() == command.filename) {
+            continue;
+        }
+        // The FileEntry only has the mtime in seconds, so the header is
+        // looked at again for the nanoseconds. If it changed since it was
+        // read, the entry is recorded as stale.
+        Header header{entry->getName(), -1, -1, -1};
+        struct stat header_info;
+        if (stat(header.name.c_str(), &header_info) == 0 &&
+            header_info.st_mtim.tv_sec == entry->getModificationTime() &&
+            header_info.st_size == entry->getSize()) {
+            header.mtime_sec = header_info.st_mtim.tv_sec;
+            header.mtime_nsec = header_info.st_mtim.tv_nsec;
+            header.size = header_info.st_size;
+        }
+        headers.push_back(std::move(header));
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto iter = m_entries.find(key);
+    if (iter == m_entries.end()) {
+        m_recent.push_front(key);
+        iter = m_entries.emplace(key, Entry{}).first;
+        iter->second.recent = m_recent.begin();
+    } else {
+        m_used -= iter->second.bytes;
+        touch(iter->second);
+    }
+    auto& entry = iter->second;
+    entry.unit = unit;
+    entry.mtime_sec = info.st_mtim.tv_sec;
+    entry.mtime_nsec = info.st_mtim.tv_nsec;
+    entry.size = info.st_size;
+    entry.hash = hash;
+    entry.headers = std::move(headers);
+    entry.bytes = ast_memory(unit->getASTContext());
+    m_used += entry.bytes;
+    evict();
+    return unit;
+}
+
+bool ASTCache::headers_unchanged(const Entry& entry) {
+    for (const auto& header : entry.headers) {
+        struct stat info;
+        if (stat(header.name.c_str(), &info) != 0 ||
+            info.st_mtim.tv_sec != header.mtime_sec ||
+            info.st_mtim.tv_nsec != header.mtime_nsec ||
+            info.st_size != header.size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void ASTCache::touch(Entry& entry) {
+    m_recent.splice(m_recent.begin(), m_recent, entry.recent);
+}
+
+void ASTCache::evict() {
+    // The file just used is kept, even if it alone exceeds the budget. An
+    // evicted AST is freed once no search is still using it.
+    while (m_used > m_budget && m_recent.size() > 1) {
+        auto iter = m_entries.find(m_recent.back());
+        m_used -= iter->second.bytes;
+        m_entries.erase(iter);
+        m_recent.pop_back();
+    }
+}
+
+std::string default_socket_path() {
+    if (auto runtime_dir = std::getenv("XDG_RUNTIME_DIR")) {
+        return std::string(runtime_dir) + "/sas.sock";
+    }
+    return "/tmp/sas-" + std::to_string(getuid()) + ".sock";
+}
+
+int serve(const std::string& socket_path, std::size_t cache_bytes,
+          const ServeRequest& handle) {
+    auto fd = connect_socket(socket_path, true);
+    if (fd < 0) {
+        return 1;
+    }
+    std::cerr << "sas: Serving on " << socket_path << std::endl;
+
+    ASTCache cache(cache_bytes);
+    for (;;) {
+        auto client = accept(fd, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            std::cerr << "sas: " << std::strerror(errno) << std::endl;
+            close(fd);
+            return 1;
+        }
+        // Requests run as the server's user, so only that user may send
+        // them, whatever the socket's permissions
+        ucred peer;
+        socklen_t size = sizeof peer;
+        if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &size) != 0 ||
+            peer.uid != getuid()) {
+            std::cerr << "sas: Refused a client of another user" << std::endl;
+            close(client);
+            continue;
+        }
+        answer(client, cache, handle);
+        close(client);
+    }
+}
+
+int run_client(const std::string& socket_path,
+               const std::vector<std::string>& args) {
+    auto fd = connect_socket(socket_path, false);
+    if (fd < 0) {
+        return 1;
+    }
+
+    char* cwd = getcwd(nullptr, 0);
+    if (!cwd) {
+        std::cerr << "sas: " << std::strerror(errno) << std::endl;
+        close(fd);
+        return 1;
+    }
+    std::vector<std::string> request{cwd};
+    std::free(cwd);
+    request.insert(request.end(), args.begin(), args.end());
+
+    bool sent = write_u32(fd, request.size());
+    for (const auto& str : request) {
+        sent = sent && write_u32(fd, str.size()) &&
+               write_all(fd, str.data(), str.size());
+    }
+
+    char channel;
+    std::uint32_t size;
+    std::string data;
+    while (sent && read_all(fd, &channel, 1) && read_u32(fd, size)) {
+        data.resize(size);
+        if (!read_all(fd, &data[0], size)) {
+            break;
+        }
+        if (channel == Stdout) {
+            std::cout.write(data.data(), size);
+        } else if (channel == Stderr) {
+            std::cerr.write(data.data(), size);
+        } else if (channel == Status && size == sizeof(std::int32_t)) {
+            std::int32_t status;
+            std::memcpy(&status, data.data(), sizeof status);
+            close(fd);
+            return status;
+        }
+    }
+
+    std::cerr << "sas: " << socket_path << ": Lost connection to the server"
+              << std::endl;
+    close(fd);
+    return 1;
+}
@@ -0,0 +1,274 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <sstream>
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+#include "shard.hpp"
+#include "stats.hpp"
+
+namespace {
+
+const char shard_magic[4] = {'S', 'A', 'S', 'S'};
+const std::uint32_t shard_version = 1;
+
+enum ShardRecord : std::uint8_t { FileRecord = 1, EndRecord = 2 };
+
+/// The size of the end record, which is the type followed by the magic
+const std::size_t end_record_size = 1 + sizeof(shard_magic);
+
+/// Reads a shard output, one file record at a time
+class ShardReader {
+public:
+    explicit ShardReader(const std::string& path)
+        : m_path{path}, m_in(path, std::ios::binary) {
+        if (!m_in) {
+            throw error("Unable to read shard output");
+        }
+        char magic[sizeof(shard_magic)];
+        read(magic, sizeof(magic));
+        if (std::memcmp(magic, shard_magic, sizeof(shard_magic)) != 0) {
+            throw error("Not a shard output");
+        }
+        if (read_uint32() != shard_version) {
+            throw error("Incompatible shard output version");
+        }
+        auto format = read_uint32();
+        shard.index = read_uint32();
+        shard.count = read_uint32();
+        search = read_string();
+        if (format > static_cast<std::uint32_t>(OutputFormat::Count) ||
+            shard.index >= shard.count) {
+            throw error("Corrupt shard output");
+        }
+        this->format = static_cast<OutputFormat>(format);
+
+        // Check that the shard finished before anything is merged, rather
+        // than failing part way through the output
+        auto records = m_in.tellg();
+        char end[end_record_size];
+        m_in.seekg(-static_cast<std::streamoff>(sizeof(end)), std::ios::end);
+        if (!m_in || m_in.tellg() < records || !m_in.read(end, sizeof(end)) ||
+            end[0] != EndRecord ||
+            std::memcmp(end + 1, shard_magic, sizeof(shard_magic)) != 0) {
+            throw error("Incomplete shard output (the shard's search did "
+                        "not finish)");
+        }
+        m_in.seekg(records);
+    }
+
+    const std::string& path() const { return m_path; }
+
+    /// Read the next file record, returning false at the end of the shard
+    bool next() {
+        std::uint8_t type;
+        read(&type, sizeof(type));
+        if (type == EndRecord) {
+            return false;
+        }
+        auto id = read_uint64();
+        if (type != FileRecord || (m_started && id <= file_id)) {
+            throw error("Corrupt shard output");
+        }
+        m_started = true;
+        file_id = id;
+        formatted = read_string();
+        return true;
+    }
+
+    OutputFormat format;
+    Shard shard;
+    std::string search;
+
+    /// The current file record
+    std::size_t file_id = 0;
+    std::string formatted;
+
+private:
+    std::runtime_error error(const std::string& what) const {
+        return std::runtime_error(m_path + ": " + what);
+    }
+
+    void read(void* data, std::size_t size) {
+        if (!m_in.read(static_cast<char*>(data), size)) {
+            throw error("Corrupt shard output");
+        }
+    }
+
+    std::uint32_t read_uint32() {
+        std::uint32_t value;
+        read(&value, sizeof(value));
+        return value;
+    }
+
+    std::uint64_t read_uint64() {
+        std::uint64_t value;
+        read(&value, sizeof(value));
+        return value;
+    }
+
+    std::string read_string() {
+        std::string str(read_uint64(), '\0');
+        read(&str[0], str.size());
+        return str;
+    }
+
+    std::string m_path;
+    std::ifstream m_in;
+    bool m_started = false;
+};
+}
+
+Shard parse_shard(const std::string& spec) {
+    std::istringstream in(spec);
+    std::size_t k = 0;
+    std::size_t n = 0;
+    char slash = 0;
+    if (!(in >> k >> slash >> n) || slash != '/' || in.peek() != EOF ||
+        k < 1 || k > n) {
+        throw std::invalid_argument("--shard takes K/N, with 1 <= K <= N");
+    }
+    return {k - 1, n};
+}
+
+std::vector<std::pair<std::size_t, std::string>>
+shard_files(std::vector<std::string> files, const Shard& shard) {
+    // (size, file ID) of each file, largest first and in ID order among
+    // files of the same size
+    std::vector<std::pair<std::uint64_t, std::size_t>> sizes;
+    sizes.reserve(files.size());
+    for (std::size_t id = 0; id < files.size(); ++id) {
+        struct stat info;
+        auto size = stat(files[id].c_str(), &info) == 0 ? info.st_size : 0;
+        sizes.emplace_back(size, id);
+    }
+    std::sort(sizes.begin(), sizes.end(), [](const auto& a, const auto& b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+
+    // (bytes dealt, shard), lightest first. Every file counts for at least
+    // a byte, so empty files are dealt out too.
+    using load_t = std::pair<std::uint64_t, std::size_t>;
+    std::priority_queue<load_t, std::vector<load_t>, std::greater<load_t>>
+        loads;
+    for (std::size_t i = 0; i < shard.count; ++i) {
+        loads.emplace(0, i);
+    }
+    std::vector<std::size_t> ids;
+    for (const auto& file : sizes) {
+        auto lightest = loads.top();
+        loads.pop();
+        if (lightest.second == shard.index) {
+            ids.push_back(file.second);
+        }
+        lightest.first += std::max<std::uint64_t>(file.first, 1);
+        loads.push(lightest);
+    }
+    std::sort(ids.begin(), ids.end());
+
+    std::vector<std::pair<std::size_t, std::string>> share;
+    share.reserve(ids.size());
+    for (auto id : ids) {
+        share.emplace_back(id, std::move(files[id]));
+    }
+    return share;
+}
+
+ShardWriter::ShardWriter(std::ostream& out, OutputFormat format,
+                         const Shard& shard, const std::string& search)
+    : m_out(out) {
+    m_out.write(shard_magic, sizeof(shard_magic));
+    write_uint32(shard_version);
+    write_uint32(static_cast<std::uint32_t>(format));
+    write_uint32(shard.index);
+    write_uint32(shard.count);
+    write_uint64(search.size());
+    m_out.write(search.data(), search.size());
+}
+
+void ShardWriter::write(std::size_t file_id, const std::string& formatted) {
+    if (formatted.empty()) {
+        return;
+    }
+    StageTimer timer(Stage::Output);
+    m_out.put(FileRecord);
+    write_uint64(file_id);
+    write_uint64(formatted.size());
+    m_out.write(formatted.data(), formatted.size());
+}
+
+void ShardWriter::finish() {
+    m_out.put(EndRecord);
+    m_out.write(shard_magic, sizeof(shard_magic));
+    m_out.flush();
+    if (!m_out) {
+        throw std::runtime_error("Unable to write shard output");
+    }
+}
+
+void ShardWriter::write_uint32(std::uint32_t value) {
+    m_out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void ShardWriter::write_uint64(std::uint64_t value) {
+    m_out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void merge_shards(const std::vector<std::string>& paths, std::ostream& out) {
+    if (paths.empty()) {
+        throw std::runtime_error("No shard outputs to merge");
+    }
+    std::vector<std::unique_ptr<ShardReader>> shards;
+    for (const auto& path : paths) {
+        shards.emplace_back(new ShardReader(path));
+    }
+
+    const auto& first = *shards.front();
+    std::vector<bool> seen(first.shard.count);
+    for (const auto& shard : shards) {
+        if (shard->shard.count != first.shard.count ||
+            shard->format != first.format || shard->search != first.search) {
+            throw std::runtime_error(shard->path() +
+                                     ": Not a shard of the same search as " +
+                                     first.path());
+        }
+        if (seen[shard->shard.index]) {
+            throw std::runtime_error(
+                shard->path() + ": Shard " +
+                std::to_string(shard->shard.index + 1) + "/" +
+                std::to_string(shard->shard.count) + " given twice");
+        }
+        seen[shard->shard.index] = true;
+    }
+    auto missing = std::find(seen.begin(), seen.end(), false);
+    if (missing != seen.end()) {
+        throw std::runtime_error(
+            "Missing shard " + std::to_string(missing - seen.begin() + 1) +
+            "/" + std::to_string(first.shard.count));
+    }
+
+    // Each shard's files are in ID order, so repeatedly taking the lowest
+    // ID among the shards' next files gives every file in ID order
+    using next_t = std::pair<std::size_t, std::size_t>;
+    std::priority_queue<next_t, std::vector<next_t>, std::greater<next_t>>
+        next;
+    for (std::size_t i = 0; i < shards.size(); ++i) {
+        if (shards[i]->next()) {
+            next.emplace(shards[i]->file_id, i);
+        }
+    }
+    OutputSink sink(out, first.format);
+    while (!next.empty()) {
+        auto i = next.top().second;
+        next.pop();
+        sink.write(shards[i]->formatted);
+        if (shards[i]->next()) {
+            next.emplace(shards[i]->file_id, i);
+        }
+    }
+}
@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "llvm/ADT/StringRef.h"
+
+#include "output.hpp"
+#include "stats.hpp"
+
+namespace stats_detail {
+
+std::atomic<bool> enabled{false};
+std::atomic<std::uint64_t> evaluated[counter_count];
+std::atomic<std::uint64_t> passed[counter_count];
+}
+
+namespace {
+
+using stats_clock = std::chrono::steady_clock;
+
+const std::size_t stage_count = static_cast<std::size_t>(Stage::Output) + 1;
+
+const char* const stage_names[stage_count] = {"read", "prefilter", "parse",
+                                              "match", "output"};
+
+const char* const counter_names[stats_detail::counter_count] = {
+    "matchesUnqualifiedName", "matchesType",      "parameterMatches",
+    "matchesParameters",      "matchesNamespace", "matchesClass",
+    "matchesQualifiers",      "regex"};
+
+struct FileRecord {
+    std::string file;
+    double total;
+    double seconds[stage_count];
+};
+
+/// A complete ("X") trace event
+struct TraceEvent {
+    std::string name;
+    const char* category;
+    std::size_t thread;
+    double start_us;
+    double duration_us;
+};
+
+std::mutex stats_mutex;
+std::string trace_file;
+stats_clock::time_point epoch;
+std::vector<FileRecord> files;
+/// The index in 'files' of each file's record
+std::map<std::string, std::size_t> file_records;
+double stage_totals[stage_count] = {};
+std::vector<TraceEvent> events;
+
+std::atomic<std::size_t> next_thread{0};
+thread_local std::size_t thread_number = next_thread++;
+thread_local FileStats* current_file = nullptr;
+thread_local StageTimer* current_stage = nullptr;
+
+double seconds_since(stats_clock::time_point start) {
+    return std::chrono::duration<double>(stats_clock::now() - start).count();
+}
+
+void add_event(std::string name, const char* category,
+               stats_clock::time_point start, double seconds) {
+    if (trace_file.empty()) {
+        return;
+    }
+    auto start_us =
+        std::chrono::duration<double, std::micro>(start - epoch).count();
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    events.push_back(
+        {std::move(name), category, thread_number, start_us, seconds * 1e6});
+}
+
+void print_seconds(std::ostream& out, double seconds) {
+    out << std::fixed << std::setprecision(3) << seconds * 1000 << "ms";
+}
+}
+
+void enable_stats(const std::string& trace) {
+    trace_file = trace;
+    epoch = stats_clock::now();
+    stats_detail::enabled = true;
+}
+
+void reset_stats() {
+    stats_detail::enabled = false;
+    for (std::size_t i = 0; i < stats_detail::counter_count; ++i) {
+        stats_detail::evaluated[i] = 0;
+        stats_detail::passed[i] = 0;
+    }
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    trace_file.clear();
+    files.clear();
+    file_records.clear();
+    std::fill(std::begin(stage_totals), std::end(stage_totals), 0.0);
+    events.clear();
+}
+
+FileStats::FileStats(const std::string& file)
+    : m_file{file}, m_start{stats_clock::now()}, m_parent{current_file} {
+    if (stats_enabled()) {
+        current_file = this;
+    }
+}
+
+FileStats::~FileStats() {
+    if (!stats_enabled()) {
+        return;
+    }
+    current_file = m_parent;
+
+    auto total = seconds_since(m_start);
+    add_event(m_file, "file", m_start, total);
+
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    auto found = file_records.emplace(m_file, files.size());
+    if (found.second) {
+        files.push_back({m_file, 0, {}});
+    }
+    auto& record = files[found.first->second];
+    record.total += total;
+    for (std::size_t i = 0; i < stage_count; ++i) {
+        record.seconds[i] += m_seconds[i];
+    }
+}
+
+StageTimer::StageTimer(Stage stage)
+    : m_stage{stage}, m_enabled{stats_enabled()} {
+    if (m_enabled) {
+        m_start = stats_clock::now();
+        m_parent = current_stage;
+        current_stage = this;
+    }
+}
+
+StageTimer::~StageTimer() {
+    if (!m_enabled) {
+        return;
+    }
+    current_stage = m_parent;
+
+    auto elapsed = seconds_since(m_start);
+    if (m_parent) {
+        m_parent->m_nested += elapsed;
+    }
+    auto index = static_cast<std::size_t>(m_stage);
+    auto exclusive = elapsed - m_nested;
+    if (current_file) {
+        current_file->m_seconds[index] += exclusive;
+    }
+    add_event(stage_names[index], "stage", m_start, elapsed);
+
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    stage_totals[index] += exclusive;
+}
+
+std::size_t peak_rss() {
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    // Linux reports the maximum resident set size in kilobytes
+    return static_cast<std::size_t>(usage.ru_maxrss) * 1024;
+}
+
+void print_stats(std::ostream& out) {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    auto flags = out.flags();
+
+    std::vector<const FileRecord*> slowest;
+    for (const auto& record : files) {
+        slowest.push_back(&record);
+    }
+    std::stable_sort(slowest.begin(), slowest.end(),
+                     [](const FileRecord* a, const FileRecord* b) {
+                         return a->total > b->total;
+                     });
+
+    out << "sas: per-file timings (slowest first)\n";
+    for (const auto* record : slowest) {
+        out << "  " << record->file << ": ";
+        print_seconds(out, record->total);
+        for (std::size_t i = 0; i < stage_count; ++i) {
+            out << ' ' << stage_names[i] << '=';
+            print_seconds(out, record->seconds[i]);
+        }
+        out << '\n';
+    }
+
+    out << "sas: totals over " << files.size() << " files\n";
+    for (std::size_t i = 0; i < stage_count; ++i) {
+        out << "  " << stage_names[i] << ": ";
+        print_seconds(out, stage_totals[i]);
+        out << '\n';
+    }
+
+    out << "sas: evaluations (passed)\n";
+    for (std::size_t i = 0; i < stats_detail::counter_count; ++i) {
+        out << "  " << counter_names[i] << ": "
+            << stats_detail::evaluated[i].load() << " ("
+            << stats_detail::passed[i].load() << ")\n";
+    }
+
+    out << "sas: peak RSS: " << peak_rss() / (1024 * 1024) << "MB\n";
+
+    out.flush();
+    out.flags(flags);
+}
+
+void write_trace() {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    if (trace_file.empty()) {
+        return;
+    }
+    std::ofstream out(trace_file);
+    if (!out) {
+        throw std::runtime_error(trace_file + ": Unable to write trace");
+    }
+
+    out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+    for (std::size_t i = 0; i < events.size(); ++i) {
+        const auto& event = events[i];
+        out << "{\"name\":" << json_string(event.name) << ",\"cat\":\""
+            << event.category << "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+            << event.thread << ",\"ts\":" << event.start_us
+            << ",\"dur\":" << event.duration_us << "}"
+            << (i + 1 < events.size() ? ",\n" : "\n");
+    }
+    out << "],\"displayTimeUnit\":\"ms\"}\n";
+}
@@ -0,0 +1,276 @@
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "ignore.hpp"
+#include "scheduler.hpp"
+#include "search.hpp"
+#include "walker.hpp"
+
+namespace {
+
+bool is_vcs_directory(const char* name) {
+    return std::strcmp(name, ".git") == 0 || std::strcmp(name, ".hg") == 0 ||
+           std::strcmp(name, ".svn") == 0;
+}
+
+std::string join(const std::string& dir, const char* name) {
+    if (!dir.empty() && dir.back() == '/') {
+        return dir + name;
+    }
+    return dir + '/' + name;
+}
+
+class Walker {
+public:
+    Walker(const po::variables_map& config,
+           const std::function<void(const std::string&)>& visit,
+           const std::function<void(const std::string&)>& visit_directory)
+        : m_config(config), m_visit(visit), m_visit_directory(visit_directory),
+          m_use_ignore_files{!config.count("no-ignore")},
+          m_hidden{config.count("hidden") > 0} {
+        auto jobs = search_jobs(config);
+        if (jobs > 1) {
+            m_pool.reset(new WorkStealingPool(jobs));
+        }
+    }
+
+    void walk(const std::string& dir) {
+        if (!m_pool) {
+            scan(dir, nullptr, nullptr);
+            return;
+        }
+        m_paths.emplace_back();
+        m_paths.back().directory.reset(new Directory);
+        schedule(dir, nullptr, m_paths.back().directory.get());
+    }
+
+    /// Visit a file named directly, in its place among the walked paths
+    void visit(const std::string& file) {
+        if (!m_pool) {
+            m_visit(file);
+            return;
+        }
+        m_paths.emplace_back();
+        m_paths.back().file = file;
+    }
+
+    /// With a pool, visit the files found in the order of a serial walk,
+    /// each as soon as every directory before it has been read, and return
+    /// once all have been visited
+    void wait() {
+        if (!m_pool) {
+            return;
+        }
+        visit_in_order(m_paths);
+        m_paths.clear();
+        m_pool->wait();
+    }
+
+private:
+    using ignores_t = std::shared_ptr<const IgnoreList>;
+
+    struct Directory;
+
+    /// A file, or a directory whose entries are visited in its place
+    struct Item {
+        std::string file;
+        std::unique_ptr<Directory> directory;
+    };
+
+    /// A directory being read by the pool. Its items are only filled in,
+    /// in name order, once all have been read.
+    struct Directory {
+        bool read = false;
+        std::vector<Item> items;
+    };
+
+    void visit_in_order(std::vector<Item>& items) {
+        for (auto& item : items) {
+            if (!item.directory) {
+                m_visit(item.file);
+                continue;
+            }
+            auto directory = item.directory.get();
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [directory] { return directory->read; });
+            }
+            visit_in_order(directory->items);
+            item.directory.reset();
+        }
+    }
+
+    void schedule(const std::string& dir, ignores_t ignores,
+                  Directory* directory) {
+        if (!m_pool) {
+            scan(dir, ignores, nullptr);
+            return;
+        }
+        m_pool->submit([this, dir, ignores, directory] {
+            scan(dir, ignores, directory);
+        });
+    }
+
+    struct Entry {
+        std::string name;
+        unsigned char type;
+    };
+
+    /// Read a directory. With a pool, its files and subdirectories are
+    /// added to 'directory' rather than visited.
+    void scan(const std::string& dir, ignores_t ignores,
+              Directory* directory) {
+        std::vector<Item> items;
+        auto handle = opendir(dir.c_str());
+        if (!handle) {
+            report(dir, std::strerror(errno));
+            finish(directory, items);
+            return;
+        }
+        if (m_visit_directory) {
+            m_visit_directory(dir);
+        }
+
+        // Read the whole directory first, so its ignore files apply to every
+        // entry
+        std::vector<Entry> entries;
+        bool has_gitignore = false;
+        bool has_sasignore = false;
+        while (auto entry = readdir(handle)) {
+            const char* name = entry->d_name;
+            if (std::strcmp(name, ".") == 0 || std::strcmp(name, "..") == 0 ||
+                is_vcs_directory(name)) {
+                continue;
+            }
+            has_gitignore |= std::strcmp(name, ".gitignore") == 0;
+            has_sasignore |= std::strcmp(name, ".sasignore") == 0;
+            if (name[0] == '.' && !m_hidden) {
+                continue;
+            }
+            entries.push_back({name, entry->d_type});
+        }
+        closedir(handle);
+        std::sort(entries.begin(), entries.end(),
+                  [](const Entry& a, const Entry& b) {
+                      return a.name < b.name;
+                  });
+
+        if (m_use_ignore_files && (has_gitignore || has_sasignore)) {
+            auto list = std::make_shared<IgnoreList>();
+            list->base = dir.back() == '/' ? dir.substr(0, dir.size() - 1)
+                                           : dir;
+            if (has_gitignore) {
+                read_ignore_file(join(dir, ".gitignore"), list->rules);
+            }
+            if (has_sasignore) {
+                read_ignore_file(join(dir, ".sasignore"), list->rules);
+            }
+            list->parent = ignores;
+            ignores = list;
+        }
+
+        for (const auto& entry : entries) {
+            auto file = join(dir, entry.name.c_str());
+            auto type = entry.type;
+            if (type == DT_UNKNOWN || type == DT_LNK) {
+                // Symbolic links are followed to files, but not to
+                // directories, which could form a cycle
+                struct stat info;
+                if (stat(file.c_str(), &info) != 0) {
+                    continue;
+                }
+                if (S_ISREG(info.st_mode)) {
+                    type = DT_REG;
+                } else if (S_ISDIR(info.st_mode) && entry.type == DT_UNKNOWN) {
+                    type = DT_DIR;
+                } else {
+                    continue;
+                }
+            }
+
+            if (type == DT_DIR) {
+                if (is_ignored(ignores.get(), file, entry.name, true)) {
+                    continue;
+                }
+                Directory* subdirectory = nullptr;
+                if (directory) {
+                    items.emplace_back();
+                    items.back().directory.reset(new Directory);
+                    subdirectory = items.back().directory.get();
+                }
+                schedule(file, ignores, subdirectory);
+            } else if (type == DT_REG) {
+                if (!should_search_path(entry.name, m_config) ||
+                    is_ignored(ignores.get(), file, entry.name, false)) {
+                    continue;
+                }
+                if (directory) {
+                    items.emplace_back();
+                    items.back().file = file;
+                } else {
+                    m_visit(file);
+                }
+            }
+        }
+        finish(directory, items);
+    }
+
+    /// Hand a directory's items to the thread visiting them
+    void finish(Directory* directory, std::vector<Item>& items) {
+        if (!directory) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        directory->items = std::move(items);
+        directory->read = true;
+        m_cv.notify_all();
+    }
+
+    void report(const std::string& path, const char* error) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::cerr << "sas: " << path << ": " << error << std::endl;
+    }
+
+    const po::variables_map& m_config;
+    const std::function<void(const std::string&)>& m_visit;
+    const std::function<void(const std::string&)>& m_visit_directory;
+    bool m_use_ignore_files;
+    bool m_hidden;
+
+    std::unique_ptr<WorkStealingPool> m_pool;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    /// With a pool, the paths walked or visited so far
+    std::vector<Item> m_paths;
+};
+}
+
+void walk_paths(const std::vector<std::string>& paths, bool recursive,
+                const po::variables_map& config,
+                const std::function<void(const std::string&)>& visit,
+                const std::function<void(const std::string&)>&
+                    visit_directory) {
+    Walker walker(config, visit, visit_directory);
+    for (const auto& path : paths) {
+        struct stat info;
+        if (stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+            if (!recursive) {
+                std::cerr << "sas: " << path << ": Is a directory"
+                          << std::endl;
+                continue;
+            }
+            walker.walk(path);
+        } else {
+            walker.visit(path);
+        }
+    }
+    walker.wait();
+}
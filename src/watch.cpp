@@ -0,0 +1,345 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "output.hpp"
+#include "scheduler.hpp"
+#include "walker.hpp"
+#include "watch.hpp"
+
+namespace {
+
+// Editors save either by writing the file in place or by renaming a new
+// file over it, so both are watched for
+const std::uint32_t watched_events = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                                     IN_MOVED_FROM | IN_MOVED_TO;
+
+/// How long to wait for the rest of a burst of events (e.g., a save, or a
+/// checkout) before searching, so it leads to a single update
+const int settle_ms = 50;
+
+/// What walk_paths() puts before the name of a file in 'dir'
+std::string prefix_of(const std::string& dir) {
+    if (dir.empty() || dir.back() == '/') {
+        return dir;
+    }
+    return dir + '/';
+}
+
+/// The directory to watch for a file named directly
+std::string parent_of(const std::string& file) {
+    auto slash = file.rfind('/');
+    if (slash == std::string::npos) {
+        return {};
+    }
+    return file.substr(0, slash + 1);
+}
+
+bool is_regular_file(const std::string& path) {
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode);
+}
+
+struct Changes {
+    std::set<std::string> modified;
+    std::set<std::string> removed;
+    /// The set of files may have changed
+    bool rescan = false;
+    /// Events were lost, so every file must be searched again
+    bool everything = false;
+};
+
+class Watcher {
+public:
+    Watcher(const std::vector<std::string>& paths, bool recursive,
+            const po::variables_map& config,
+            const ParallelSearch::SearchFile& search, std::ostream& out,
+            std::ostream& err)
+        : m_paths(paths), m_recursive{recursive}, m_config(config),
+          m_search(search), m_format{output_format(config)}, m_out(out),
+          m_err(err) {}
+
+    ~Watcher() {
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+    }
+
+    int run() {
+        m_fd = inotify_init1(IN_CLOEXEC);
+        if (m_fd < 0) {
+            m_err << "sas: " << std::strerror(errno) << std::endl;
+            return 1;
+        }
+
+        search(rescan());
+        print();
+
+        for (;;) {
+            Changes changes;
+            if (!read_events(changes)) {
+                m_err << "sas: " << std::strerror(errno) << std::endl;
+                return 1;
+            }
+            update(changes);
+        }
+    }
+
+private:
+    struct Result {
+        std::size_t id;
+        std::string formatted;
+    };
+
+    void add_watch(const std::string& dir) {
+        auto wd = inotify_add_watch(m_fd, dir.empty() ? "." : dir.c_str(),
+                                    watched_events);
+        if (wd < 0) {
+            m_err << "sas: " << dir << ": " << std::strerror(errno)
+                  << std::endl;
+            return;
+        }
+        m_watches[wd] = prefix_of(dir);
+    }
+
+    /// Walk the paths again, watching every directory entered. Files that
+    /// have gone are forgotten, and those not seen before are returned.
+    std::vector<std::string> rescan() {
+        std::set<std::string> files;
+        std::vector<std::string> dirs;
+        std::mutex mutex;
+        for (const auto& path : m_paths) {
+            struct stat info;
+            if (stat(path.c_str(), &info) != 0 || !S_ISDIR(info.st_mode)) {
+                dirs.push_back(parent_of(path));
+            }
+        }
+        walk_paths(m_paths, m_recursive, m_config,
+                   [&](const std::string& file) {
+                       if (should_search_path(file, m_config) &&
+                           is_regular_file(file)) {
+                           std::lock_guard<std::mutex> lock(mutex);
+                           files.insert(file);
+                       }
+                   },
+                   [&](const std::string& dir) {
+                       std::lock_guard<std::mutex> lock(mutex);
+                       dirs.push_back(dir);
+                   });
+
+        for (const auto& dir : dirs) {
+            add_watch(dir);
+        }
+        for (auto iter = m_results.begin(); iter != m_results.end();) {
+            if (files.count(iter->first)) {
+                ++iter;
+            } else {
+                iter = m_results.erase(iter);
+            }
+        }
+
+        std::vector<std::string> added;
+        for (const auto& file : files) {
+            if (!m_results.count(file)) {
+                added.push_back(file);
+            }
+        }
+        return added;
+    }
+
+    /// Wait for a burst of events, and work out what they changed
+    bool read_events(Changes& changes) {
+        alignas(inotify_event) char buffer[64 * 1024];
+        int timeout = -1;
+        for (;;) {
+            pollfd request{m_fd, POLLIN, 0};
+            auto ready = poll(&request, 1, timeout);
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ready <= 0) {
+                return ready == 0;
+            }
+
+            auto size = read(m_fd, buffer, sizeof buffer);
+            if (size < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            for (auto next = buffer; next < buffer + size;) {
+                const auto* event = reinterpret_cast<inotify_event*>(next);
+                handle_event(*event, changes);
+                next += sizeof(inotify_event) + event->len;
+            }
+            timeout = settle_ms;
+        }
+    }
+
+    void handle_event(const inotify_event& event, Changes& changes) {
+        if (event.mask & IN_Q_OVERFLOW) {
+            changes.rescan = true;
+            changes.everything = true;
+            return;
+        }
+        auto watch = m_watches.find(event.wd);
+        if (watch == m_watches.end()) {
+            return;
+        }
+        if (event.mask & IN_IGNORED) {
+            // The directory is gone
+            m_watches.erase(watch);
+            return;
+        }
+        if (event.len == 0) {
+            return;
+        }
+
+        std::string name(event.name);
+        auto path = watch->second + name;
+        if (event.mask & IN_ISDIR) {
+            changes.rescan = true;
+        } else if (m_results.count(path)) {
+            if (event.mask & (IN_DELETE | IN_MOVED_FROM)) {
+                changes.modified.erase(path);
+                changes.removed.insert(path);
+            } else {
+                changes.removed.erase(path);
+                changes.modified.insert(path);
+            }
+        } else if (name == ".gitignore" || name == ".sasignore" ||
+                   should_search_path(name, m_config)) {
+            // Editors' temporary files and the like are not searched, so
+            // they do not lead to a walk
+            changes.rescan = true;
+        }
+    }
+
+    void update(const Changes& changes) {
+        for (const auto& path : changes.removed) {
+            m_results.erase(path);
+        }
+
+        std::vector<std::string> files;
+        if (changes.rescan) {
+            files = rescan();
+        }
+        if (changes.everything) {
+            for (const auto& result : m_results) {
+                files.push_back(result.first);
+            }
+        } else {
+            for (const auto& path : changes.modified) {
+                if (m_results.count(path)) {
+                    files.push_back(path);
+                }
+            }
+        }
+
+        if (files.empty() && changes.removed.empty() && !changes.rescan) {
+            return;
+        }
+        search(files);
+        print();
+    }
+
+    /// Search 'files', keeping the IDs of those already known
+    void search(const std::vector<std::string>& files) {
+        std::vector<std::size_t> ids(files.size());
+        for (std::size_t i = 0; i < files.size(); ++i) {
+            auto iter = m_results.find(files[i]);
+            if (iter == m_results.end()) {
+                iter = m_results.emplace(files[i], Result{m_next_id++, {}})
+                           .first;
+            }
+            ids[i] = iter->second.id;
+        }
+
+        std::vector<std::string> formatted(files.size());
+        std::mutex error_mutex;
+        auto search_one = [&](std::size_t i) {
+            try {
+                formatted[i] = m_search(files[i], ids[i]);
+            } catch (const std::exception& e) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                m_err << "sas: " << files[i] << ": " << e.what() << std::endl;
+            }
+        };
+
+        auto jobs = search_jobs(m_config);
+        if (jobs > 1 && files.size() > 1) {
+            WorkStealingPool pool(std::min(jobs, files.size()));
+            for (std::size_t i = 0; i < files.size(); ++i) {
+                pool.submit([&, i] { search_one(i); });
+            }
+            pool.wait();
+        } else {
+            for (std::size_t i = 0; i < files.size(); ++i) {
+                search_one(i);
+            }
+        }
+
+        for (std::size_t i = 0; i < files.size(); ++i) {
+            m_results[files[i]].formatted = std::move(formatted[i]);
+        }
+        m_searched = files.size();
+    }
+
+    /// Print every file's results, in the order the files were first found
+    void print() {
+        std::vector<const std::pair<const std::string, Result>*> results;
+        for (const auto& result : m_results) {
+            results.push_back(&result);
+        }
+        std::sort(results.begin(), results.end(),
+                  [](const std::pair<const std::string, Result>* a,
+                     const std::pair<const std::string, Result>* b) {
+                      return a->second.id < b->second.id;
+                  });
+
+        {
+            OutputSink sink(m_out, m_format);
+            for (const auto* result : results) {
+                sink.write(result->second.formatted, result->first);
+            }
+        }
+        m_out.flush();
+        m_err << "sas: Searched " << m_searched << " of " << m_results.size()
+              << " files, watching for changes" << std::endl;
+    }
+
+    const std::vector<std::string>& m_paths;
+    bool m_recursive;
+    const po::variables_map& m_config;
+    const ParallelSearch::SearchFile& m_search;
+    OutputFormat m_format;
+    std::ostream& m_out;
+    std::ostream& m_err;
+
+    int m_fd = -1;
+    /// The prefix of the paths in each watched directory
+    std::unordered_map<int, std::string> m_watches;
+    std::unordered_map<std::string, Result> m_results;
+    std::size_t m_next_id = 0;
+    std::size_t m_searched = 0;
+};
+}
+
+int watch_paths(const std::vector<std::string>& paths, bool recursive,
+                const po::variables_map& config,
+                const ParallelSearch::SearchFile& search, std::ostream& out,
+                std::ostream& err) {
+    Watcher watcher(paths, recursive, config, search, out, err);
+    return watcher.run();
+}
@@ -0,0 +1,27 @@
+/// Test parameter list matching
+
+void one(int a) {}
+
+void two(int a, int b) {}
+
+void mixed(int a, double b, int c) {}
+
+void none() {}
+
+// .*:.*(..., int:.*)
+// 3 5 7
+//
+// .*:.*(..., double:.*, ...)
+// 7
+//
+// .*:.*(int:a, ...)
+// 3 5 7
+//
+// .*:.*(...)
+// 3 5 7 9
+//
+// .*:.*()
+// 9
+//
+// .*:.*(int:.*, int:.*)
+// 5
@@ -0,0 +1,32 @@
+/// Test qualified variable matching
+
+namespace outer {
+int x;
+
+namespace inner {
+int y;
+}
+
+void f() {
+    int x;
+    static int z;
+}
+}
+
+struct S {
+    static int x;
+};
+
+int S::x;
+
+// outer::int:x
+// 4
+//
+// outer::inner::.*:.*
+// 7
+//
+// #S::.*:x
+// 17 20
+//
+// .*:x
+// 4 11 17 20
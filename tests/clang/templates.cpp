@@ -0,0 +1,16 @@
+/// Test members of a class template first used in a function body, which
+/// are only instantiated if the body is parsed
+
+template <class T>
+struct Counter {
+    static int count;
+};
+
+void bump() { Counter<int>::count = 1; }
+
+/// The member is matched in the template and in its instantiation
+// #Counter::int:count
+// 6 6
+//
+// .*:count
+// 6 6
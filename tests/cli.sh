@@ -0,0 +1,216 @@
+#!/bin/sh
+# End-to-end checks of the sas command line on tests/cases, comparing the
+# output of options that should agree. Run from the top of the repository
+# after 'make all' (or set SAS to the binary to test).
+
+set -eu
+
+SAS=${SAS:-bin/sas}
+CASES=tests/cases
+QUERY='.*:.*'
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+failures=0
+
+fail() {
+    echo "  FAILED: $1"
+    failures=$((failures + 1))
+}
+
+# Check that two outputs are identical
+same() {
+    if ! cmp -s "$2" "$3"; then
+        fail "$1"
+        diff "$2" "$3" | head -20
+    fi
+}
+
+echo "Testing: -j"
+for format in text json; do
+    "$SAS" --format $format -r "$QUERY" $CASES >"$tmp/serial"
+    for jobs in 2 4 8; do
+        "$SAS" --format $format -j $jobs -r "$QUERY" $CASES >"$tmp/parallel"
+        same "-j $jobs --format $format" "$tmp/serial" "$tmp/parallel"
+    done
+done
+
+tab=$(printf '\t')
+
+# The queries of a case file (see tests/tests.cpp), each listed once
+queries() {
+    awk 'length($0) >= 4 && substr($0, 1, 3) == "// " {
+        print substr($0, 4)
+        getline
+    }' "$1" | awk '!seen[$0]++'
+}
+
+# Prefix each line of a file by a query and a tab, as a batch search does
+tag() {
+    TAG="$1$tab" awk '{ print ENVIRON["TAG"] $0 }' "$2"
+}
+
+# The lines of a batch search's output prefixed by a query
+tagged() {
+    TAG="$1$tab" awk 'index($0, ENVIRON["TAG"]) == 1' "$2"
+}
+
+echo "Testing: -q and -f"
+for file in $CASES/*; do
+    queries "$file" >"$tmp/queries"
+    set --
+    : >"$tmp/expected"
+    while IFS= read -r query; do
+        set -- "$@" -q "$query"
+        "$SAS" "$query" "$file" >"$tmp/single"
+        tag "$query" "$tmp/single" >>"$tmp/expected"
+    done <"$tmp/queries"
+
+    # A batch finds the matches of every single search, each prefixed by
+    # its query and in the same order as that search
+    "$SAS" "$@" "$file" >"$tmp/batch"
+    sort "$tmp/expected" >"$tmp/expected.sorted"
+    sort "$tmp/batch" >"$tmp/batch.sorted"
+    same "-q on $file" "$tmp/expected.sorted" "$tmp/batch.sorted"
+    while IFS= read -r query; do
+        tagged "$query" "$tmp/expected" >"$tmp/single"
+        tagged "$query" "$tmp/batch" >"$tmp/tagged"
+        same "-q '$query' on $file" "$tmp/single" "$tmp/tagged"
+    done <"$tmp/queries"
+
+    "$SAS" -f "$tmp/queries" "$file" >"$tmp/from_file"
+    same "-f on $file" "$tmp/batch" "$tmp/from_file"
+done
+
+# Two files sharing a header, and a header that no file includes
+inc="$tmp/inc"
+mkdir "$inc"
+printf 'int shared_a;\nint shared_b;\n' >"$inc/shared.hpp"
+printf '#include "shared.hpp"\nint a_one;\nint a_two;\n' >"$inc/a.cpp"
+printf '#include "shared.hpp"\nint b_one;\n' >"$inc/b.cpp"
+printf 'int lone;\n' >"$inc/lone.hpp"
+
+# Check the output of a search of the files above
+expect() {
+    name="$1"
+    shift
+    "$SAS" "$@" -r 'int:.*' "$inc" >"$tmp/actual"
+    same "$name" "$tmp/expected" "$tmp/actual"
+}
+
+echo "Testing: -l, -c and -m"
+printf '%s\n' "$inc/a.cpp" "$inc/b.cpp" "$inc/lone.hpp" "$inc/shared.hpp" \
+    >"$tmp/expected"
+expect "-l" -l
+# A header is listed after the first file that includes it, once
+printf '%s\n' "$inc/a.cpp" "$inc/shared.hpp" "$inc/b.cpp" "$inc/lone.hpp" \
+    >"$tmp/expected"
+expect "-l --follow-includes" -l --follow-includes
+printf '%s\n' "$inc/a.cpp:2" "$inc/b.cpp:1" "$inc/lone.hpp:1" \
+    "$inc/shared.hpp:2" >"$tmp/expected"
+expect "-c" -c
+printf '%s\n' "$inc/a.cpp:2" "$inc/shared.hpp:2" "$inc/b.cpp:1" \
+    "$inc/lone.hpp:1" >"$tmp/expected"
+expect "-c --follow-includes" -c --follow-includes
+printf '%s\n' "$inc/a.cpp:2" "$inc/b.cpp:1" "$inc/lone.hpp:1" \
+    "$inc/shared.hpp:1" >"$tmp/expected"
+expect "-c -m 5" -c -m 5
+# The header's matches through b.cpp were already reported, so they leave
+# the limit to b.cpp's own
+printf '%s\n' "$inc/a.cpp:2" "$inc/shared.hpp:2" "$inc/b.cpp:1" \
+    >"$tmp/expected"
+expect "-c -m 5 --follow-includes" -c -m 5 --follow-includes
+
+echo "Testing: --follow-includes"
+# Each header location is reported once, after the first file that
+# includes it, and a header that a file included is not searched on its
+# own. With -j, the parses race to report a header first, and headers
+# are searched in a second pass, so only the lines are compared.
+printf '%s\n' '2:1:int a_one;' '3:1:int a_two;' '1:1:int shared_a;' \
+    '2:1:int shared_b;' '2:1:int b_one;' '1:1:int lone;' >"$tmp/expected"
+expect "--follow-includes" --follow-includes
+sort "$tmp/expected" >"$tmp/expected.sorted"
+printf '%s\n' "$inc/a.cpp" "$inc/b.cpp" "$inc/lone.hpp" "$inc/shared.hpp" |
+    sort >"$tmp/listed.sorted"
+for jobs in 2 4; do
+    "$SAS" --follow-includes -j $jobs -r 'int:.*' "$inc" >"$tmp/actual"
+    sort "$tmp/actual" >"$tmp/actual.sorted"
+    same "--follow-includes -j $jobs" "$tmp/expected.sorted" \
+        "$tmp/actual.sorted"
+    "$SAS" --follow-includes -l -j $jobs -r 'int:.*' "$inc" >"$tmp/actual"
+    sort "$tmp/actual" >"$tmp/actual.sorted"
+    same "-l --follow-includes -j $jobs" "$tmp/listed.sorted" \
+        "$tmp/actual.sorted"
+done
+
+echo "Testing: --since and --rev"
+# A repository whose header changed after the first commit, with an
+# untracked file in its working tree
+repo="$tmp/repo"
+mkdir "$repo"
+case $SAS in
+*/*) sas=$(cd "$(dirname "$SAS")" && pwd)/$(basename "$SAS") ;;
+*) sas=$SAS ;;
+esac
+in_repo() {
+    (cd "$repo" && "$@")
+}
+commit() {
+    in_repo git add -A
+    in_repo git -c user.name=sas -c user.email=sas@example.com \
+        commit -q -m "$1"
+}
+in_repo git init -q
+printf '#include "shared.hpp"\nint main_value;\n' >"$repo/main.cpp"
+printf 'int old_value;\n' >"$repo/old.cpp"
+printf 'int shared_value;\n' >"$repo/shared.hpp"
+commit first
+first=$(in_repo git rev-parse HEAD)
+printf 'int changed_value;\nint more_value;\n' >"$repo/shared.hpp"
+commit second
+printf 'int new_value;\n' >"$repo/new.cpp"
+printf 'int tree_value;\n' >"$repo/shared.hpp"
+
+printf '%s\n' ./new.cpp ./shared.hpp >"$tmp/expected"
+in_repo "$sas" --since "$first" -l -r 'int:.*' . >"$tmp/actual"
+same "--since" "$tmp/expected" "$tmp/actual"
+printf '%s\n' shared.hpp >"$tmp/expected"
+in_repo "$sas" --rev HEAD --since "$first" -l 'int:.*' . >"$tmp/actual"
+same "--rev --since" "$tmp/expected" "$tmp/actual"
+
+# A revision, headers included, is searched as if it were checked out
+for rev in "$first" HEAD; do
+    rm -rf "$tmp/checkout"
+    mkdir "$tmp/checkout"
+    in_repo git archive "$rev" | tar -x -C "$tmp/checkout"
+    for follow in "" --follow-includes; do
+        (cd "$tmp/checkout" && "$sas" $follow -r 'int:.*' .) \
+            >"$tmp/expected"
+        in_repo "$sas" --rev "$rev" $follow 'int:.*' . >"$tmp/actual"
+        same "--rev $rev $follow" "$tmp/expected" "$tmp/actual"
+    done
+done
+
+echo "Testing: --shard and merge"
+for format in text json ndjson binary; do
+    "$SAS" --format $format -r "$QUERY" $CASES >"$tmp/single"
+    for count in 1 2 3 5; do
+        k=1
+        while [ $k -le $count ]; do
+            "$SAS" --format $format --shard $k/$count -r "$QUERY" $CASES \
+                >"$tmp/shard$k" &
+            k=$((k + 1))
+        done
+        wait
+        "$SAS" --merge "$tmp"/shard* >"$tmp/merged"
+        same "$count shards --format $format" "$tmp/single" "$tmp/merged"
+        rm -f "$tmp"/shard*
+    done
+done
+
+if [ $failures -ne 0 ]; then
+    echo "$failures failed"
+    exit 1
+fi
+echo "  Passed"
@@ -0,0 +1,64 @@
+/// Test the approximations of the --fast engine (see fast.hpp), where its
+/// matches differ from those of a search that parses the file
+
+#define DECLARE(name) int name
+DECLARE(hidden);
+
+#if 0
+int disabled;
+#else
+int enabled;
+#endif
+
+int lhs, rhs;
+
+void multiply() {
+    lhs * rhs;
+    undeclared(lhs);
+}
+
+struct Widget {
+    void draw(int times);
+    static int count;
+    int size;
+};
+
+void Widget::draw(int times) {
+    multiply();
+}
+
+int Widget::count;
+
+/// Code produced by a macro is not seen
+// .*:hidden
+//
+/// Both branches of an '#if' are searched
+// .*:disabled
+// 8
+//
+// .*:enabled
+// 10
+//
+/// An ambiguous statement is taken as a declaration, of a pointer
+// .*:rhs
+// 13 16
+//
+// lhs.*:rhs
+// 16
+//
+/// Calls are only found of functions declared in the file
+// :undeclared(...)
+//
+// :multiply()
+// 15 27
+//
+/// Out-of-line members are qualified by their class, like those declared
+/// in it. Other data members are not seen.
+// #Widget::.*:count
+// 22 30
+//
+// #Widget::void:draw(int:times)
+// 21 26
+//
+// .*:size
+//
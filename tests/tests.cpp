@@ -1,15 +1,25 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <vector>
 
-#include "boost/filesystem/path.hpp"
+#include "boost/filesystem.hpp"
 
+#include "ignore.hpp"
+#include "index.hpp"
+#include "lines.hpp"
+#include "output.hpp"
 #include "parser.hpp"
 #include "search.hpp"
 
-void test_case(const std::string& filename) {
-    boost::program_options::variables_map vm;
+/// Run 'check(statement, lines)' for each query in a case file: a '// '
+/// comment holding the search string, followed by a comment listing the
+/// lines of its expected matches
+template <typename Check>
+void for_each_query(const std::string& filename, Check check) {
     std::ifstream test_cases(filename);
 
     std::string line;
@@ -36,27 +46,472 @@ void test_case(const std::string& filename) {
         }
 
         std::cout << "Testing: " << statement << std::endl;
+        check(statement, matches);
+        std::cout << "  Passed" << std::endl;
+    }
+}
+
+void check_lines(const std::vector<match_t>& found,
+                 const std::vector<int>& matches) {
+    assert(found.size() == matches.size());
+    for (std::size_t s = 0; s < found.size(); ++s) {
+        assert(found[s].first.first == matches[s]);
+    }
+}
+
+/// Reads an output in order, asserting that it holds what is expected
+class OutputReader {
+public:
+    explicit OutputReader(std::string data) : m_data(std::move(data)) {}
+
+    void expect(const std::string& text) {
+        assert(m_data.compare(m_pos, text.size(), text) == 0);
+        m_pos += text.size();
+    }
+
+    long long number() {
+        char* end;
+        auto value = std::strtoll(m_data.c_str() + m_pos, &end, 10);
+        assert(end != m_data.c_str() + m_pos);
+        m_pos = end - m_data.c_str();
+        return value;
+    }
+
+    /// The rest of the line, without its newline
+    std::string line() {
+        auto end = m_data.find('\n', m_pos);
+        assert(end != std::string::npos);
+        auto line = m_data.substr(m_pos, end - m_pos);
+        m_pos = end + 1;
+        return line;
+    }
+
+    std::string json_string() {
+        expect("\"");
+        std::string str;
+        while (m_data.at(m_pos) != '"') {
+            char c = m_data[m_pos++];
+            if (c == '\\') {
+                c = m_data.at(m_pos++);
+                if (c == 'n') {
+                    c = '\n';
+                } else if (c == 'r') {
+                    c = '\r';
+                } else if (c == 't') {
+                    c = '\t';
+                } else if (c == 'u') {
+                    c = static_cast<char>(
+                        std::stoi(m_data.substr(m_pos, 4), nullptr, 16));
+                    m_pos += 4;
+                }
+            }
+            str.push_back(c);
+        }
+        ++m_pos;
+        return str;
+    }
+
+    /// '[start row,start column,end row,end column]' without the brackets
+    match_t json_range() {
+        match_t range;
+        range.first.first = number();
+        expect(",");
+        range.first.second = number();
+        expect(",");
+        range.second.first = number();
+        expect(",");
+        range.second.second = number();
+        return range;
+    }
+
+    std::string bytes(std::size_t size) {
+        assert(m_pos + size <= m_data.size());
+        auto bytes = m_data.substr(m_pos, size);
+        m_pos += size;
+        return bytes;
+    }
+
+    std::uint8_t uint8() { return bytes(1)[0]; }
+
+    std::uint32_t uint32() {
+        std::uint32_t value;
+        std::memcpy(&value, bytes(sizeof(value)).data(), sizeof(value));
+        return value;
+    }
+
+    bool at_end() const { return m_pos == m_data.size(); }
+
+private:
+    std::string m_data;
+    std::size_t m_pos = 0;
+};
+
+/// The output of a search of 'filename' given 'option', as sas writes it
+template <typename T>
+std::string format_output(const std::string& filename, const Term& term,
+                          const std::string& option, const T& value) {
+    boost::program_options::variables_map vm;
+    vm.insert(std::make_pair(
+        option, boost::program_options::variable_value(value, false)));
+    std::ostringstream out;
+    {
+        OutputSink sink(out, output_format(vm));
+        sink.write(format_matches(filename, compile_term(term), vm));
+    }
+    return out.str();
+}
+
+/// Read the matches back from each output format, checking that they are
+/// those found and that every format gives the same lines
+void test_formats(const std::string& filename, const Term& term,
+                  const std::vector<match_t>& found) {
+    using std::string;
+
+    OutputReader text(format_output(filename, term, "format", string("text")));
+    std::vector<string> lines;
+    for (const auto& match : found) {
+        assert(text.number() == match.first.first);
+        text.expect(":");
+        assert(text.number() == match.first.second);
+        text.expect(":");
+        lines.push_back(text.line());
+    }
+    assert(text.at_end());
+
+    OutputReader ndjson(
+        format_output(filename, term, "format", string("ndjson")));
+    for (std::size_t i = 0; i < found.size(); ++i) {
+        ndjson.expect("{\"file\":");
+        assert(ndjson.json_string() == filename);
+        ndjson.expect(",\"file_id\":0,\"query_id\":0,\"range\":[");
+        assert(ndjson.json_range() == found[i]);
+        ndjson.expect("],\"line\":");
+        assert(ndjson.json_string() == lines[i]);
+        ndjson.expect("}\n");
+    }
+    assert(ndjson.at_end());
+
+    OutputReader json(format_output(filename, term, "format", string("json")));
+    json.expect("[");
+    if (!found.empty()) {
+        json.expect("\n{\"file\":");
+        assert(json.json_string() == filename);
+        json.expect(",\"file_id\":0,\"matches\":[");
+        for (std::size_t i = 0; i < found.size(); ++i) {
+            json.expect(i == 0 ? "\n" : ",\n");
+            json.expect("{\"query_id\":0,\"range\":[");
+            assert(json.json_range() == found[i]);
+            json.expect("],\"line\":");
+            assert(json.json_string() == lines[i]);
+            json.expect("}");
+        }
+        json.expect("]}\n");
+    }
+    json.expect("]\n");
+    assert(json.at_end());
+
+    OutputReader binary(
+        format_output(filename, term, "format", string("binary")));
+    binary.expect("SASM");
+    assert(binary.uint32() == 1);
+    for (std::size_t i = 0; i < found.size(); ++i) {
+        if (i == 0) {
+            assert(binary.uint8() == 1);
+            assert(binary.uint32() == 0);
+            assert(binary.bytes(binary.uint32()) == filename);
+        }
+        assert(binary.uint8() == 2);
+        assert(binary.uint32() == 0);
+        assert(binary.uint32() == 0);
+        match_t range;
+        range.first.first = static_cast<std::int32_t>(binary.uint32());
+        range.first.second = static_cast<std::int32_t>(binary.uint32());
+        range.second.first = static_cast<std::int32_t>(binary.uint32());
+        range.second.second = static_cast<std::int32_t>(binary.uint32());
+        assert(range == found[i]);
+    }
+    assert(binary.at_end());
 
+    assert(format_output(filename, term, "files-with-matches", true) ==
+           (found.empty() ? "" : filename + "\n"));
+    assert(format_output(filename, term, "count", true) ==
+           filename + ":" + std::to_string(found.size()) + "\n");
+}
+
+/// The matches of 'filename' in the index in 'index_dir'
+std::vector<match_t> indexed_matches(const std::string& index_dir,
+                                     const std::string& filename,
+                                     const Term& term) {
+    for (const auto& file :
+         find_indexed_matches(index_dir, compile_term(term))) {
+        if (file.first == filename) {
+            return file.second;
+        }
+    }
+    return {};
+}
+
+void test_case(const std::string& filename, const std::string& index_dir) {
+    boost::program_options::variables_map vm;
+
+    boost::program_options::variables_map full_parse;
+    full_parse.insert(std::make_pair(
+        "full-parse", boost::program_options::variable_value(true, true)));
+    boost::program_options::variables_map fast;
+    fast.insert(std::make_pair(
+        "fast", boost::program_options::variable_value(true, true)));
+
+    for_each_query(filename, [&](const std::string& statement,
+                                 const std::vector<int>& matches) {
         auto term = parse_search_string(statement, vm);
         auto found = find_matches(filename, term, vm);
 
-        assert(found.size() == matches.size());
-        for (std::size_t s = 0; s < found.size(); ++s) {
-            assert(found[s].first.first == matches[s]);
-        }
+        // Skipping function bodies must not change the results
+        assert(found == find_matches(filename, term, full_parse));
 
-        std::cout << "  Passed" << std::endl;
+        // The lexer-only engine must agree with clang on these cases
+        assert(found == find_matches(filename, term, fast));
+
+        // A Searcher's matchers and caches must not carry anything over
+        // from one file to the next
+        sas::Searcher searcher(term, vm);
+        assert(found == searcher.search(filename));
+        assert(found == searcher.search(filename));
+
+        // The index must answer as a search of the file would
+        assert(found == indexed_matches(index_dir, filename, term));
+
+        test_formats(filename, term, found);
+
+        check_lines(found, matches);
+    });
+}
+
+/// The cases in tests/fast are where the lexer-only engine is approximate
+/// (see fast.hpp), so only its matches are checked
+void fast_test_case(const std::string& filename) {
+    boost::program_options::variables_map fast;
+    fast.insert(std::make_pair(
+        "fast", boost::program_options::variable_value(true, true)));
+
+    for_each_query(filename, [&](const std::string& statement,
+                                 const std::vector<int>& matches) {
+        auto term = parse_search_string(statement, fast);
+        check_lines(find_matches(filename, term, fast), matches);
+    });
+}
+
+/// The cases in tests/clang are where the --fast engine is approximate in
+/// ways it cannot test (e.g., it does not instantiate templates), so only
+/// the parse's matches are checked
+void clang_test_case(const std::string& filename) {
+    boost::program_options::variables_map vm;
+    boost::program_options::variables_map full_parse;
+    full_parse.insert(std::make_pair(
+        "full-parse", boost::program_options::variable_value(true, true)));
+
+    for_each_query(filename, [&](const std::string& statement,
+                                 const std::vector<int>& matches) {
+        auto term = parse_search_string(statement, vm);
+        auto found = find_matches(filename, term, vm);
+        assert(found == find_matches(filename, term, full_parse));
+        sas::Searcher searcher(term, vm);
+        assert(found == searcher.search(filename));
+        check_lines(found, matches);
+    });
+}
+
+void test_ignore() {
+    std::cout << "Testing: ignore files" << std::endl;
+
+    assert(glob_match("*.o", "a.o"));
+    assert(!glob_match("*.o", "dir/a.o"));
+    assert(glob_match("**/x", "a/b/x"));
+    assert(glob_match("**/x", "x"));
+    assert(glob_match("a/**", "a/b/c"));
+    assert(glob_match("a/**/b", "a/b"));
+    assert(glob_match("a/**/b", "a/x/y/b"));
+    assert(!glob_match("a?b", "a/b"));
+    assert(glob_match("[a-c]x", "bx"));
+    assert(!glob_match("[!a-c]x", "bx"));
+    assert(glob_match("\\*", "*"));
+    assert(!glob_match("\\*", "a"));
+
+    IgnoreRule rule;
+    assert(!parse_ignore_rule("", rule));
+    assert(!parse_ignore_rule("# comment", rule));
+    assert(parse_ignore_rule("\\#hash", rule) && rule.pattern == "#hash");
+    assert(parse_ignore_rule("trailing  ", rule) &&
+           rule.pattern == "trailing");
+    assert(parse_ignore_rule("!keep.o", rule) && rule.negated &&
+           rule.pattern == "keep.o" && !rule.anchored);
+    assert(parse_ignore_rule("build/", rule) && rule.directory_only &&
+           rule.pattern == "build" && !rule.anchored && !rule.negated);
+    assert(parse_ignore_rule("/top.h", rule) && rule.anchored &&
+           rule.pattern == "top.h");
+    assert(parse_ignore_rule("doc/*.txt", rule) && rule.anchored);
+
+    IgnoreList top;
+    top.base = "/r";
+    for (auto line : {"*.o", "!keep.o", "build/", "/top.h", "doc/*.txt",
+                      "**/gen/*.cpp"}) {
+        assert(parse_ignore_rule(line, rule));
+        top.rules.push_back(rule);
     }
+    assert(is_ignored(&top, "/r/a.o", "a.o", false));
+    assert(!is_ignored(&top, "/r/sub/keep.o", "keep.o", false));
+    assert(is_ignored(&top, "/r/sub/build", "build", true));
+    assert(!is_ignored(&top, "/r/sub/build", "build", false));
+    assert(is_ignored(&top, "/r/top.h", "top.h", false));
+    assert(!is_ignored(&top, "/r/sub/top.h", "top.h", false));
+    assert(is_ignored(&top, "/r/doc/a.txt", "a.txt", false));
+    assert(!is_ignored(&top, "/r/sub/doc/a.txt", "a.txt", false));
+    assert(is_ignored(&top, "/r/gen/a.cpp", "a.cpp", false));
+    assert(is_ignored(&top, "/r/x/gen/a.cpp", "a.cpp", false));
+
+    // A deeper ignore file takes precedence
+    auto parent = std::make_shared<IgnoreList>(top);
+    IgnoreList sub;
+    sub.base = "/r/sub";
+    sub.parent = parent;
+    assert(parse_ignore_rule("!a.o", rule));
+    sub.rules.push_back(rule);
+    assert(!is_ignored(&sub, "/r/sub/a.o", "a.o", false));
+    assert(is_ignored(&sub, "/r/sub/b.o", "b.o", false));
+
+    std::cout << "  Passed" << std::endl;
+}
+
+void test_lines() {
+    std::cout << "Testing: line index" << std::endl;
+
+    // Lines end with '\n', "\r\n", '\r' or "\n\r", as clang counts them
+    LineIndex lines("a\nb\r\nc\rd\n\re\n");
+    assert(lines.size() == 5);
+    assert(lines.start_of(4) == 7 && lines.start_of(5) == 10);
+    assert(lines.line_of(0) == 1 && lines.line_of(4) == 2);
+    assert(lines.line_of(5) == 3 && lines.line_of(9) == 4);
+    assert(lines.line(2) == "b" && lines.line(3) == "c");
+    assert(lines.line(4) == "d" && lines.line(5) == "e");
+    assert(lines.lines(2, 4) == "b\r\nc\rd");
+
+    LineIndex unterminated("x\ny");
+    assert(unterminated.size() == 2 && unterminated.line(2) == "y");
+
+    std::cout << "  Passed" << std::endl;
+}
+
+/// A match on the first column of 'line', ending on 'last_line'
+match_t at_line(int line, int last_line = 0) {
+    return {{line, 1}, {last_line ? last_line : line, 2}};
+}
+
+/// The matches written in 'source' with the given context
+std::string context_output(const SourceContext& context,
+                           llvm::StringRef source,
+                           const std::vector<match_t>& matches,
+                           OutputFormat format = OutputFormat::Text) {
+    MatchWriter writer(format, "file", 0, context);
+    for (const auto& match : matches) {
+        writer.write_in_source(match, source, 0, {});
+    }
+    return writer.finish();
+}
+
+void test_context() {
+    std::cout << "Testing: -A, -B, -C and --full-range" << std::endl;
+
+    const char* source = "l1\nl2\nl3\nl4\nl5\nl6\nl7\nl8\nl9\n";
+    SourceContext around;
+    around.before = around.after = 1;
+    assert(context_output(around, source, {at_line(3), at_line(7)}) ==
+           "2-l2\n3:1:l3\n4-l4\n--\n6-l6\n7:1:l7\n8-l8\n");
+    assert(context_output(around, source, {at_line(3), at_line(5)}) ==
+           "2-l2\n3:1:l3\n4-l4\n5:1:l5\n6-l6\n");
+    assert(context_output(around, source, {at_line(1), at_line(9)}) ==
+           "1:1:l1\n2-l2\n--\n8-l8\n9:1:l9\n");
+
+    SourceContext after;
+    after.after = 2;
+    assert(context_output(after, source, {at_line(3), at_line(4)}) ==
+           "3:1:l3\n4:1:l4\n5-l5\n6-l6\n");
+
+    SourceContext before;
+    before.before = 1;
+    assert(context_output(before, source, {at_line(3), at_line(6)}) ==
+           "2-l2\n3:1:l3\n--\n5-l5\n6:1:l6\n");
+    assert(context_output(before, source, {at_line(3), at_line(5)}) ==
+           "2-l2\n3:1:l3\n4-l4\n5:1:l5\n");
+
+    // A match before the last one starts a new group, with all its context
+    assert(context_output(around, source, {at_line(7), at_line(3)}) ==
+           "6-l6\n7:1:l7\n8-l8\n--\n2-l2\n3:1:l3\n4-l4\n");
+
+    SourceContext full;
+    full.full_range = true;
+    assert(context_output(full, source, {at_line(3, 5)}) ==
+           "3:1:l3\n4:l4\n5:l5\n");
+    full.after = 1;
+    assert(context_output(full, source, {at_line(3, 5), at_line(8)}) ==
+           "3:1:l3\n4:l4\n5:l5\n6-l6\n--\n8:1:l8\n9-l9\n");
+
+    // Other formats give each match its own context
+    assert(context_output(around, source, {at_line(3)},
+                          OutputFormat::NDJson)
+               .find("\"line\":\"l3\",\"before\":\"l2\",\"after\":\"l4\"") !=
+           std::string::npos);
+
+    // Lines ending in '\r' are split as clang splits them
+    assert(context_output(around, "l1\r\nl2\rl3\n", {at_line(2)}) ==
+           "1-l1\n2:1:l2\n3-l3\n");
+
+    // The context of a match in one buffer ends before one in another
+    std::string first = "a1\na2\na3\na4\n", second = "b1\nb2\n";
+    MatchWriter writer(OutputFormat::Text, "file", 0, after);
+    writer.write_in_source(at_line(3), first, 0, {});
+    writer.write_in_source(at_line(1), second, 0, {});
+    assert(writer.finish() == "3:1:a3\n4-a4\n--\n1:1:b1\n2-b2\n");
+
+    std::cout << "  Passed" << std::endl;
 }
 
 namespace fs = boost::filesystem;
 
 int main() {
+    test_ignore();
+    test_lines();
+    test_context();
+
     fs::directory_iterator end_iter;
+    std::vector<std::string> cases;
     for (fs::directory_iterator dir_itr("tests/cases"); dir_itr != end_iter;
          ++dir_itr) {
+        cases.push_back(dir_itr->path().string());
+    }
+
+    boost::program_options::variables_map vm;
+    auto index_dir =
+        (fs::temp_directory_path() / fs::unique_path("sas-index-%%%%-%%%%"))
+            .string();
+    build_index(index_dir, cases, vm);
+
+    for (const auto& path : cases) {
+        std::cout << "Case: " << path << std::endl;
+        test_case(path, index_dir);
+    }
+    fs::remove_all(index_dir);
+
+    for (fs::directory_iterator dir_itr("tests/fast"); dir_itr != end_iter;
+         ++dir_itr) {
+        std::string path = dir_itr->path().string();
+        std::cout << "Case: " << path << std::endl;
+        fast_test_case(path);
+    }
+
+    for (fs::directory_iterator dir_itr("tests/clang"); dir_itr != end_iter;
+         ++dir_itr) {
         std::string path = dir_itr->path().string();
         std::cout << "Case: " << path << std::endl;
-        test_case(path);
+        clang_test_case(path);
     }
 }